@@ -0,0 +1,628 @@
+/*
+	Host benchmark for the Elster codec.
+
+	Measures the time and the heap allocations per operation of decoding
+	(ElsterRawToReceivePacket, ElsterPacketName, SetValueType), parsing
+	(TranslateString), encoding (ElsterPrepareSendPacket,
+	ElsterSetValueDefault) and the table lookups. The frames are a synthetic
+	mix of the traffic the gateway sees: responses to 0x680, broadcasts,
+	reads, writes and indexes missing from the table, with short and 0xfa
+	extended indexes. The corpus is generated from a fixed seed, so runs
+	are comparable as long as the table does not change.
+
+	The results are written as JSON to stdout (or to the file given with -o).
+	Exits with 1 if a frame does not decode to what it was built from.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "elster.h"
+
+#define CORPUS_FRAMES   8192
+#define VALUE_SAMPLES   4096
+#define MISS_SAMPLES    4096
+#define SAMPLES         5       // measurements per case, the median is reported
+#define MIN_SAMPLE_NS   20e6    // a measurement runs the data set at least this long
+
+/*
+	Allocation counting: malloc and friends are replaced for the whole
+	process and forward to glibc. Only calls made while s_count is set are
+	counted, that is inside a measurement.
+*/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int s_count;
+static uint64_t s_allocs;
+static uint64_t s_alloc_bytes;
+
+void *malloc(size_t size)
+{
+	if (s_count) { s_allocs++; s_alloc_bytes += size; }
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	if (s_count) { s_allocs++; s_alloc_bytes += n * size; }
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (s_count) { s_allocs++; s_alloc_bytes += size; }
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+/*
+	Corpus
+*/
+
+typedef struct {
+	uint16_t sender;
+	uint8_t data[7];
+	uint16_t index;     // expected decode
+	uint16_t value;
+	uint8_t type;       // ElsterValueType of the table row
+	bool known;         // index is in the table
+} Frame;
+
+typedef struct {
+	const Frame **frames;
+	uint32_t count;
+} FrameSet;
+
+typedef struct {
+	uint16_t index;
+	uint8_t type;
+} Row;
+
+typedef struct {
+	uint32_t responses;
+	uint32_t broadcasts;
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t unknown;
+	uint32_t shortIndex;
+	uint32_t extendedIndex;
+} CorpusStats;
+
+static const uint16_t s_devices[] = { 0x180, 0x301, 0x480, 0x500, 0x514, 0x601 };
+static const uint16_t s_errors[] = { 0x0002, 0x0004, 0x000a, 0x0010, 0x001a, 0x0020 };
+
+// ElsterValueType names for the results, ElsterTypeStr in elster.c does
+// not cover all types
+static const char * const s_typeNames[] = {
+	"et_default", "et_dec_val", "et_cent_val", "et_mil_val", "et_byte",
+	"et_bool", "et_little_bool", "et_double_val", "et_triple_val",
+	"et_little_endian", "et_betriebsart", "et_zeit", "et_datum",
+	"et_time_domain", "et_dev_nr", "et_err_nr", "et_dev_id"
+};
+
+static uint32_t s_seed = 0x2545f491;
+
+static Row *s_rows;
+static uint32_t s_rowCount;
+static Row *s_shortRows;
+static uint32_t s_shortCount;
+static Row *s_extRows;
+static uint32_t s_extCount;
+static char (*s_names)[ELSTER_NAME_LEN];
+
+static Frame s_corpus[CORPUS_FRAMES];
+static FrameSet s_mixed, s_short, s_extended;
+static CorpusStats s_stats;
+static ElsterPacketReceive s_decoded[CORPUS_FRAMES];
+
+static volatile uint32_t s_sink;
+
+static uint32_t rnd(void)
+{
+	// xorshift32
+	s_seed ^= s_seed << 13;
+	s_seed ^= s_seed >> 17;
+	s_seed ^= s_seed << 5;
+	return s_seed;
+}
+
+// A raw value as a device would send it for the type
+static uint16_t gen_value(uint8_t type)
+{
+	if (rnd() % 50 == 0) return 0x8000; // not available
+
+	switch (type)
+	{
+		case et_dec_val:
+			return (uint16_t)(int16_t)((int)(rnd() % 800) - 200);
+		case et_cent_val:
+		case et_mil_val:
+			return (uint16_t)(int16_t)((int)(rnd() % 20000) - 5000);
+		case et_byte:
+			return rnd() % 256;
+		case et_bool:
+			return rnd() % 2;
+		case et_little_bool:
+			return (rnd() % 2) << 8;
+		case et_little_endian:
+			return (rnd() % 256) << 8;
+		case et_betriebsart:
+			return (rnd() % 6) << 8;
+		case et_zeit:
+			return (rnd() % 24) | ((rnd() % 60) << 8);
+		case et_datum:
+			return ((1 + rnd() % 28) << 8) | (1 + rnd() % 12);
+		case et_time_domain:
+			return rnd() % 2 ? 0x8080 : (((rnd() % 48) << 8) | (48 + rnd() % 48));
+		case et_err_nr:
+			return s_errors[rnd() % (sizeof(s_errors) / sizeof(s_errors[0]))];
+		default:
+			return rnd() % 0x10000;
+	}
+}
+
+static uint16_t gen_unknown_index(void)
+{
+	uint16_t index;
+	do {
+		index = rnd() % 0x10000;
+	} while (GetElsterTableIndex(index) >= 0);
+	return index;
+}
+
+// Rows are drawn 40% from the short index form, like a typical poll list
+// of temperatures and switches next to the extended parameters
+static const Row * gen_row(void)
+{
+	if (s_shortCount && rnd() % 100 < 40) return &s_shortRows[rnd() % s_shortCount];
+	return &s_extRows[rnd() % s_extCount];
+}
+
+static void build_frame(Frame *f, uint16_t sender, uint16_t receiver, ElsterPacketType type, uint16_t index, uint16_t value)
+{
+	ElsterPacketSend p = { receiver, type, index };
+	f->sender = sender;
+	f->index = index;
+	ElsterPrepareSendPacket(7, f->data, p);
+	if (type != ELSTER_PT_READ) {
+		ElsterSetValueDefault(7, f->data, value);
+		f->value = value;
+	} else {
+		f->value = 0;
+	}
+}
+
+static void load_table(void)
+{
+	ElsterIndex entry;
+	char name[ELSTER_NAME_LEN];
+
+	s_rows = __libc_malloc(sizeof(Row) * 0x10000);
+	s_shortRows = __libc_malloc(sizeof(Row) * 0x10000);
+	s_extRows = __libc_malloc(sizeof(Row) * 0x10000);
+	s_names = __libc_malloc(sizeof(*s_names) * 0x10000);
+
+	while (s_rowCount < 0x10000 && GetElsterTableEntry(s_rowCount, &entry, name)) {
+		Row r = { entry.Index, (uint8_t)entry.Type };
+		strcpy(s_names[s_rowCount], name);
+		s_rows[s_rowCount++] = r;
+		if (r.index < 0xfa) s_shortRows[s_shortCount++] = r;
+		else s_extRows[s_extCount++] = r;
+	}
+}
+
+static void build_corpus(void)
+{
+	for (uint32_t i = 0; i < CORPUS_FRAMES; i++) {
+		Frame *f = &s_corpus[i];
+		uint16_t device = s_devices[rnd() % (sizeof(s_devices) / sizeof(s_devices[0]))];
+		uint32_t kind = rnd() % 100;
+		const Row *row = gen_row();
+
+		f->known = true;
+		f->type = row->type;
+		if (kind < 55) {
+			build_frame(f, device, 0x680, ELSTER_PT_RESPONSE, row->index, gen_value(row->type));
+			s_stats.responses++;
+		} else if (kind < 75) {
+			build_frame(f, 0x180, 0x000, ELSTER_PT_WRITE, row->index, gen_value(row->type));
+			f->data[1] = 0x79;
+			s_stats.broadcasts++;
+		} else if (kind < 90) {
+			build_frame(f, 0x680, device, ELSTER_PT_READ, row->index, 0);
+			s_stats.reads++;
+		} else if (kind < 95) {
+			build_frame(f, 0x680, 0x480, ELSTER_PT_WRITE, row->index, gen_value(row->type));
+			s_stats.writes++;
+		} else {
+			build_frame(f, device, 0x680, ELSTER_PT_RESPONSE, gen_unknown_index(), rnd() % 0x10000);
+			f->known = false;
+			f->type = et_default;
+			s_stats.unknown++;
+		}
+
+		s_mixed.frames[s_mixed.count++] = f;
+		if (f->data[2] == 0xfa) {
+			s_extended.frames[s_extended.count++] = f;
+			s_stats.extendedIndex++;
+		} else {
+			s_short.frames[s_short.count++] = f;
+			s_stats.shortIndex++;
+		}
+	}
+}
+
+// Every frame decodes to the index and value it was built from
+static int check_corpus(void)
+{
+	int errors = 0;
+
+	for (uint32_t i = 0; i < CORPUS_FRAMES; i++) {
+		const Frame *f = &s_corpus[i];
+		ElsterPacketReceive p = ElsterRawToReceivePacket(f->sender, 7, f->data);
+		bool known = p.tableIndex != ELSTER_NO_TABLE_INDEX;
+		if (p.index != f->index || p.value != f->value || known != f->known ||
+			ElsterPacketValueType(&p) != f->type) {
+			if (errors < 10) {
+				fprintf(stderr, "MISMATCH frame %u: index 0x%04x/0x%04x value 0x%04x/0x%04x\n",
+					(unsigned)i, f->index, p.index, f->value, p.value);
+			}
+			errors++;
+		}
+		s_decoded[i] = p;
+	}
+	return errors;
+}
+
+/*
+	Cases, each run processes its data set once and returns the number of
+	operations
+*/
+
+typedef uint32_t (*RunFn)(const void *arg);
+
+static uint32_t run_decode(const void *arg)
+{
+	const FrameSet *set = arg;
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < set->count; i++) {
+		const Frame *f = set->frames[i];
+		ElsterPacketReceive p = ElsterRawToReceivePacket(f->sender, 7, f->data);
+		sink += p.tableIndex + p.value;
+	}
+	s_sink = sink;
+	return set->count;
+}
+
+static uint32_t run_name(const void *arg)
+{
+	(void)arg;
+	char name[ELSTER_NAME_LEN];
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < CORPUS_FRAMES; i++) {
+		sink += ElsterPacketName(&s_decoded[i], name)[0];
+	}
+	s_sink = sink;
+	return CORPUS_FRAMES;
+}
+
+static uint32_t run_value(const void *arg)
+{
+	(void)arg;
+	char val[64];
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < CORPUS_FRAMES; i++) {
+		ElsterPacketValue(&s_decoded[i], val);
+		sink += val[0];
+	}
+	s_sink = sink;
+	return CORPUS_FRAMES;
+}
+
+// What mqtt_pub does with a received frame
+static uint32_t run_publish(const void *arg)
+{
+	(void)arg;
+	char name[ELSTER_NAME_LEN];
+	char val[64];
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < CORPUS_FRAMES; i++) {
+		const Frame *f = &s_corpus[i];
+		ElsterPacketReceive p = ElsterRawToReceivePacket(f->sender, 7, f->data);
+		if (p.tableIndex == ELSTER_NO_TABLE_INDEX) continue;
+		ElsterPacketName(&p, name);
+		ElsterPacketValue(&p, val);
+		sink += name[0] + val[0];
+	}
+	s_sink = sink;
+	return CORPUS_FRAMES;
+}
+
+typedef struct {
+	uint8_t type;
+	uint16_t values[VALUE_SAMPLES];
+	char strings[VALUE_SAMPLES][64];
+} TypeSet;
+
+static TypeSet s_types[et_dev_id + 1];
+
+static void build_type_sets(void)
+{
+	for (uint8_t type = et_default; type <= et_dev_id; type++) {
+		TypeSet *t = &s_types[type];
+		t->type = type;
+		for (uint32_t i = 0; i < VALUE_SAMPLES; i++) {
+			t->values[i] = gen_value(type);
+			SetValueType(t->strings[i], type, t->values[i]);
+		}
+	}
+}
+
+static uint32_t run_format(const void *arg)
+{
+	const TypeSet *t = arg;
+	char val[64];
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < VALUE_SAMPLES; i++) {
+		SetValueType(val, t->type, t->values[i]);
+		sink += val[0];
+	}
+	s_sink = sink;
+	return VALUE_SAMPLES;
+}
+
+static uint32_t run_translate(const void *arg)
+{
+	const TypeSet *t = arg;
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < VALUE_SAMPLES; i++) {
+		sink += TranslateString(t->strings[i], t->type);
+	}
+	s_sink = sink;
+	return VALUE_SAMPLES;
+}
+
+static uint32_t run_encode(const void *arg)
+{
+	const FrameSet *set = arg;
+	uint8_t data[7];
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < set->count; i++) {
+		const Frame *f = set->frames[i];
+		ElsterPacketSend p = { 0x480, ELSTER_PT_WRITE, f->index };
+		ElsterPrepareSendPacket(7, data, p);
+		ElsterSetValueDefault(7, data, f->value);
+		sink += data[2] + data[4] + data[6];
+	}
+	s_sink = sink;
+	return set->count;
+}
+
+static uint16_t s_missIndexes[MISS_SAMPLES];
+static char s_missNames[MISS_SAMPLES][ELSTER_NAME_LEN];
+
+static void build_lookup_sets(void)
+{
+	for (uint32_t i = 0; i < MISS_SAMPLES; i++) {
+		s_missIndexes[i] = gen_unknown_index();
+		// close to a real name, the usual typo in a wp/get or wp/write topic
+		snprintf(s_missNames[i], ELSTER_NAME_LEN, "%.40s_X", s_names[rnd() % s_rowCount]);
+	}
+}
+
+static uint32_t run_index_hit(const void *arg)
+{
+	(void)arg;
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < s_rowCount; i++) {
+		sink += GetElsterTableIndex(s_rows[i].index);
+	}
+	s_sink = sink;
+	return s_rowCount;
+}
+
+static uint32_t run_index_miss(const void *arg)
+{
+	(void)arg;
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < MISS_SAMPLES; i++) {
+		sink += GetElsterTableIndex(s_missIndexes[i]);
+	}
+	s_sink = sink;
+	return MISS_SAMPLES;
+}
+
+static uint32_t run_name_hit(const void *arg)
+{
+	(void)arg;
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < s_rowCount; i++) {
+		sink += GetElsterTableIndexFromString(s_names[i]);
+	}
+	s_sink = sink;
+	return s_rowCount;
+}
+
+static uint32_t run_name_miss(const void *arg)
+{
+	(void)arg;
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < MISS_SAMPLES; i++) {
+		sink += GetElsterTableIndexFromString(s_missNames[i]);
+	}
+	s_sink = sink;
+	return MISS_SAMPLES;
+}
+
+static uint32_t run_entry(const void *arg)
+{
+	(void)arg;
+	ElsterIndex entry;
+	char name[ELSTER_NAME_LEN];
+	uint32_t sink = 0;
+	for (uint32_t i = 0; i < s_rowCount; i++) {
+		GetElsterTableEntry(i, &entry, name);
+		sink += name[0] + entry.Index;
+	}
+	s_sink = sink;
+	return s_rowCount;
+}
+
+/*
+	Measurement
+*/
+
+typedef struct {
+	double ns;          // median
+	double nsMin;
+	double allocs;      // per operation
+	double allocBytes;
+	uint64_t ops;       // per measurement
+} Result;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static Result measure(RunFn fn, const void *arg)
+{
+	Result r = { 0 };
+	double ns[SAMPLES];
+	uint32_t loops = 1;
+
+	// warm up and find the number of runs that takes MIN_SAMPLE_NS
+	for (;;) {
+		double start = now_ns();
+		for (uint32_t l = 0; l < loops; l++) fn(arg);
+		if (now_ns() - start >= MIN_SAMPLE_NS || loops >= (1u << 24)) break;
+		loops *= 2;
+	}
+
+	for (int s = 0; s < SAMPLES; s++) {
+		uint64_t ops = 0;
+		s_allocs = 0;
+		s_alloc_bytes = 0;
+		s_count = 1;
+		double start = now_ns();
+		for (uint32_t l = 0; l < loops; l++) ops += fn(arg);
+		double elapsed = now_ns() - start;
+		s_count = 0;
+		ns[s] = elapsed / ops;
+		r.ops = ops;
+		r.allocs = (double)s_allocs / ops;
+		r.allocBytes = (double)s_alloc_bytes / ops;
+	}
+	qsort(ns, SAMPLES, sizeof(ns[0]), cmp_double);
+	r.ns = ns[SAMPLES / 2];
+	r.nsMin = ns[0];
+	return r;
+}
+
+static FILE *s_out;
+static int s_results;
+
+static void result(const char *group, const char *name, RunFn fn, const void *arg)
+{
+	Result r = measure(fn, arg);
+	fprintf(s_out, "%s\n    {\"group\": \"%s\", \"case\": \"%s\", \"ops\": %llu, "
+		"\"ns_per_op\": %.2f, \"ns_per_op_min\": %.2f, "
+		"\"allocs_per_op\": %.3f, \"alloc_bytes_per_op\": %.1f}",
+		s_results++ ? "," : "", group, name, (unsigned long long)r.ops,
+		r.ns, r.nsMin, r.allocs, r.allocBytes);
+	fflush(s_out);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	s_out = stdout;
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			s_out = fopen(optarg, "w");
+			if (s_out == NULL) {
+				perror(optarg);
+				return 2;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-o results.json]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	static const Frame *mixed[CORPUS_FRAMES], *shortIdx[CORPUS_FRAMES], *extended[CORPUS_FRAMES];
+	s_mixed.frames = mixed;
+	s_short.frames = shortIdx;
+	s_extended.frames = extended;
+
+	load_table();
+	build_corpus();
+	build_type_sets();
+	build_lookup_sets();
+	int errors = check_corpus();
+
+	fprintf(s_out, "{\n  \"benchmark\": \"elster_codec\",\n");
+	fprintf(s_out, "  \"compiler\": \"%s\",\n", __VERSION__);
+	fprintf(s_out, "  \"table\": {\"rows\": %u, \"short_index\": %u, \"extended_index\": %u},\n",
+		(unsigned)s_rowCount, (unsigned)s_shortCount, (unsigned)s_extCount);
+	fprintf(s_out, "  \"corpus\": {\"frames\": %u, \"responses\": %u, \"broadcasts\": %u, \"reads\": %u, "
+		"\"writes\": %u, \"unknown\": %u, \"short_index\": %u, \"extended_index\": %u},\n",
+		CORPUS_FRAMES, (unsigned)s_stats.responses, (unsigned)s_stats.broadcasts,
+		(unsigned)s_stats.reads, (unsigned)s_stats.writes, (unsigned)s_stats.unknown,
+		(unsigned)s_stats.shortIndex, (unsigned)s_stats.extendedIndex);
+	fprintf(s_out, "  \"mismatches\": %d,\n  \"results\": [", errors);
+
+	result("decode", "mixed", run_decode, &s_mixed);
+	result("decode", "short", run_decode, &s_short);
+	result("decode", "extended", run_decode, &s_extended);
+	result("decode", "name", run_name, NULL);
+	result("decode", "value", run_value, NULL);
+	result("decode", "publish", run_publish, NULL);
+
+	result("encode", "mixed", run_encode, &s_mixed);
+	result("encode", "short", run_encode, &s_short);
+	result("encode", "extended", run_encode, &s_extended);
+
+	for (uint8_t type = et_default; type <= et_dev_id; type++) {
+		result("format", s_typeNames[type], run_format, &s_types[type]);
+	}
+	for (uint8_t type = et_default; type <= et_dev_id; type++) {
+		result("translate", s_typeNames[type], run_translate, &s_types[type]);
+	}
+
+	result("lookup", "index_hit", run_index_hit, NULL);
+	result("lookup", "index_miss", run_index_miss, NULL);
+	result("lookup", "name_hit", run_name_hit, NULL);
+	result("lookup", "name_miss", run_name_miss, NULL);
+	result("lookup", "entry", run_entry, NULL);
+
+	fprintf(s_out, "\n  ]\n}\n");
+	if (s_out != stdout) fclose(s_out);
+
+	return errors ? 1 : 0;
+}
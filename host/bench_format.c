@@ -0,0 +1,174 @@
+/*
+	Host micro-benchmark for SetValueType().
+
+	Compares the integer only formatter in elster.c against the former
+	sprintf based implementation (LegacySetValueType below) for every
+	ElsterValueType and every 16 bit raw value. Fails if any output differs.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "elster.h"
+#include "elsterTable.inc"
+
+#define High(A)     (sizeof(A)/sizeof(A[0]) - 1)
+#define ROUNDS      20
+
+// SetValueType() as it was before the integer formatter
+static void LegacySetValueType(char * Val, uint8_t Type, uint16_t Value)
+{
+   if (Value == 0x8000)
+     strcpy(Val, "not available");
+   else
+   switch (Type)
+   {
+     case et_byte:
+       sprintf(Val, "%d", (uint8_t)Value);
+       break;
+
+     case et_dec_val:
+       sprintf(Val, "%.1f", ((double)((int16_t)Value)) / 10.0);
+       break;
+
+     case et_cent_val:
+       sprintf(Val, "%.2f", ((double)((int16_t)Value)) / 100.0);
+       break;
+
+     case et_mil_val:
+       sprintf(Val, "%.3f", ((double)((int16_t)Value)) / 1000.0);
+       break;
+
+     case et_little_endian:
+       sprintf(Val, "%d", (Value >> 8) + 256*(Value & 0xff));
+       break;
+
+     case et_little_bool:
+       if (Value == 0x0100)
+         strcpy(Val, "1");
+       else
+         strcpy(Val, "0");
+       break;
+
+     case et_bool:
+       if (Value == 0x0001)
+         strcpy(Val, "1");
+       else
+         strcpy(Val, "0");
+       break;
+
+     case et_betriebsart:
+       if ((Value & 0xff) == 0 && (Value >> 8) <= (int) High(BetriebsartList))
+         strcpy(Val, BetriebsartList[Value >> 8].Name);
+       else
+         strcpy(Val, "?");
+       break;
+
+     case et_zeit:
+       sprintf(Val, "%2.2d:%2.2d", Value & 0xff, Value >> 8);
+       break;
+
+     case et_datum:
+       sprintf(Val, "%2.2d.%2.2d.", Value >> 8, Value & 0xff);
+       break;
+
+     case et_time_domain:
+       if (Value & 0x8080)
+         strcpy(Val, "not used time domain");
+       else
+         sprintf(Val, "%2.2d:%2.2d-%2.2d:%2.2d",
+                 (Value >> 8) / 4, 15*((Value >> 8) % 4),
+                 (Value & 0xff) / 4, 15*(Value % 4));
+       break;
+
+     case et_dev_nr:
+       if (Value >= 0x80)
+         strcpy(Val, "--");
+       else
+         sprintf(Val, "%d", Value + 1);
+       break;
+
+     case et_dev_id:
+       sprintf(Val, "%d-%2.2d", (Value >> 8), Value & 0xff);
+       break;
+
+     case et_err_nr:
+     {
+       int idx = -1;
+       for (unsigned i = 0; i <= High(ErrorList); i++)
+         if (ErrorList[i].Index == Value)
+         {
+           idx = i;
+           break;
+         }
+       if (idx >= 0)
+         strcpy(Val, ErrorList[idx].Name);
+       else
+         sprintf(Val, "ERR %d", Value);
+       break;
+     }
+
+     case et_default:
+     default:
+       sprintf(Val, "%d", (signed short)Value);
+       break;
+   }
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double bench(void (*fn)(char *, uint8_t, uint16_t), uint8_t type)
+{
+	char val[64];
+	volatile char sink = 0;
+
+	double start = now_ns();
+	for (int r = 0; r < ROUNDS; r++) {
+		for (uint32_t v = 0; v <= 0xffff; v++) {
+			fn(val, type, (uint16_t)v);
+			sink ^= val[0];
+		}
+	}
+	(void)sink;
+	return (now_ns() - start) / (ROUNDS * 0x10000);
+}
+
+int main(void)
+{
+	int errors = 0;
+	char expected[64];
+	char actual[64];
+
+	for (uint8_t type = et_default; type <= et_dev_id; type++) {
+		for (uint32_t v = 0; v <= 0xffff; v++) {
+			LegacySetValueType(expected, type, (uint16_t)v);
+			SetValueType(actual, type, (uint16_t)v);
+			if (strcmp(expected, actual) != 0) {
+				if (errors < 10) {
+					printf("MISMATCH type=%d value=0x%04x expected=[%s] actual=[%s]\n",
+						type, (unsigned)v, expected, actual);
+				}
+				errors++;
+			}
+		}
+	}
+
+	printf("%-18s %12s %12s %8s\n", "type", "sprintf ns", "integer ns", "speedup");
+	for (uint8_t type = et_default; type <= et_dev_id; type++) {
+		double legacy = bench(LegacySetValueType, type);
+		double current = bench(SetValueType, type);
+		printf("%-18d %12.1f %12.1f %7.1fx\n", type, legacy, current, legacy / current);
+	}
+
+	printf("%d mismatches\n", errors);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/*
+	Host benchmark for the hand-over of received MQTT messages from the
+	MQTT client task to mqtt_sub_task.
+
+	A producer thread plays the MQTT client task and a consumer thread
+	mqtt_sub_task. Both ways are measured with the same queue depth:
+
+	  by value  MQTT_t built on the stack, copied into the queue and out
+	            again (as before the message pool)
+	  pool      msg_pool_take() copies once into a pool buffer, the queue
+	            carries the pointer
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "mqtt.h"
+#include "msg_pool.h"
+
+#define MESSAGES 2000000
+
+static const char *s_topics[] = {
+	"wp/write/PROGRAMMSCHALTER",
+	"wp/get/AUSSENTEMP",
+	"wp/write/UHRZEIT",
+	"wp/poll/set",
+};
+static const char *s_data[] = {
+	"3",
+	"",
+	"12:30",
+	"0x500,AUSSENTEMP,30,600,3,2,0",
+};
+#define NTOPICS (sizeof(s_topics) / sizeof(s_topics[0]))
+
+static QueueHandle_t s_queue;
+static uint32_t s_checksum;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The former mqtt_sub_handler()
+static void *value_producer(void *arg)
+{
+	for (int i = 0; i < MESSAGES; i++) {
+		const char *topic = s_topics[i % NTOPICS];
+		const char *data = s_data[i % NTOPICS];
+		int topic_len = strlen(topic);
+		int data_len = strlen(data);
+		MQTT_t mqttBuf;
+		mqttBuf.topic_type = SUBSCRIBE;
+		mqttBuf.topic_len = topic_len;
+		memcpy(mqttBuf.topic, topic, topic_len);
+		mqttBuf.topic[topic_len] = 0;
+		mqttBuf.data_len = data_len;
+		memcpy(mqttBuf.data, data, data_len);
+		mqttBuf.data[data_len] = 0;
+		xQueueSend(s_queue, &mqttBuf, portMAX_DELAY);
+	}
+	return NULL;
+}
+
+static void *value_consumer(void *arg)
+{
+	MQTT_t mqttBuf;
+	for (int i = 0; i < MESSAGES; i++) {
+		xQueueReceive(s_queue, &mqttBuf, portMAX_DELAY);
+		s_checksum += mqttBuf.topic[mqttBuf.topic_len - 1] + mqttBuf.data_len;
+	}
+	return NULL;
+}
+
+static void *pool_producer(void *arg)
+{
+	for (int i = 0; i < MESSAGES; i++) {
+		const char *topic = s_topics[i % NTOPICS];
+		const char *data = s_data[i % NTOPICS];
+		MQTT_t *msg = msg_pool_take(SUBSCRIBE, topic, strlen(topic), data, strlen(data), portMAX_DELAY);
+		xQueueSend(s_queue, &msg, portMAX_DELAY);
+	}
+	return NULL;
+}
+
+static void *pool_consumer(void *arg)
+{
+	MQTT_t *msg;
+	for (int i = 0; i < MESSAGES; i++) {
+		xQueueReceive(s_queue, &msg, portMAX_DELAY);
+		s_checksum += msg->topic[msg->topic_len - 1] + msg->data_len;
+		msg_pool_put(msg);
+	}
+	return NULL;
+}
+
+static double bench_run(void *(*producer)(void *), void *(*consumer)(void *))
+{
+	pthread_t p, c;
+	double start = bench_now();
+	pthread_create(&c, NULL, consumer, NULL);
+	pthread_create(&p, NULL, producer, NULL);
+	pthread_join(p, NULL);
+	pthread_join(c, NULL);
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	s_queue = xQueueCreate(MSG_POOL_SIZE, sizeof(MQTT_t));
+	double tValue = bench_run(value_producer, value_consumer);
+	uint32_t valueChecksum = s_checksum;
+	vQueueDelete(s_queue);
+
+	s_checksum = 0;
+	msg_pool_init();
+	s_queue = xQueueCreate(MSG_POOL_SIZE, sizeof(MQTT_t *));
+	double tPool = bench_run(pool_producer, pool_consumer);
+	vQueueDelete(s_queue);
+
+	if (s_checksum != valueChecksum) {
+		printf("checksum mismatch %u != %u\n", s_checksum, valueChecksum);
+		return 1;
+	}
+
+	MSG_POOL_STATS_t stats;
+	msg_pool_get_stats(&stats);
+	printf("%d messages, queue depth %d, sizeof(MQTT_t) %zu\n", MESSAGES, MSG_POOL_SIZE, sizeof(MQTT_t));
+	printf("by value: %8.0f msg/s, 3 copies/msg, queue storage %6zu bytes\n",
+		MESSAGES / tValue, (size_t)MSG_POOL_SIZE * sizeof(MQTT_t));
+	printf("pool:     %8.0f msg/s, 1 copy/msg,  queue storage %6zu bytes (+ pool %zu bytes, free list %zu bytes)\n",
+		MESSAGES / tPool, (size_t)MSG_POOL_SIZE * sizeof(MQTT_t *),
+		(size_t)MSG_POOL_SIZE * sizeof(MQTT_t), (size_t)MSG_POOL_SIZE * sizeof(MQTT_t *));
+	printf("pool low water %u of %d free, exhausted %u\n", stats.lowWater, MSG_POOL_SIZE, stats.exhausted);
+	return 0;
+}
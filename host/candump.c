@@ -0,0 +1,34 @@
+/*
+	Reading of candump -l logs, "(seconds) interface ID#DATA" per line.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "candump.h"
+
+bool candump_parse(const char *line, double *time, twai_message_t *msg)
+{
+	char id[16];
+	char data[32];
+	if (sscanf(line, " (%lf) %*s %15[0-9A-Fa-f]#%31s", time, id, data) != 3) return false;
+	memset(msg, 0, sizeof(*msg));
+	msg->identifier = strtoul(id, NULL, 16);
+	msg->extd = strlen(id) > 3;
+	if (data[0] == 'R') {
+		msg->rtr = 1;
+		return true;
+	}
+	int len = strlen(data);
+	if (len % 2 != 0 || len / 2 > TWAI_FRAME_MAX_DLC) return false;
+	msg->data_length_code = len / 2;
+	for (int i = 0; i < len / 2; i++) {
+		unsigned int byte;
+		if (sscanf(&data[i * 2], "%2x", &byte) != 1) return false;
+		msg->data[i] = byte;
+	}
+	return true;
+}
@@ -0,0 +1,18 @@
+/*
+	Reading of candump -l logs, "(seconds) interface ID#DATA" per line.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef CANDUMP_H
+#define CANDUMP_H
+
+#include <stdbool.h>
+#include "driver/twai.h"
+
+// One line of a log into time (seconds) and msg. An identifier of more
+// than three digits is extended, "ID#R" a remote frame. Returns false for
+// comments and lines that are not a frame.
+bool candump_parse(const char *line, double *time, twai_message_t *msg);
+
+#endif
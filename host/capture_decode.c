@@ -0,0 +1,70 @@
+/*
+	Decodes a candump -l log, e.g. a capture from wp/sys/capture/log or
+	/capture.log, with the Elster decoder of the gateway.
+
+	Prints one line per Elster telegram:
+
+	  <seconds> <sender> -> <receiver> <type> <index> <name> <value>
+
+	and counts the frames that are no telegram or of an unknown index.
+
+	  capture_decode [capture.log]   (standard input without a file)
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "elster.h"
+#include "candump.h"
+
+static const char * const s_types[] = {
+	"WRITE", "READ", "RESPONSE", "ACK", "WRITE_ACK", "WRITE_RESPONSE", "SYSTEM", "SYSTEM_RESPONSE", "INVALID"
+};
+
+int main(int argc, char **argv)
+{
+	FILE *f = stdin;
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+		fprintf(stderr, "usage: %s [candump -l log]\n", argv[0]);
+		return 2;
+	}
+	if (argc == 2 && (f = fopen(argv[1], "r")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	char line[128];
+	uint32_t frames = 0, telegrams = 0, unknown = 0, other = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double time;
+		twai_message_t msg;
+		if (!candump_parse(line, &time, &msg)) continue;
+		frames++;
+		if (msg.extd || msg.rtr || msg.data_length_code != 7) {
+			other++;
+			continue;
+		}
+		ElsterPacketReceive packet = ElsterRawToReceivePacket((uint16_t)msg.identifier, msg.data_length_code, msg.data);
+		char name[ELSTER_NAME_LEN];
+		char value[ELSTER_NAME_LEN];
+		telegrams++;
+		if (packet.tableIndex == ELSTER_NO_TABLE_INDEX) {
+			unknown++;
+			strcpy(name, "?");
+			snprintf(value, sizeof(value), "0x%04x", packet.value);
+		} else {
+			ElsterPacketName(&packet, name);
+			ElsterPacketValue(&packet, value);
+		}
+		printf("%.6f %03x -> %03x %s %04x %s %s\n", time, packet.sender, packet.receiver,
+			s_types[packet.packetType <= ELSTER_PT_invalid ? packet.packetType : ELSTER_PT_invalid],
+			packet.index, name, value);
+	}
+	if (f != stdin) fclose(f);
+	fprintf(stderr, "%u frames, %u telegrams (%u of an unknown index), %u other frames\n",
+		frames, telegrams, unknown, other);
+	return 0;
+}
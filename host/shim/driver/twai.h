@@ -0,0 +1,104 @@
+/*
+	Host replacement for the TWAI driver, see twai.c. Frames come from and go
+	to a simulated bus through the hooks in shim.h.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+
+#define TWAI_FRAME_MAX_DLC 8
+
+typedef struct {
+	union {
+		struct {
+			uint32_t extd: 1;
+			uint32_t rtr: 1;
+			uint32_t ss: 1;
+			uint32_t self: 1;
+			uint32_t dlc_non_comp: 1;
+			uint32_t reserved: 27;
+		};
+		uint32_t flags;
+	};
+	uint32_t identifier;
+	uint8_t data_length_code;
+	uint8_t data[TWAI_FRAME_MAX_DLC];
+} twai_message_t;
+
+typedef enum {
+	TWAI_MODE_NORMAL,
+	TWAI_MODE_NO_ACK,
+	TWAI_MODE_LISTEN_ONLY
+} twai_mode_t;
+
+typedef enum {
+	TWAI_STATE_STOPPED,
+	TWAI_STATE_RUNNING,
+	TWAI_STATE_BUS_OFF,
+	TWAI_STATE_RECOVERING
+} twai_state_t;
+
+typedef struct {
+	twai_mode_t mode;
+	int tx_io;
+	int rx_io;
+	uint32_t tx_queue_len;
+	uint32_t rx_queue_len;
+} twai_general_config_t;
+
+typedef struct {
+	uint32_t quanta_resolution_hz;
+	uint32_t brp;
+	uint8_t tseg_1;
+	uint8_t tseg_2;
+	uint8_t sjw;
+	bool triple_sampling;
+} twai_timing_config_t;
+
+typedef struct {
+	uint32_t acceptance_code;
+	uint32_t acceptance_mask;
+	bool single_filter;
+} twai_filter_config_t;
+
+typedef struct {
+	twai_state_t state;
+	uint32_t msgs_to_tx;
+	uint32_t msgs_to_rx;
+	uint32_t tx_error_counter;
+	uint32_t rx_error_counter;
+	uint32_t tx_failed_count;
+	uint32_t rx_missed_count;
+	uint32_t rx_overrun_count;
+	uint32_t arb_lost_count;
+	uint32_t bus_error_count;
+} twai_status_info_t;
+
+// Queue lengths as in ESP-IDF
+#define TWAI_GENERAL_CONFIG_DEFAULT(tx_io_num, rx_io_num, op_mode) { \
+	.mode = op_mode, .tx_io = tx_io_num, .rx_io = rx_io_num, \
+	.tx_queue_len = 5, .rx_queue_len = 5 }
+
+#define TWAI_TIMING_CONFIG_20KBITS()  { .quanta_resolution_hz = 400000, .tseg_1 = 15, .tseg_2 = 4, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_25KBITS()  { .quanta_resolution_hz = 625000, .tseg_1 = 16, .tseg_2 = 8, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_50KBITS()  { .quanta_resolution_hz = 1000000, .tseg_1 = 15, .tseg_2 = 4, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_100KBITS() { .quanta_resolution_hz = 2000000, .tseg_1 = 15, .tseg_2 = 4, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_125KBITS() { .quanta_resolution_hz = 2500000, .tseg_1 = 15, .tseg_2 = 4, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_250KBITS() { .quanta_resolution_hz = 5000000, .tseg_1 = 15, .tseg_2 = 4, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_500KBITS() { .quanta_resolution_hz = 10000000, .tseg_1 = 15, .tseg_2 = 4, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_800KBITS() { .quanta_resolution_hz = 20000000, .tseg_1 = 16, .tseg_2 = 8, .sjw = 3 }
+#define TWAI_TIMING_CONFIG_1MBITS()   { .quanta_resolution_hz = 20000000, .tseg_1 = 15, .tseg_2 = 4, .sjw = 3 }
+
+#define TWAI_FILTER_CONFIG_ACCEPT_ALL() { .acceptance_code = 0, .acceptance_mask = 0xFFFFFFFF, .single_filter = true }
+
+esp_err_t twai_driver_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config, const twai_filter_config_t *f_config);
+esp_err_t twai_driver_uninstall(void);
+esp_err_t twai_start(void);
+esp_err_t twai_stop(void);
+esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks_to_wait);
+esp_err_t twai_receive(twai_message_t *message, TickType_t ticks_to_wait);
+esp_err_t twai_get_status_info(twai_status_info_t *status_info);
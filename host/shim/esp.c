@@ -0,0 +1,124 @@
+/*
+	Host replacements for esp_timer, esp_err, esp_log_level_set and the heap
+	functions of esp_system, and the simulated clock shared by all shims.
+
+	Simulated time runs s_speed times as fast as CLOCK_MONOTONIC and starts
+	at 1 s, so that 0 keeps meaning "never" in the callers. The wall clock
+	of programs linked with -Wl,--wrap=gettimeofday starts at the real time
+	and runs at the same speed.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <malloc.h>
+
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "shim.h"
+
+#define START_US 1000000
+
+static double s_speed = 1.0;
+static int64_t s_startNs;
+static int64_t s_wallStartUs;   // CLOCK_REALTIME at s_startNs
+
+static int64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void shim_clock_start(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s_wallStartUs = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	s_startNs = monotonic_ns();
+}
+
+// The clock starts with the first use
+static void shim_clock_init(void)
+{
+	if (s_startNs == 0) shim_clock_start();
+}
+
+void shim_set_speed(double speed)
+{
+	s_speed = speed > 0 ? speed : 1.0;
+	shim_clock_start();
+}
+
+int64_t esp_timer_get_time(void)
+{
+	shim_clock_init();
+	return START_US + (int64_t)((double)(monotonic_ns() - s_startNs) * s_speed / 1000.0);
+}
+
+// Stands in for gettimeofday() with -Wl,--wrap=gettimeofday
+int __wrap_gettimeofday(struct timeval *tv, void *tz)
+{
+	int64_t us = esp_timer_get_time() - START_US + s_wallStartUs;
+	tv->tv_sec = us / 1000000;
+	tv->tv_usec = us % 1000000;
+	return 0;
+}
+
+void shim_timespec(int64_t time, struct timespec *ts)
+{
+	shim_clock_init();
+	int64_t ns = s_startNs + (int64_t)((double)(time - START_US) * 1000.0 / s_speed);
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+void shim_sleep_until(int64_t time)
+{
+	struct timespec ts;
+	shim_timespec(time, &ts);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+	switch (code) {
+		case ESP_OK: return "ESP_OK";
+		case ESP_FAIL: return "ESP_FAIL";
+		case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+		case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+		case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+		case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+		case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+		case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+		case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+		default: return "UNKNOWN ERROR";
+	}
+}
+
+// Low water mark of the free heap, as far as esp_get_free_heap_size() saw it
+static uint32_t s_heapMin = SHIM_HEAP_SIZE;
+
+uint32_t esp_get_free_heap_size(void)
+{
+	struct mallinfo2 info = mallinfo2();
+	uint32_t used = info.uordblks < SHIM_HEAP_SIZE ? (uint32_t)info.uordblks : SHIM_HEAP_SIZE;
+	uint32_t avail = SHIM_HEAP_SIZE - used;
+	if (avail < s_heapMin) s_heapMin = avail;
+	return avail;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+	esp_get_free_heap_size();
+	return s_heapMin;
+}
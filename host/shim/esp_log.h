@@ -0,0 +1,26 @@
+/*
+	Host replacement for the ESP-IDF logging macros.
+*/
+
+#pragma once
+
+#include <stdio.h>
+
+typedef enum {
+	ESP_LOG_NONE,
+	ESP_LOG_ERROR,
+	ESP_LOG_WARN,
+	ESP_LOG_INFO,
+	ESP_LOG_DEBUG,
+	ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+// Errors and warnings are always printed, the level is ignored
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W (%s) " format "\n", tag, ##__VA_ARGS__)
+// Not printed, but the arguments are used and the format checked as by ESP-IDF
+#define ESP_LOGI(tag, format, ...) do { if (0) printf("%s " format, tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, format, ...) do { if (0) printf("%s " format, tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGV(tag, format, ...) do { if (0) printf("%s " format, tag, ##__VA_ARGS__); } while (0)
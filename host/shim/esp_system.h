@@ -0,0 +1,13 @@
+/*
+	Host replacement for the heap functions of esp_system.h. The host heap
+	has no fixed size, the free heap is given against SHIM_HEAP_SIZE.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#define SHIM_HEAP_SIZE (300 * 1024)
+
+uint32_t esp_get_free_heap_size(void);
+uint32_t esp_get_minimum_free_heap_size(void);
@@ -0,0 +1,9 @@
+/*
+	Host replacement for esp_timer.h, see shim_set_speed().
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
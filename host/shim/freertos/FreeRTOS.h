@@ -0,0 +1,22 @@
+/*
+	Host replacement for the parts of FreeRTOS used by the host build.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <assert.h>
+
+typedef int32_t BaseType_t;
+typedef uint32_t UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE            1
+#define pdFALSE           0
+#define pdPASS            pdTRUE
+#define pdFAIL            pdFALSE
+#define portMAX_DELAY     ((TickType_t)0xffffffffu)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#define configASSERT(x)   assert(x)
@@ -0,0 +1,14 @@
+/*
+	Host replacement for FreeRTOS mutexes.
+*/
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct MutexDefinition *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+// Only 0 (try) and waiting without limit are distinguished
+BaseType_t xSemaphoreTake(SemaphoreHandle_t mutex, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t mutex);
@@ -0,0 +1,19 @@
+/*
+	Host replacement for FreeRTOS tasks: every task is a detached pthread,
+	priorities and stack sizes are ignored.
+*/
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+#define tskIDLE_PRIORITY 0
+
+typedef void (*TaskFunction_t)(void *);
+typedef struct tskTaskControlBlock *TaskHandle_t;
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stackDepth, void *parameters, UBaseType_t priority, TaskHandle_t *created);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+char *pcTaskGetName(TaskHandle_t task);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
@@ -0,0 +1,18 @@
+/*
+	Host replacement for FreeRTOS software timers. The callbacks run one
+	after the other in one timer thread, like in the FreeRTOS timer task.
+*/
+
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct tmrTimerControl *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t timer);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t autoReload, void *id, TimerCallbackFunction_t callback);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t wait);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t wait);
+// Also starts the timer
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t wait);
+void *pvTimerGetTimerID(TimerHandle_t timer);
@@ -0,0 +1,20 @@
+/*
+	Functions of newlib that the host C library may lack.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include "host_compat.h"
+
+#if HOST_COMPAT_STRLCPY
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+	if (size > 0) {
+		size_t n = len < size - 1 ? len : size - 1;
+		memcpy(dst, src, n);
+		dst[n] = 0;
+	}
+	return len;
+}
+#endif
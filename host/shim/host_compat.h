@@ -0,0 +1,14 @@
+/*
+	Functions of newlib that the host C library may lack. Force included
+	into the sources of the host build.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size);
+#define HOST_COMPAT_STRLCPY 1
+#endif
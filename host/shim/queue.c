@@ -0,0 +1,139 @@
+/*
+	Host replacement for FreeRTOS queues: a ring buffer of fixed size items
+	guarded by a pthread mutex. Items are copied in and out like in
+	FreeRTOS. Ticks are milliseconds of simulated time (see esp.c).
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "shim.h"
+
+struct QueueDefinition {
+	pthread_mutex_t mutex;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+	UBaseType_t length;
+	UBaseType_t itemSize;
+	UBaseType_t head;   // next item to receive
+	UBaseType_t count;
+	uint8_t *storage;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize)
+{
+	QueueHandle_t q = calloc(1, sizeof(*q));
+	if (q == NULL) return NULL;
+	q->storage = malloc((size_t)length * itemSize);
+	if (q->storage == NULL) {
+		free(q);
+		return NULL;
+	}
+	q->length = length;
+	q->itemSize = itemSize;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->notEmpty, &attr);
+	pthread_cond_init(&q->notFull, &attr);
+	pthread_condattr_destroy(&attr);
+	return q;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+	pthread_cond_destroy(&q->notFull);
+	pthread_cond_destroy(&q->notEmpty);
+	pthread_mutex_destroy(&q->mutex);
+	free(q->storage);
+	free(q);
+}
+
+// Waits on cond while the queue holds blocked items, at most wait ticks.
+// Returns 0 on timeout. Call with the mutex held.
+static int queue_wait(QueueHandle_t q, pthread_cond_t *cond, TickType_t wait, UBaseType_t blocked)
+{
+	struct timespec deadline;
+	if (wait != portMAX_DELAY && wait != 0) {
+		shim_timespec(esp_timer_get_time() + (int64_t)wait * 1000, &deadline);
+	}
+	while (q->count == blocked) {
+		if (wait == 0) return 0;
+		if (wait == portMAX_DELAY) {
+			pthread_cond_wait(cond, &q->mutex);
+		} else if (pthread_cond_timedwait(cond, &q->mutex, &deadline) == ETIMEDOUT) {
+			return q->count != blocked;
+		}
+	}
+	return 1;
+}
+
+static BaseType_t queue_send(QueueHandle_t q, const void *item, TickType_t wait, int front)
+{
+	pthread_mutex_lock(&q->mutex);
+	if (!queue_wait(q, &q->notFull, wait, q->length)) {
+		pthread_mutex_unlock(&q->mutex);
+		return pdFAIL;
+	}
+	UBaseType_t slot;
+	if (front) {
+		q->head = (q->head + q->length - 1) % q->length;
+		slot = q->head;
+	} else {
+		slot = (q->head + q->count) % q->length;
+	}
+	memcpy(q->storage + (size_t)slot * q->itemSize, item, q->itemSize);
+	q->count++;
+	pthread_cond_signal(&q->notEmpty);
+	pthread_mutex_unlock(&q->mutex);
+	return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait)
+{
+	return queue_send(q, item, wait, 0);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t q, const void *item, TickType_t wait)
+{
+	return queue_send(q, item, wait, 1);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait)
+{
+	pthread_mutex_lock(&q->mutex);
+	if (!queue_wait(q, &q->notEmpty, wait, 0)) {
+		pthread_mutex_unlock(&q->mutex);
+		return pdFAIL;
+	}
+	memcpy(item, q->storage + (size_t)q->head * q->itemSize, q->itemSize);
+	q->head = (q->head + 1) % q->length;
+	q->count--;
+	pthread_cond_signal(&q->notFull);
+	pthread_mutex_unlock(&q->mutex);
+	return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+	pthread_mutex_lock(&q->mutex);
+	UBaseType_t count = q->count;
+	pthread_mutex_unlock(&q->mutex);
+	return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q)
+{
+	pthread_mutex_lock(&q->mutex);
+	UBaseType_t spaces = q->length - q->count;
+	pthread_mutex_unlock(&q->mutex);
+	return spaces;
+}
@@ -0,0 +1,41 @@
+/*
+	Controls of the host shims that have no ESP-IDF counterpart.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/twai.h"
+
+// Runs simulated time (esp_timer_get_time(), ticks) speed times as fast as
+// real time. Call before anything else.
+void shim_set_speed(double speed);
+// CLOCK_MONOTONIC time at which esp_timer_get_time() reaches time
+void shim_timespec(int64_t time, struct timespec *ts);
+// Sleeps until esp_timer_get_time() reaches time
+void shim_sleep_until(int64_t time);
+
+// Takes a frame the gateway transmits, may block up to wait for room
+typedef bool (*twai_shim_tx_t)(const twai_message_t *msg, TickType_t wait);
+void twai_shim_set_tx(twai_shim_tx_t tx);
+// Passes a frame from the bus through the acceptance filter into the RX
+// queue. Returns false if it was not received.
+bool twai_shim_deliver(const twai_message_t *msg);
+// Bit rate of the installed driver, 0 if none
+uint32_t twai_shim_bitrate(void);
+// The next n twai_driver_install() fail with ESP_ERR_NO_MEM
+void twai_shim_fail_install(int n);
+
+typedef struct {
+	uint32_t delivered;   // frames offered by the bus
+	uint32_t filtered;    // rejected by the acceptance filter
+	uint32_t overrun;     // RX queue full
+	uint32_t offline;     // driver stopped or being reinstalled
+	uint32_t discarded;   // still in the RX queue when the driver was uninstalled
+	uint32_t transmitted;
+	uint32_t installs;
+} TWAI_SHIM_STATS_t;
+void twai_shim_get_stats(TWAI_SHIM_STATS_t *stats);
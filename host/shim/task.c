@@ -0,0 +1,110 @@
+/*
+	Host replacements for FreeRTOS tasks and mutexes. A task is a detached
+	pthread; priorities, stack sizes and preemption are not modelled.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "shim.h"
+
+typedef struct {
+	TaskFunction_t code;
+	void *parameters;
+	char name[16];
+} TASK_START_t;
+
+struct tskTaskControlBlock {
+	uint32_t stackDepth;
+};
+
+static __thread char s_taskName[16] = "main";
+
+static void *task_run(void *arg)
+{
+	TASK_START_t start = *(TASK_START_t *)arg;
+	free(arg);
+	strcpy(s_taskName, start.name);
+	start.code(start.parameters);
+	return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char *name, uint32_t stackDepth, void *parameters, UBaseType_t priority, TaskHandle_t *created)
+{
+	TASK_START_t *start = malloc(sizeof(*start));
+	if (start == NULL) return pdFAIL;
+	start->code = code;
+	start->parameters = parameters;
+	strncpy(start->name, name, sizeof(start->name) - 1);
+	start->name[sizeof(start->name) - 1] = 0;
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int ret = pthread_create(&thread, &attr, task_run, start);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		free(start);
+		return pdFAIL;
+	}
+	if (created) {
+		// only for uxTaskGetStackHighWaterMark(), never freed
+		*created = malloc(sizeof(**created));
+		if (*created) (*created)->stackDepth = stackDepth;
+	}
+	return pdPASS;
+}
+
+// Only a task deleting itself is supported
+void vTaskDelete(TaskHandle_t task)
+{
+	pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+	shim_sleep_until(esp_timer_get_time() + (int64_t)ticks * 1000);
+}
+
+// Stack use is not modelled, the whole stack is reported free
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+	return task ? task->stackDepth : 0;
+}
+
+char *pcTaskGetName(TaskHandle_t task)
+{
+	return s_taskName;
+}
+
+struct MutexDefinition {
+	pthread_mutex_t mutex;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	SemaphoreHandle_t m = malloc(sizeof(*m));
+	if (m == NULL) return NULL;
+	pthread_mutex_init(&m->mutex, NULL);
+	return m;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t wait)
+{
+	if (wait == 0) return pthread_mutex_trylock(&m->mutex) == 0 ? pdTRUE : pdFALSE;
+	pthread_mutex_lock(&m->mutex);
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m)
+{
+	pthread_mutex_unlock(&m->mutex);
+	return pdTRUE;
+}
@@ -0,0 +1,130 @@
+/*
+	Host replacement for FreeRTOS software timers. One thread, started with
+	the first timer, sleeps until the earliest expiry and runs the callbacks
+	one after the other like the FreeRTOS timer task. Callbacks run without
+	the list lock held, so they may start and stop timers.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "freertos/timers.h"
+#include "esp_timer.h"
+#include "shim.h"
+
+struct tmrTimerControl {
+	TimerHandle_t next;
+	TickType_t period;
+	bool autoReload;
+	bool active;
+	int64_t expiry;       // esp_timer_get_time() when due
+	void *id;
+	TimerCallbackFunction_t callback;
+};
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_changed;
+static pthread_once_t s_once = PTHREAD_ONCE_INIT;
+static TimerHandle_t s_timers;
+
+static void *timer_run(void *arg)
+{
+	pthread_mutex_lock(&s_mutex);
+	while (1) {
+		TimerHandle_t due = NULL;
+		for (TimerHandle_t t = s_timers; t; t = t->next) {
+			if (t->active && (due == NULL || t->expiry < due->expiry)) due = t;
+		}
+		if (due == NULL) {
+			pthread_cond_wait(&s_changed, &s_mutex);
+			continue;
+		}
+		if (due->expiry > esp_timer_get_time()) {
+			struct timespec ts;
+			shim_timespec(due->expiry, &ts);
+			pthread_cond_timedwait(&s_changed, &s_mutex, &ts);
+			continue;
+		}
+		if (due->autoReload) {
+			due->expiry += (int64_t)due->period * 1000;
+		} else {
+			due->active = false;
+		}
+		pthread_mutex_unlock(&s_mutex);
+		due->callback(due);
+		pthread_mutex_lock(&s_mutex);
+	}
+	return NULL;
+}
+
+static void timer_start_thread(void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s_changed, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, timer_run, NULL);
+	pthread_detach(thread);
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t autoReload, void *id, TimerCallbackFunction_t callback)
+{
+	pthread_once(&s_once, timer_start_thread);
+	TimerHandle_t t = calloc(1, sizeof(*t));
+	if (t == NULL) return NULL;
+	t->period = period;
+	t->autoReload = autoReload;
+	t->id = id;
+	t->callback = callback;
+	pthread_mutex_lock(&s_mutex);
+	t->next = s_timers;
+	s_timers = t;
+	pthread_mutex_unlock(&s_mutex);
+	return t;
+}
+
+// Call with s_mutex held
+static void timer_arm(TimerHandle_t t)
+{
+	t->active = true;
+	t->expiry = esp_timer_get_time() + (int64_t)t->period * 1000;
+	pthread_cond_signal(&s_changed);
+}
+
+BaseType_t xTimerStart(TimerHandle_t t, TickType_t wait)
+{
+	pthread_mutex_lock(&s_mutex);
+	timer_arm(t);
+	pthread_mutex_unlock(&s_mutex);
+	return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t t, TickType_t wait)
+{
+	pthread_mutex_lock(&s_mutex);
+	t->active = false;
+	pthread_cond_signal(&s_changed);
+	pthread_mutex_unlock(&s_mutex);
+	return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t t, TickType_t period, TickType_t wait)
+{
+	pthread_mutex_lock(&s_mutex);
+	t->period = period;
+	timer_arm(t);
+	pthread_mutex_unlock(&s_mutex);
+	return pdPASS;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t t)
+{
+	return t->id;
+}
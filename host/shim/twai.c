@@ -0,0 +1,198 @@
+/*
+	Host replacement for the TWAI driver. Frames the gateway transmits go to
+	the hook set with twai_shim_set_tx(); the bus hands frames in through
+	twai_shim_deliver(), which applies the acceptance filter like the
+	controller does for standard frames:
+
+	  single  code/mask bits 31:21 ID, 20 RTR, 15:8 data 0, 7:0 data 1
+	  dual    filter 1: 31:21 ID, 20 RTR, 19:16 and 3:0 data 0
+	          filter 2: 15:5 ID, 4 RTR
+
+	Data bytes the frame does not have are not compared. A set mask bit is
+	don't care.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <string.h>
+#include <pthread.h>
+
+#include "freertos/queue.h"
+#include "driver/twai.h"
+#include "shim.h"
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static QueueHandle_t s_rx;
+static twai_filter_config_t s_filter;
+static uint32_t s_bitrate;
+static bool s_started;
+static twai_shim_tx_t s_tx;
+static int s_failInstall;
+static uint32_t s_overrunInstalled;  // s_stats.overrun at the install
+static TWAI_SHIM_STATS_t s_stats;
+
+static bool filter_match(uint32_t frame, uint32_t bits)
+{
+	return ((frame ^ s_filter.acceptance_code) & ~s_filter.acceptance_mask & bits) == 0;
+}
+
+// Call with s_mutex held
+static bool filter_accept(const twai_message_t *msg)
+{
+	if (msg->extd) return true; // not used on the Elster bus
+	uint8_t dlc = msg->rtr ? 0 : msg->data_length_code;
+	uint32_t id = ((msg->identifier & 0x7ff) << 1) | (msg->rtr ? 1 : 0); // ID and RTR
+	uint8_t d0 = dlc > 0 ? msg->data[0] : 0;
+	uint8_t d1 = dlc > 1 ? msg->data[1] : 0;
+	if (s_filter.single_filter) {
+		uint32_t bits = 0xfff00000 | (dlc > 0 ? 0xff00 : 0) | (dlc > 1 ? 0xff : 0);
+		return filter_match((id << 20) | ((uint32_t)d0 << 8) | d1, bits);
+	}
+	uint32_t bits1 = 0xfff00000 | (dlc > 0 ? 0x000f000f : 0);
+	uint32_t frame1 = (id << 20) | ((uint32_t)(d0 >> 4) << 16) | (d0 & 0xf);
+	return filter_match(frame1, bits1) || filter_match(id << 4, 0x0000fff0);
+}
+
+esp_err_t twai_driver_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config, const twai_filter_config_t *f_config)
+{
+	pthread_mutex_lock(&s_mutex);
+	if (s_rx != NULL) {
+		pthread_mutex_unlock(&s_mutex);
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (s_failInstall > 0) {
+		s_failInstall--;
+		pthread_mutex_unlock(&s_mutex);
+		return ESP_ERR_NO_MEM;
+	}
+	s_rx = xQueueCreate(g_config->rx_queue_len, sizeof(twai_message_t));
+	s_filter = *f_config;
+	s_overrunInstalled = s_stats.overrun;
+	s_bitrate = t_config->quanta_resolution_hz / (1 + t_config->tseg_1 + t_config->tseg_2);
+	s_started = false;
+	s_stats.installs++;
+	pthread_mutex_unlock(&s_mutex);
+	return s_rx ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t twai_driver_uninstall(void)
+{
+	pthread_mutex_lock(&s_mutex);
+	if (s_rx == NULL || s_started) {
+		pthread_mutex_unlock(&s_mutex);
+		return ESP_ERR_INVALID_STATE;
+	}
+	// like the driver, the frames not received yet go with the queue
+	s_stats.discarded += uxQueueMessagesWaiting(s_rx);
+	vQueueDelete(s_rx);
+	s_rx = NULL;
+	pthread_mutex_unlock(&s_mutex);
+	return ESP_OK;
+}
+
+esp_err_t twai_start(void)
+{
+	pthread_mutex_lock(&s_mutex);
+	esp_err_t ret = s_rx == NULL || s_started ? ESP_ERR_INVALID_STATE : ESP_OK;
+	if (ret == ESP_OK) s_started = true;
+	pthread_mutex_unlock(&s_mutex);
+	return ret;
+}
+
+esp_err_t twai_stop(void)
+{
+	pthread_mutex_lock(&s_mutex);
+	esp_err_t ret = s_started ? ESP_OK : ESP_ERR_INVALID_STATE;
+	s_started = false;
+	pthread_mutex_unlock(&s_mutex);
+	return ret;
+}
+
+esp_err_t twai_transmit(const twai_message_t *message, TickType_t ticks_to_wait)
+{
+	pthread_mutex_lock(&s_mutex);
+	bool started = s_started;
+	twai_shim_tx_t tx = s_tx;
+	pthread_mutex_unlock(&s_mutex);
+	if (!started) return ESP_ERR_INVALID_STATE;
+	if (tx != NULL && !tx(message, ticks_to_wait)) return ESP_ERR_TIMEOUT;
+
+	pthread_mutex_lock(&s_mutex);
+	s_stats.transmitted++;
+	pthread_mutex_unlock(&s_mutex);
+	return ESP_OK;
+}
+
+// The RX queue only goes away in twai_driver_uninstall(), which twai.c calls
+// from the task that receives
+esp_err_t twai_receive(twai_message_t *message, TickType_t ticks_to_wait)
+{
+	pthread_mutex_lock(&s_mutex);
+	QueueHandle_t rx = s_started ? s_rx : NULL;
+	pthread_mutex_unlock(&s_mutex);
+	if (rx == NULL) return ESP_ERR_INVALID_STATE;
+	return xQueueReceive(rx, message, ticks_to_wait) == pdTRUE ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+esp_err_t twai_get_status_info(twai_status_info_t *status_info)
+{
+	memset(status_info, 0, sizeof(*status_info));
+	pthread_mutex_lock(&s_mutex);
+	if (s_rx == NULL) {
+		pthread_mutex_unlock(&s_mutex);
+		return ESP_ERR_INVALID_STATE;
+	}
+	status_info->state = s_started ? TWAI_STATE_RUNNING : TWAI_STATE_STOPPED;
+	status_info->msgs_to_rx = uxQueueMessagesWaiting(s_rx);
+	// like the driver's, counted from the install
+	status_info->rx_overrun_count = s_stats.overrun - s_overrunInstalled;
+	pthread_mutex_unlock(&s_mutex);
+	return ESP_OK;
+}
+
+void twai_shim_set_tx(twai_shim_tx_t tx)
+{
+	pthread_mutex_lock(&s_mutex);
+	s_tx = tx;
+	pthread_mutex_unlock(&s_mutex);
+}
+
+bool twai_shim_deliver(const twai_message_t *msg)
+{
+	bool received = false;
+	pthread_mutex_lock(&s_mutex);
+	s_stats.delivered++;
+	if (!s_started) {
+		s_stats.offline++;
+	} else if (!filter_accept(msg)) {
+		s_stats.filtered++;
+	} else if (xQueueSend(s_rx, msg, 0) != pdPASS) {
+		s_stats.overrun++;
+	} else {
+		received = true;
+	}
+	pthread_mutex_unlock(&s_mutex);
+	return received;
+}
+
+void twai_shim_fail_install(int n)
+{
+	pthread_mutex_lock(&s_mutex);
+	s_failInstall = n;
+	pthread_mutex_unlock(&s_mutex);
+}
+
+uint32_t twai_shim_bitrate(void)
+{
+	pthread_mutex_lock(&s_mutex);
+	uint32_t bitrate = s_rx ? s_bitrate : 0;
+	pthread_mutex_unlock(&s_mutex);
+	return bitrate;
+}
+
+void twai_shim_get_stats(TWAI_SHIM_STATS_t *stats)
+{
+	pthread_mutex_lock(&s_mutex);
+	*stats = s_stats;
+	pthread_mutex_unlock(&s_mutex);
+}
@@ -0,0 +1,31 @@
+/*
+	Loopback stand-in for the MQTT broker behind the mqtt_conn.h API.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef MOCK_BROKER_H
+#define MOCK_BROKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Called for every message the gateway publishes while connected
+typedef void (*mock_broker_hook_t)(const char *topic, const char *data, int len);
+
+typedef struct {
+	uint32_t published;  // messages that reached the broker
+	uint32_t rejected;   // mqtt_conn_publish() while disconnected
+	uint32_t outbox;     // mqtt_conn_enqueue() held back while disconnected
+	uint32_t injected;   // messages sent to the gateway's subscriptions
+} MOCK_BROKER_STATS_t;
+
+void mock_broker_set_hook(mock_broker_hook_t hook);
+// Connection state seen by the gateway, the outbox is sent on reconnect
+void mock_broker_set_connected(bool connected);
+// Delivers a message to the matching subscriptions like the MQTT client
+// task does. Returns the number of handlers called.
+int mock_broker_inject(const char *topic, const char *data);
+void mock_broker_get_stats(MOCK_BROKER_STATS_t *stats);
+
+#endif
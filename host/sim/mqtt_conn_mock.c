@@ -0,0 +1,188 @@
+/*
+	The one MQTT connection, connected to a loopback broker for the host
+	simulator. Implements mqtt_conn.h; published messages go to the hook of
+	mock_broker.h, injected ones to the subscribed handlers.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "mqtt_conn.h"
+#include "mock_broker.h"
+#include "trace.h"
+
+#define TAG "MQTT"
+
+#define OUTBOX_MAX 64
+
+typedef struct {
+	const char *filter;
+	mqtt_conn_handler_t handler;
+} MQTT_HANDLER_t;
+
+typedef struct {
+	char topic[64];
+	char data[256];
+	int len;
+} MQTT_OUTBOX_t;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool s_connected;
+static MQTT_HANDLER_t s_handlers[MQTT_CONN_MAX_HANDLERS];
+static int s_nhandlers;
+static MQTT_OUTBOX_t s_outbox[OUTBOX_MAX];
+static int s_noutbox;
+static int s_msgId;
+static mock_broker_hook_t s_hook;
+static MOCK_BROKER_STATS_t s_stats;
+
+// Same matching as mqtt_conn.c
+static bool mqtt_conn_match(const char *filter, const char *topic, int topic_len)
+{
+	const char *end = topic + topic_len;
+	while (*filter) {
+		if (*filter == '#') return true;
+		// "a/#" also matches "a"
+		if (topic == end && strcmp(filter, "/#") == 0) return true;
+		if (*filter == '+') {
+			while (topic < end && *topic != '/') topic++;
+			filter++;
+			continue;
+		}
+		if (topic == end || *filter != *topic) return false;
+		filter++;
+		topic++;
+	}
+	return topic == end;
+}
+
+void mqtt_conn_start(void)
+{
+	ESP_LOGI(TAG, "Start loopback broker");
+}
+
+void mqtt_conn_wait(void)
+{
+	while (!mqtt_conn_connected()) vTaskDelay(pdMS_TO_TICKS(10));
+}
+
+bool mqtt_conn_connected(void)
+{
+	pthread_mutex_lock(&s_mutex);
+	bool connected = s_connected;
+	pthread_mutex_unlock(&s_mutex);
+	return connected;
+}
+
+esp_err_t mqtt_conn_subscribe(const char *filter, int qos, mqtt_conn_handler_t handler)
+{
+	pthread_mutex_lock(&s_mutex);
+	esp_err_t ret = ESP_ERR_NO_MEM;
+	if (s_nhandlers < MQTT_CONN_MAX_HANDLERS) {
+		s_handlers[s_nhandlers].filter = filter;
+		s_handlers[s_nhandlers].handler = handler;
+		s_nhandlers++;
+		ret = ESP_OK;
+	}
+	pthread_mutex_unlock(&s_mutex);
+	return ret;
+}
+
+int mqtt_conn_publish(const char *topic, const char *data, int len, int qos, int retain)
+{
+	pthread_mutex_lock(&s_mutex);
+	if (!s_connected) {
+		s_stats.rejected++;
+		pthread_mutex_unlock(&s_mutex);
+		return -1;
+	}
+	int msgId = ++s_msgId;
+	s_stats.published++;
+	mock_broker_hook_t hook = s_hook;
+	pthread_mutex_unlock(&s_mutex);
+
+	if (hook) hook(topic, data, len);
+	// The loopback broker acknowledges at once. The client task records the
+	// PUBACK in mqtt_conn.c; here only the wp/read values are acknowledged,
+	// which mqtt_pub_task alone publishes, so the ring keeps its one writer.
+	if (qos > 0 && strncmp(topic, "wp/read/", 8) == 0) {
+		trace_record(TRACE_ACK, 0, (uint16_t)msgId, esp_timer_get_time());
+	}
+	return msgId;
+}
+
+int mqtt_conn_enqueue(const char *topic, const char *data, int len, int qos, int retain)
+{
+	pthread_mutex_lock(&s_mutex);
+	if (!s_connected) {
+		int msgId = -1;
+		if (s_noutbox < OUTBOX_MAX && len < (int)sizeof(s_outbox[0].data)) {
+			MQTT_OUTBOX_t *m = &s_outbox[s_noutbox++];
+			snprintf(m->topic, sizeof(m->topic), "%s", topic);
+			memcpy(m->data, data, len);
+			m->len = len;
+			s_stats.outbox++;
+			msgId = ++s_msgId;
+		}
+		pthread_mutex_unlock(&s_mutex);
+		return msgId;
+	}
+	pthread_mutex_unlock(&s_mutex);
+	return mqtt_conn_publish(topic, data, len, qos, retain);
+}
+
+void mock_broker_set_hook(mock_broker_hook_t hook)
+{
+	pthread_mutex_lock(&s_mutex);
+	s_hook = hook;
+	pthread_mutex_unlock(&s_mutex);
+}
+
+void mock_broker_set_connected(bool connected)
+{
+	pthread_mutex_lock(&s_mutex);
+	s_connected = connected;
+	int n = connected ? s_noutbox : 0;
+	static MQTT_OUTBOX_t outbox[OUTBOX_MAX];
+	memcpy(outbox, s_outbox, n * sizeof(outbox[0]));
+	if (connected) s_noutbox = 0;
+	pthread_mutex_unlock(&s_mutex);
+
+	ESP_LOGI(TAG, "%s", connected ? "connected" : "disconnected");
+	for (int i = 0; i < n; i++) {
+		mqtt_conn_publish(outbox[i].topic, outbox[i].data, outbox[i].len, 1, 0);
+	}
+}
+
+int mock_broker_inject(const char *topic, const char *data)
+{
+	MQTT_HANDLER_t handlers[MQTT_CONN_MAX_HANDLERS];
+	int n = 0;
+	pthread_mutex_lock(&s_mutex);
+	s_stats.injected++;
+	for (int i = 0; i < s_nhandlers; i++) {
+		if (mqtt_conn_match(s_handlers[i].filter, topic, strlen(topic))) handlers[n++] = s_handlers[i];
+	}
+	pthread_mutex_unlock(&s_mutex);
+
+	for (int i = 0; i < n; i++) {
+		handlers[i].handler(topic, strlen(topic), data, strlen(data));
+	}
+	return n;
+}
+
+void mock_broker_get_stats(MOCK_BROKER_STATS_t *stats)
+{
+	pthread_mutex_lock(&s_mutex);
+	*stats = s_stats;
+	pthread_mutex_unlock(&s_mutex);
+}
@@ -0,0 +1,51 @@
+/*
+	Configuration of the host simulator: the Kconfig defaults of
+	main/Kconfig.projbuild, with the bit rate of the WPM bus and the latency
+	trace. SIM_PUBLISH_STATE selects wp/state only (sim_gateway_state).
+*/
+
+#pragma once
+
+#define CONFIG_CAN_BITRATE_20 1
+#define CONFIG_WPM_HW_FILTER 1
+
+#if SIM_PUBLISH_STATE
+#define CONFIG_WPM_PUBLISH_STATE 1
+#else
+#define CONFIG_WPM_PUBLISH_TOPIC 1
+#endif
+#define CONFIG_WPM_PUBLISH_ON_CHANGE 1
+#define CONFIG_WPM_HEARTBEAT 900
+#define CONFIG_WPM_STATE_PERIOD 60
+
+#define CONFIG_WPM_SPOOL 1
+#define CONFIG_WPM_SPOOL_SIZE 256
+#define CONFIG_WPM_SPOOL_BATCH 20
+#define CONFIG_WPM_SPOOL_BATCH_PERIOD 1000
+
+#define CONFIG_WPM_METRICS 1
+#define CONFIG_WPM_METRICS_PERIOD 60
+
+#define CONFIG_WPM_TRACE 1
+#define CONFIG_WPM_TRACE_PERIOD 60
+#define CONFIG_WPM_TRACE_RING 256
+#define CONFIG_WPM_TRACE_DUMP 256
+
+#define CONFIG_WPM_DLOG_RING 64
+
+#define CONFIG_WPM_CAPTURE 1
+#define CONFIG_WPM_CAPTURE_SIZE 128
+#define CONFIG_WPM_REPLAY 1
+
+#define CONFIG_WPM_POLL_BUDGET 20
+#define CONFIG_WPM_MAX_INFLIGHT 1
+#define CONFIG_WPM_REQUEST_TIMEOUT_MS 500
+#define CONFIG_WPM_REQUEST_RETRIES 2
+#define CONFIG_WPM_BROADCAST_LISTENER 1
+#define CONFIG_WPM_BROADCAST_TIMEOUT 300
+
+#define CONFIG_WPM_WRITE_SETTLE_MS 200
+#define CONFIG_WPM_WRITE_TIMEOUT_MS 2000
+
+#define CONFIG_WPM_GET_MAX_AGE 10
+#define CONFIG_WPM_GET_RECEIVER 0x180
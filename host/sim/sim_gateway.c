@@ -0,0 +1,877 @@
+/*
+	End-to-end run of the gateway on the host.
+
+	The TWAI, request, poll, change, get, write, spool and MQTT task code of
+	main/ runs unchanged on the host shims, between a simulated CAN bus with
+	a WPM answering from a recorded trace (wpm.c) and a loopback broker
+	(mqtt_conn_mock.c). Simulated time runs faster than real time. The run
+	goes through these phases and checks what the broker receives:
+
+	  steady  the poll scheduler reads every value of the built in poll list
+	  get     wp/get is answered from the cache or the bus, unknown names
+	          are rejected
+	  reinstall a failed driver reinstall keeps the previous filter
+	  write   wp/write is confirmed by read-back, a burst is coalesced
+	  outage  values received while the broker is away are replayed from
+	          the spool to wp/history
+	  flood   the devices broadcast as fast as the bus takes it
+	  trace   the latency per stage is published and the trace dumped
+	  log     wp/sys/log/level switches the deferred log to debug and back
+	  capture the frames to the gateway are captured to flash and dumped
+	          in the candump -l format
+	  replay  the capture is replayed at 10x, the trace as fast as possible
+
+	sim_gateway_state, built with the values published to wp/state only,
+	runs the get phase after
+
+	  state   the values reach wp/state and nothing is sent to wp/read
+
+	Publish latency is taken from the end of a frame on the bus to the
+	message reaching the broker. Exits with 1 if a check failed.
+
+	  sim_gateway [-t trace] [-s speed] [-d steady seconds] [-o outage seconds] [-f flood seconds]
+
+	With -r the phases are skipped: the frames of a candump -l log are
+	replayed through the gateway at -x times the recorded pace (0, the
+	default, as fast as possible), "<seconds> <topic> <value>" of every
+	wp/replay message is written to the -w file and the report printed.
+
+	  sim_gateway -r log [-x speed] [-w stream]
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/twai.h"
+#include "shim.h"
+
+#include "elster.h"
+#include "mqtt.h"
+#include "request.h"
+#include "poll.h"
+#include "change.h"
+#include "spool.h"
+#include "get.h"
+#include "write.h"
+#include "msg_pool.h"
+#include "mqtt_conn.h"
+#include "trace.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "capture.h"
+#include "replay.h"
+#include "candump.h"
+
+#include "vbus.h"
+#include "wpm.h"
+#include "mock_broker.h"
+
+#define MAX_TOPICS  256
+#define MAX_SAMPLES 65536
+#define SECONDS(s)  ((int64_t)(s) * 1000000)
+
+typedef struct {
+	char topic[64];
+	char data[1024];
+	int64_t time;     // last publish
+	uint32_t count;
+} TOPIC_SEEN_t;
+
+QueueHandle_t xQueue_mqtt_tx;
+QueueHandle_t xQueue_twai_tx;
+
+void mqtt_pub_task(void *pvParameters);
+void mqtt_sub_task(void *pvParameters);
+void twai_task(void *pvParameters);
+void twai_tx_task(void *pvParameters);
+esp_err_t twai_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config);
+void twai_filter_require(uint16_t sender);
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TOPIC_SEEN_t s_topics[MAX_TOPICS];
+static int s_ntopics;
+static int64_t s_onBus[0x10000];      // per index, end of the last frame to the gateway
+static int64_t s_samples[MAX_SAMPLES];
+static int s_nsamples;
+static uint32_t s_reads;              // wp/read messages
+static uint32_t s_history;            // wp/history messages
+static uint32_t s_replayed;           // wp/replay messages
+static FILE *s_replayStream;          // and their text for -w
+static bool s_logPhase;               // phase_log() runs
+static char s_logPublished[64][96];   // "topic data" of wp/read meanwhile
+static int s_nlogPublished;
+static uint32_t s_logLines;           // PUB lines formatted by dlog
+static uint32_t s_logMismatched;      // of them not matching a publish
+static FILE *s_captureLog;            // wp/sys/capture/log goes here
+static bool s_captureEnd;             // the empty message ending the dump came
+static int s_failed;
+
+// Call with s_mutex held
+static TOPIC_SEEN_t *sim_topic(const char *topic)
+{
+	for (int i = 0; i < s_ntopics; i++) {
+		if (strcmp(s_topics[i].topic, topic) == 0) return &s_topics[i];
+	}
+	if (s_ntopics == MAX_TOPICS) return NULL;
+	TOPIC_SEEN_t *t = &s_topics[s_ntopics++];
+	snprintf(t->topic, sizeof(t->topic), "%s", topic);
+	return t;
+}
+
+static void sim_tap(const twai_message_t *msg, bool fromGateway)
+{
+	if (fromGateway || msg->data_length_code != 7) return;
+	ElsterPacketReceive packet = ElsterRawToReceivePacket(msg->identifier, msg->data_length_code, msg->data);
+	int64_t now = esp_timer_get_time();
+	pthread_mutex_lock(&s_mutex);
+	s_onBus[packet.index] = now;
+	pthread_mutex_unlock(&s_mutex);
+}
+
+static void sim_publish(const char *topic, const char *data, int len)
+{
+	int64_t now = esp_timer_get_time();
+	int tableIndex = -1;
+	if (strncmp(topic, "wp/read/", 8) == 0) tableIndex = GetElsterTableIndexFromString(&topic[8]);
+	ElsterIndex entry;
+	char name[ELSTER_NAME_LEN];
+	bool known = tableIndex >= 0 && GetElsterTableEntry(tableIndex, &entry, name);
+
+	pthread_mutex_lock(&s_mutex);
+	if (strcmp(topic, "wp/sys/capture/log") == 0) {
+		if (len == 0) s_captureEnd = true;
+		else if (s_captureLog) fwrite(data, 1, len, s_captureLog);
+	}
+	TOPIC_SEEN_t *t = sim_topic(topic);
+	if (t) {
+		int n = len < (int)sizeof(t->data) - 1 ? len : (int)sizeof(t->data) - 1;
+		memcpy(t->data, data, n);
+		t->data[n] = 0;
+		t->time = now;
+		t->count++;
+	}
+	if (strncmp(topic, "wp/read/", 8) == 0) {
+		s_reads++;
+		if (s_logPhase && s_nlogPublished < 64) {
+			snprintf(s_logPublished[s_nlogPublished++], sizeof(s_logPublished[0]), "%s %.*s", topic, len, data);
+		}
+	}
+	if (strncmp(topic, "wp/history/", 11) == 0) s_history++;
+	if (strncmp(topic, "wp/replay/", 10) == 0) {
+		s_replayed++;
+		if (s_replayStream) fprintf(s_replayStream, "%.6f %s %.*s\n", now / 1e6, topic, len, data);
+	}
+	// values answered from the cache were not on the bus just now
+	if (known && s_onBus[entry.Index] != 0 && now - s_onBus[entry.Index] < SECONDS(5) && s_nsamples < MAX_SAMPLES) {
+		s_samples[s_nsamples++] = now - s_onBus[entry.Index];
+	}
+	pthread_mutex_unlock(&s_mutex);
+}
+
+static void sim_check(bool ok, const char *what)
+{
+	printf("  %s  %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok) s_failed++;
+}
+
+static void sim_sleep(int64_t us)
+{
+	shim_sleep_until(esp_timer_get_time() + us);
+}
+
+// Waits up to timeout for topic to be published after since. Copies the
+// payload to data if given.
+static bool sim_wait(const char *topic, int64_t since, int64_t timeout, char *data, size_t size)
+{
+	int64_t end = esp_timer_get_time() + timeout;
+	while (1) {
+		pthread_mutex_lock(&s_mutex);
+		TOPIC_SEEN_t *t = sim_topic(topic);
+		bool seen = t && t->time > since;
+		// a longer payload is cut to size
+		if (seen && data) strlcpy(data, t->data, size);
+		pthread_mutex_unlock(&s_mutex);
+		if (seen) return true;
+		if (esp_timer_get_time() >= end) return false;
+		sim_sleep(10000);
+	}
+}
+
+static int sample_compare(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Prints (unless phase is NULL) and clears the latency samples of the phase
+static void sim_latency(const char *phase)
+{
+	pthread_mutex_lock(&s_mutex);
+	int n = phase ? s_nsamples : 0;
+	qsort(s_samples, n, sizeof(s_samples[0]), sample_compare);
+	if (n > 0) {
+		int64_t sum = 0;
+		for (int i = 0; i < n; i++) sum += s_samples[i];
+		printf("  %s publish latency n=%d min=%.1fms avg=%.1fms p50=%.1fms p99=%.1fms max=%.1fms\n", phase, n,
+			s_samples[0] / 1000.0, sum / n / 1000.0, s_samples[n / 2] / 1000.0,
+			s_samples[(int)(n * 0.99)] / 1000.0, s_samples[n - 1] / 1000.0);
+	}
+	s_nsamples = 0;
+	pthread_mutex_unlock(&s_mutex);
+}
+
+static uint32_t sim_count(uint32_t *counter)
+{
+	pthread_mutex_lock(&s_mutex);
+	uint32_t count = *counter;
+	pthread_mutex_unlock(&s_mutex);
+	return count;
+}
+
+static void phase_steady(int seconds)
+{
+	static const char *polled[] = {
+		"PROGRAMMSCHALTER", "KUEHLEN_AKTIVIERT", "SPEICHERISTTEMP", "WPVORLAUFIST",
+		"RUECKLAUFISTTEMP", "AUSSENTEMP", "RAUM_IST_TEMPERATUR", "RAUM_SOLL_TEMPERATUR",
+		"RAUM_IST_FEUCHTE", "RAUM_TAUPUNKT_TEMPERATUR", "WW_SUM_KWH", "WW_SUM_MWH",
+		"HEIZ_SUM_KWH", "HEIZ_SUM_MWH"
+	};
+	printf("steady: %d s\n", seconds);
+	sim_sleep(SECONDS(seconds));
+
+	int missing = 0;
+	for (int i = 0; i < sizeof(polled) / sizeof(polled[0]); i++) {
+		char topic[64];
+		snprintf(topic, sizeof(topic), "wp/read/%s", polled[i]);
+		if (!sim_wait(topic, 0, 0, NULL, 0)) {
+			printf("  %s not published\n", polled[i]);
+			missing++;
+		}
+	}
+	sim_check(missing == 0, "every polled value published");
+	REQUEST_STATS_t req;
+	request_get_stats(&req);
+	printf("  requests sent=%"PRIu32" completed=%"PRIu32" retries=%"PRIu32" timeouts=%"PRIu32" latency avg=%.1fms max=%.1fms\n",
+		req.sent, req.completed, req.retries, req.timeouts,
+		req.completed ? req.latencySum / req.completed / 1000.0 : 0.0, req.latencyMax / 1000.0);
+	sim_check(req.timeouts == 0, "no request timed out");
+	sim_latency("steady");
+}
+
+// CONFIG_WPM_PUBLISH_STATE: wp/read only takes the answers of wp/get
+static void phase_state(int seconds)
+{
+	printf("state: %d s\n", seconds);
+	sim_sleep(SECONDS(seconds));
+	char state[256];
+	bool published = sim_wait("wp/state", 0, 0, state, sizeof(state));
+	sim_check(published, "values published to wp/state");
+	if (published) printf("  %s\n", state);
+	sim_check(sim_count(&s_reads) == 0, "no value published to wp/read");
+}
+
+static void phase_get(void)
+{
+	printf("get\n");
+	// A get needing the bus is dropped when the in-flight table is full,
+	// so wait for a poll to complete first.
+	while (request_free() == 0) sim_sleep(1000);
+	int64_t start = esp_timer_get_time();
+	mock_broker_inject("wp/get/AUSSENTEMP", "");
+	sim_check(sim_wait("wp/read/AUSSENTEMP", start, SECONDS(3), NULL, 0), "wp/get/AUSSENTEMP answered");
+	printf("  after %.1f ms\n", (esp_timer_get_time() - start) / 1000.0);
+
+	// DATUM is not polled, it is read from CONFIG_WPM_GET_RECEIVER
+	while (request_free() == 0) sim_sleep(1000);
+	start = esp_timer_get_time();
+	mock_broker_inject("wp/get", "DATUM, AUSSENTEMP");
+	sim_check(sim_wait("wp/read/DATUM", start, SECONDS(3), NULL, 0), "wp/get list: DATUM answered");
+	sim_check(sim_wait("wp/read/AUSSENTEMP", start, SECONDS(3), NULL, 0), "wp/get list: AUSSENTEMP answered");
+	printf("  after %.1f ms\n", (esp_timer_get_time() - start) / 1000.0);
+
+	GET_STATS_t before, after;
+	get_get_stats(&before);
+	mock_broker_inject("wp/get/NO_SUCH_VALUE", "");
+	sim_sleep(SECONDS(1));
+	get_get_stats(&after);
+	sim_check(after.unknown == before.unknown + 1, "unknown name rejected");
+	printf("  requests=%"PRIu32" cached=%"PRIu32" coalesced=%"PRIu32" sent=%"PRIu32" dropped=%"PRIu32"\n",
+		after.requests, after.cached, after.coalesced, after.sent, after.dropped);
+}
+
+// A filter change whose reinstall fails keeps the previous filter and is
+// applied later
+static void phase_reinstall(void)
+{
+	TWAI_SHIM_STATS_t before, after;
+	printf("reinstall\n");
+	twai_shim_get_stats(&before);
+	uint32_t received = metrics_get(METRIC_CAN_RX);
+	twai_shim_fail_install(1);
+	// a device not heard of before
+	twai_filter_require(0x123);
+	// the answer to a read passes the previous filter, the change is tried
+	// again after 5 s
+	int64_t start = esp_timer_get_time();
+	sim_sleep(SECONDS(1));
+	request_read(0x480, 0x0112);
+	while (metrics_get(METRIC_CAN_RX) == received && esp_timer_get_time() - start < 4500000) sim_sleep(10000);
+	twai_shim_get_stats(&after);
+	sim_check(after.installs == before.installs + 1 && metrics_get(METRIC_CAN_RX) > received,
+		"failed reinstall: previous filter back, frames received");
+	sim_sleep(SECONDS(7) - (esp_timer_get_time() - start));
+	twai_shim_get_stats(&after);
+	sim_check(after.installs == before.installs + 2, "filter change applied later");
+}
+
+static void phase_write(void)
+{
+	char data[128];
+	uint16_t value;
+	printf("write\n");
+
+	int64_t start = esp_timer_get_time();
+	mock_broker_inject("wp/write/PROGRAMMSCHALTER", "3");
+	bool done = sim_wait("wp/write_result/PROGRAMMSCHALTER", start, SECONDS(5), data, sizeof(data));
+	sim_check(done && strstr(data, "\"result\":\"ok\"") != NULL, "wp/write/PROGRAMMSCHALTER confirmed");
+	printf("  %s\n", done ? data : "no result");
+	sim_check(wpm_value(0x480, 0x0112, &value) && value == (uint16_t)TranslateString("3", et_little_endian),
+		"PROGRAMMSCHALTER written to the WPM");
+
+	// the second value is superseded by the third before it is sent
+	WRITE_STATS_t before, after;
+	write_get_stats(&before);
+	mock_broker_inject("wp/write/TAG", "5");
+	mock_broker_inject("wp/write/TAG", "6");
+	mock_broker_inject("wp/write/TAG", "7");
+	sim_sleep(SECONDS(5));
+	write_get_stats(&after);
+	sim_check(after.confirmed == before.confirmed + 2 && after.superseded == before.superseded + 1,
+		"burst of 3 writes: 2 confirmed, 1 superseded");
+	sim_check(wpm_value(0x480, 0x0122, &value) && value == (uint16_t)TranslateString("7", et_little_endian),
+		"last value of the burst written to the WPM");
+
+	// one request slot: the read-back of the second waits for the first
+	write_get_stats(&before);
+	mock_broker_inject("wp/write/PROGRAMMSCHALTER", "2");
+	mock_broker_inject("wp/write/TAG", "4");
+	sim_sleep(SECONDS(5));
+	write_get_stats(&after);
+	printf("  confirmed=%"PRIu32" timeouts=%"PRIu32" unverified=%"PRIu32"\n",
+		after.confirmed - before.confirmed, after.timeouts - before.timeouts, after.unverified - before.unverified);
+	sim_check(after.confirmed == before.confirmed + 2, "2 writes at once with one request slot: both confirmed");
+
+	write_get_stats(&before);
+	mock_broker_inject("wp/write/AUSSENTEMP", "10");
+	mock_broker_inject("wp/write/PROGRAMMSCHALTER", "9");
+	sim_sleep(SECONDS(1));
+	write_get_stats(&after);
+	sim_check(after.requested == before.requested, "not writable and out of range values rejected");
+}
+
+static void phase_outage(int seconds)
+{
+	printf("outage: %d s\n", seconds);
+	sim_latency(NULL);
+	SPOOL_STATS_t before, after;
+	spool_get_stats(&before);
+	uint32_t history = sim_count(&s_history);
+	uint32_t reads = sim_count(&s_reads);
+
+	mock_broker_set_connected(false);
+	sim_sleep(SECONDS(seconds));
+	int64_t back = esp_timer_get_time();
+	mock_broker_set_connected(true);
+
+	// the spool is replayed in batches, done when nothing arrives for a while
+	uint32_t last = sim_count(&s_history);
+	int quiet = 0;
+	while (quiet < 3 && esp_timer_get_time() - back < SECONDS(600)) {
+		sim_sleep(SECONDS(1));
+		uint32_t now = sim_count(&s_history);
+		quiet = now == last ? quiet + 1 : 0;
+		last = now;
+	}
+	spool_get_stats(&after);
+	uint32_t spooled = after.written - before.written;
+	uint32_t replayed = sim_count(&s_history) - history;
+	printf("  spooled=%"PRIu32" replayed=%"PRIu32" in %.1f s, wp/read while away=%"PRIu32" flash bytes=%"PRIu32"\n",
+		spooled, replayed, (esp_timer_get_time() - back) / 1e6 - quiet, sim_count(&s_reads) - reads,
+		after.bytesWritten - before.bytesWritten);
+	sim_check(spooled > 0, "values spooled while disconnected");
+	sim_check(replayed == spooled, "every spooled value replayed to wp/history");
+	sim_latency("outage");
+}
+
+static void phase_flood(int seconds)
+{
+	printf("flood: %d s\n", seconds);
+	sim_latency(NULL);
+	VBUS_STATS_t busBefore, busAfter;
+	TWAI_SHIM_STATS_t twaiBefore, twaiAfter;
+	vbus_get_stats(&busBefore);
+	twai_shim_get_stats(&twaiBefore);
+	uint32_t reads = sim_count(&s_reads);
+	int64_t start = esp_timer_get_time();
+
+	wpm_flood(true);
+	sim_sleep(SECONDS(seconds));
+	wpm_flood(false);
+	int64_t us = esp_timer_get_time() - start;
+	sim_sleep(SECONDS(2));
+
+	vbus_get_stats(&busAfter);
+	twai_shim_get_stats(&twaiAfter);
+	uint32_t frames = busAfter.frames - busBefore.frames;
+	uint32_t received = busAfter.toGateway - busBefore.toGateway;
+	uint32_t published = sim_count(&s_reads) - reads;
+	printf("  bus %"PRIu32" frames (%.0f/s, load %.0f%%), received %"PRIu32", filtered %"PRIu32", overrun %"PRIu32", published %"PRIu32" (%.0f/s)\n",
+		frames, frames * 1e6 / us, (busAfter.busyUs - busBefore.busyUs) * 100.0 / us, received,
+		twaiAfter.filtered - twaiBefore.filtered, twaiAfter.overrun - twaiBefore.overrun, published, published * 1e6 / us);
+	sim_check(twaiAfter.overrun == twaiBefore.overrun, "no RX queue overrun");
+	sim_check(published >= received * 95 / 100, "at least 95% of the received values published");
+	sim_latency("flood");
+}
+
+static void sim_summary(void)
+{
+	VBUS_STATS_t bus;
+	TWAI_SHIM_STATS_t twai;
+	WPM_STATS_t wpm;
+	CHANGE_STATS_t change;
+	MSG_POOL_STATS_t pool;
+	MOCK_BROKER_STATS_t broker;
+	vbus_get_stats(&bus);
+	twai_shim_get_stats(&twai);
+	wpm_get_stats(&wpm);
+	change_get_stats(&change);
+	msg_pool_get_stats(&pool);
+	mock_broker_get_stats(&broker);
+	printf("summary\n");
+	printf("  bus frames=%"PRIu32" from gateway=%"PRIu32" to gateway=%"PRIu32" filtered=%"PRIu32" driver installs=%"PRIu32" discarded=%"PRIu32"\n",
+		bus.frames, bus.fromGateway, bus.toGateway, twai.filtered, twai.installs, twai.discarded);
+	printf("  wpm reads=%"PRIu32" answered=%"PRIu32" unknown=%"PRIu32" writes=%"PRIu32" replayed=%"PRIu32"\n",
+		wpm.reads, wpm.answered, wpm.unknown, wpm.writes, wpm.replayed);
+	printf("  change forwarded=%"PRIu32" heartbeats=%"PRIu32" suppressed=%"PRIu32" requested=%"PRIu32"\n",
+		change.forwarded, change.heartbeats, change.suppressed, change.requested);
+	printf("  broker published=%"PRIu32" rejected=%"PRIu32" outbox=%"PRIu32", msg pool taken=%"PRIu32" exhausted=%"PRIu32"\n",
+		broker.published, broker.rejected, broker.outbox, pool.taken, pool.exhausted);
+	sim_check(twai.filtered > 0, "traffic between other devices filtered by the controller");
+
+	char metrics[1024];
+	bool published = sim_wait("wp/sys/metrics", 0, 0, metrics, sizeof(metrics));
+	sim_check(published, "metrics published to wp/sys/metrics");
+	if (published) printf("  %s\n", metrics);
+	// a frame delivered just now may not have been taken by twai_task yet
+	bool counted = false;
+	for (int i = 0; i < 50 && !counted; i++) {
+		twai_shim_get_stats(&twai);
+		counted = metrics_get(METRIC_CAN_RX) == twai.delivered - twai.offline - twai.filtered - twai.overrun - twai.discarded;
+		if (!counted) sim_sleep(10000);
+	}
+	if (!counted) {
+		printf("  can_rx=%"PRIu32", delivered=%"PRIu32" offline=%"PRIu32" filtered=%"PRIu32" overrun=%"PRIu32" discarded=%"PRIu32"\n",
+			metrics_get(METRIC_CAN_RX), twai.delivered, twai.offline, twai.filtered, twai.overrun, twai.discarded);
+	}
+	char prometheus[5120];
+	sim_check(metrics_render_prometheus(prometheus, sizeof(prometheus)) > 0 && counted,
+		"every received frame counted, Prometheus text rendered");
+	sim_check(metrics_get(METRIC_CAN_RX_OVERRUN) == twai.overrun, "RX overruns counted across driver reinstalls");
+}
+
+// Stages of the latency trace (main/trace.c) and its binary dump
+static void phase_trace(void)
+{
+	char latency[512];
+	char dump[8];
+	printf("trace\n");
+	bool published = sim_wait("wp/sys/latency", 0, 0, latency, sizeof(latency));
+	sim_check(published, "latency per stage published to wp/sys/latency");
+	if (published) printf("  %s\n", latency);
+
+	int64_t since = esp_timer_get_time();
+	mock_broker_inject("wp/sys/trace/dump", "");
+	bool dumped = sim_wait("wp/sys/trace", since, SECONDS(2), dump, sizeof(dump));
+	sim_check(dumped && memcmp(dump, "WPTR", 4) == 0, "trace dumped to wp/sys/trace");
+
+	TRACE_STATS_t stats;
+	trace_get_stats(&stats);
+	printf("  trace records=%"PRIu32" lost=%"PRIu32" frames=%"PRIu32" dumps=%"PRIu32"\n",
+		stats.records, stats.lost, stats.frames, stats.dumps);
+	sim_check(stats.frames > 0 && stats.lost == 0, "frames traced up to PUBACK, no record lost");
+}
+
+// dlog_output_t of phase_log(), a PUB line has to name a value published
+// with the same text
+static void sim_log_line(const char *line)
+{
+	puts(line);
+	const char *topic = strstr(line, "PUB: TOPIC=[");
+	const char *data = strstr(line, "] DATA=[");
+	if (topic == NULL || data == NULL) return;
+	topic += 12;
+	char published[96];
+	snprintf(published, sizeof(published), "%.*s %.*s", (int)(data - topic), topic,
+		(int)strlen(data + 8) - 1, data + 8);
+	pthread_mutex_lock(&s_mutex);
+	s_logLines++;
+	bool found = false;
+	for (int i = 0; i < s_nlogPublished && !found; i++) found = strcmp(s_logPublished[i], published) == 0;
+	if (!found) {
+		printf("  not published: %s\n", published);
+		s_logMismatched++;
+	}
+	pthread_mutex_unlock(&s_mutex);
+}
+
+// Level of the deferred log (main/dlog.c) set over MQTT
+static void phase_log(void)
+{
+	DLOG_STATS_t before, debug, after;
+	printf("log\n");
+	pthread_mutex_lock(&s_mutex);
+	s_logPhase = true;
+	pthread_mutex_unlock(&s_mutex);
+	dlog_set_output(sim_log_line);
+	dlog_get_stats(&before);
+	mock_broker_inject("wp/sys/log/level", "debug");
+	// the poll scheduler reads a value every few seconds, a wp/get
+	// answered from the cache is published in any case
+	mock_broker_inject("wp/get/AUSSENTEMP", "");
+	sim_sleep(SECONDS(10));
+	dlog_get_stats(&debug);
+	mock_broker_inject("wp/sys/log/level", "info");
+	sim_sleep(SECONDS(1));
+	dlog_get_stats(&after);
+	sim_sleep(SECONDS(3));
+	dlog_flush();
+	dlog_set_output(NULL);
+	DLOG_STATS_t end;
+	dlog_get_stats(&end);
+	printf("  log written=%"PRIu32" dropped=%"PRIu32" printed=%"PRIu32"\n", end.written, end.dropped, end.printed);
+	sim_check(debug.written > before.written && end.written == after.written,
+		"debug records written only while wp/sys/log/level is debug");
+	sim_check(end.dropped == 0 && end.printed == end.written, "every record formatted, none dropped");
+	pthread_mutex_lock(&s_mutex);
+	s_logPhase = false;
+	printf("  PUB lines=%"PRIu32" mismatched=%"PRIu32"\n", s_logLines, s_logMismatched);
+	sim_check(s_logLines > 0 && s_logMismatched == 0, "PUB lines name the topic and data published");
+	pthread_mutex_unlock(&s_mutex);
+}
+
+// Capture of the frames to the gateway (main/capture.c), dumped in the
+// candump -l format and read back as the host tools do
+static void phase_capture(const char *dir)
+{
+	char path[96];
+	printf("capture\n");
+	mock_broker_inject("wp/sys/capture", "clear");
+	mock_broker_inject("wp/sys/capture", "start receiver=0x680");
+	sim_sleep(SECONDS(60));
+	mock_broker_inject("wp/sys/capture", "stop");
+
+	snprintf(path, sizeof(path), "%s/capture.log", dir);
+	pthread_mutex_lock(&s_mutex);
+	s_captureLog = fopen(path, "w");
+	s_captureEnd = false;
+	pthread_mutex_unlock(&s_mutex);
+	int64_t since = esp_timer_get_time();
+	mock_broker_inject("wp/sys/capture", "dump");
+	bool ended = false;
+	for (int64_t end = since + SECONDS(5); !ended && esp_timer_get_time() < end; ) {
+		sim_sleep(10000);
+		pthread_mutex_lock(&s_mutex);
+		ended = s_captureEnd;
+		pthread_mutex_unlock(&s_mutex);
+	}
+	pthread_mutex_lock(&s_mutex);
+	if (s_captureLog) fclose(s_captureLog);
+	s_captureLog = NULL;
+	pthread_mutex_unlock(&s_mutex);
+
+	uint32_t frames = 0, toGateway = 0;
+	FILE *f = fopen(path, "r");
+	char line[128];
+	while (f && fgets(line, sizeof(line), f) != NULL) {
+		double time;
+		twai_message_t msg;
+		if (!candump_parse(line, &time, &msg)) continue;
+		frames++;
+		ElsterPacketReceive packet = ElsterRawToReceivePacket((uint16_t)msg.identifier, msg.data_length_code, msg.data);
+		if (packet.receiver == 0x680) toGateway++;
+	}
+	if (f) fclose(f);
+
+	CAPTURE_STATS_t stats;
+	capture_get_stats(&stats);
+	char status[256];
+	bool published = sim_wait("wp/sys/capture/status", since, SECONDS(1), status, sizeof(status));
+	printf("  captured frames=%"PRIu32" filtered=%"PRIu32" dropped=%"PRIu32" blocks=%"PRIu32" flash bytes=%"PRIu32", dumped %"PRIu32" lines\n",
+		stats.frames, stats.filtered, stats.dropped, stats.blocks, stats.bytesWritten, frames);
+	sim_check(ended && frames > 0 && frames == stats.frames, "capture dumped to wp/sys/capture/log in the candump -l format");
+	sim_check(toGateway == frames && stats.filtered > 0, "only the frames to 0x680 captured");
+	sim_check(stats.dropped == 0 && stats.corrupt == 0, "no frame dropped, no block corrupt");
+	sim_check(published && strstr(status, "\"active\":false") != NULL, "capture status published to wp/sys/capture/status");
+}
+
+// replay_source_t over a candump -l log
+static bool sim_candump_next(void *ctx, twai_message_t *msg, int64_t *time)
+{
+	char line[128];
+	double seconds;
+	while (fgets(line, sizeof(line), (FILE *)ctx) != NULL) {
+		if (!candump_parse(line, &seconds, msg)) continue;
+		*time = (int64_t)(seconds * 1e6 + 0.5);
+		return true;
+	}
+	return false;
+}
+
+// Waits up to timeout after since for wp/sys/replay/status reporting the
+// end of the replay
+static bool sim_replay_wait(int64_t since, int64_t timeout, char *status, size_t size)
+{
+	int64_t end = esp_timer_get_time() + timeout;
+	while (esp_timer_get_time() < end) {
+		if (sim_wait("wp/sys/replay/status", since, SECONDS(1), status, size) &&
+			strstr(status, "\"active\":false") != NULL) return true;
+		sim_sleep(10000);
+	}
+	return false;
+}
+
+// Recorded frames through the receive path (main/replay.c): the capture of
+// phase_capture() started over MQTT as on the target, the trace of the WPM
+// from the host
+static void phase_replay(const char *trace)
+{
+	char status[384];
+	REPLAY_STATS_t stats;
+	CAPTURE_STATS_t capture;
+	printf("replay\n");
+	capture_get_stats(&capture);
+	// time from the first to the last frame captured, read as replay.c
+	// does, and the values published when received without change filter
+	CAPTURE_READER_t reader;
+	twai_message_t msg;
+	int64_t time, first = 0, last = 0;
+	uint32_t values = 0;
+	capture_reader_init(&reader);
+	for (uint32_t n = 0; capture_reader_next(&reader, &msg, &time); n++) {
+		if (n == 0) first = time;
+		last = time;
+		ElsterPacketReceive packet = ElsterRawToReceivePacket((uint16_t)msg.identifier, msg.data_length_code, msg.data);
+		if (packet.packetType == ELSTER_PT_RESPONSE && packet.tableIndex != ELSTER_NO_TABLE_INDEX) values++;
+	}
+	uint32_t liveDropped = metrics_get(METRIC_CAN_RX_DROPPED);
+	CHANGE_STATS_t changeBefore, changeAfter;
+	change_get_stats(&changeBefore);
+	uint32_t replayed = sim_count(&s_replayed);
+	int64_t since = esp_timer_get_time();
+	mock_broker_inject("wp/sys/replay", "start 10");
+	bool done = sim_replay_wait(since, SECONDS(30), status, sizeof(status));
+	replay_get_stats(&stats);
+	printf("  capture at 10x: %s\n", done ? status : "no report");
+	sim_check(done && stats.frames == capture.frames && stats.telegrams == stats.frames,
+		"every captured frame replayed, report on wp/sys/replay/status");
+	// paced in ticks of 1 ms
+	int64_t pace = stats.injectUs - (last - first) / 10;
+	printf("  captured %.1f s replayed in %.1f s\n", (last - first) / 1e6, stats.injectUs / 1e6);
+	sim_check(last > first && pace > -5000 && pace < 50000, "replayed at 10 times the recorded pace");
+	sim_check(stats.queued == values && stats.published == stats.queued && stats.dropped == 0 &&
+		sim_count(&s_replayed) - replayed == stats.published, "every replayed value published to wp/replay/");
+	// the live traffic goes on meanwhile
+	change_get_stats(&changeAfter);
+	uint32_t filtered = changeAfter.forwarded + changeAfter.heartbeats + changeAfter.suppressed + changeAfter.requested -
+		changeBefore.forwarded - changeBefore.heartbeats - changeBefore.suppressed - changeBefore.requested;
+	printf("  change filter: %"PRIu32" live values meanwhile\n", filtered);
+	sim_check(filtered < values, "replayed values not taken through the change filter");
+
+	FILE *f = fopen(trace, "r");
+	replayed = sim_count(&s_replayed);
+	since = esp_timer_get_time();
+	sim_check(f != NULL && replay_start(sim_candump_next, f, 0), "replay of the trace started");
+	done = f != NULL && sim_replay_wait(since, SECONDS(60), status, sizeof(status));
+	if (f) fclose(f);
+	replay_get_stats(&stats);
+	printf("  trace as fast as possible: %s\n", done ? status : "no report");
+	sim_check(done && stats.queued > 0 && stats.published == stats.queued && stats.dropped == 0 &&
+		sim_count(&s_replayed) - replayed == stats.published, "trace replayed without a drop");
+	sim_check(metrics_get(METRIC_CAN_RX_DROPPED) == liveDropped, "no frame from the bus dropped during the replays");
+}
+
+// -r: one replay of log instead of the phases
+static int sim_replay_log(const char *log, uint32_t speed, const char *stream)
+{
+	char status[384];
+	FILE *f = fopen(log, "r");
+	if (f == NULL) {
+		perror(log);
+		return 2;
+	}
+	if (stream && (s_replayStream = fopen(stream, "w")) == NULL) {
+		perror(stream);
+		fclose(f);
+		return 2;
+	}
+	if (speed) printf("replay %s at %"PRIu32" times the recorded pace\n", log, speed);
+	else printf("replay %s as fast as possible\n", log);
+	int64_t since = esp_timer_get_time();
+	replay_start(sim_candump_next, f, speed);
+	bool done = sim_replay_wait(since, SECONDS(24 * 3600), status, sizeof(status));
+	fclose(f);
+	pthread_mutex_lock(&s_mutex);
+	if (s_replayStream) fclose(s_replayStream);
+	s_replayStream = NULL;
+	pthread_mutex_unlock(&s_mutex);
+	printf("  %s\n", done ? status : "no report");
+	return done ? 0 : 1;
+}
+
+static void sim_remove(const char *dir)
+{
+	DIR *d = opendir(dir);
+	if (d == NULL) return;
+	struct dirent *e;
+	char path[300];
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *trace = SIM_TRACE;
+	double speed = 20;
+	int steady = 300, outage = 120, flood = 20;
+	const char *replayLog = NULL, *replayStream = NULL;
+	uint32_t replaySpeed = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:s:d:o:f:r:x:w:")) != -1) {
+		switch (opt) {
+			case 't': trace = optarg; break;
+			case 's': speed = atof(optarg); break;
+			case 'd': steady = atoi(optarg); break;
+			case 'o': outage = atoi(optarg); break;
+			case 'f': flood = atoi(optarg); break;
+			case 'r': replayLog = optarg; break;
+			case 'x': replaySpeed = strtoul(optarg, NULL, 10); break;
+			case 'w': replayStream = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-t trace] [-s speed] [-d steady s] [-o outage s] [-f flood s]\n"
+					"       %s -r log [-x speed] [-w stream]\n", argv[0], argv[0]);
+				return 2;
+		}
+	}
+	shim_set_speed(speed);
+
+	// stands in for the SPIFFS partition
+	char dir[] = "/tmp/sim_gateway.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 2;
+	}
+	char poll_file[64], spool_prefix[64], capture_prefix[64];
+	snprintf(poll_file, sizeof(poll_file), "%s/poll.csv", dir);
+	snprintf(spool_prefix, sizeof(spool_prefix), "%s/spool", dir);
+	snprintf(capture_prefix, sizeof(capture_prefix), "%s/cap", dir);
+
+	int frames = wpm_load(trace);
+	if (frames <= 0) {
+		fprintf(stderr, "no frames in %s\n", trace);
+		return 2;
+	}
+	printf("trace %s: %d frames, speed %.0fx, files in %s\n", trace, frames, speed, dir);
+	vbus_init(wpm_frame, sim_tap);
+	wpm_start();
+	mock_broker_set_hook(sim_publish);
+	mock_broker_set_connected(true);
+
+	// as in app_main()
+	static const twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(0, 0, TWAI_MODE_NORMAL);
+	static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_20KBITS();
+	ESP_ERROR_CHECK(twai_install(&g_config, &t_config));
+	ESP_ERROR_CHECK(twai_start());
+
+	xQueue_mqtt_tx = xQueueCreate( 32, sizeof(PACKET_t) );
+	configASSERT( xQueue_mqtt_tx );
+	xQueue_twai_tx = xQueueCreate( 10, sizeof(TWAI_t) );
+	configASSERT( xQueue_twai_tx );
+
+	metrics_init();
+	metrics_watch_queue(METRIC_Q_MQTT_TX, xQueue_mqtt_tx);
+	metrics_watch_queue(METRIC_Q_TWAI_TX, xQueue_twai_tx);
+	request_init();
+	change_init();
+	get_init();
+	write_init();
+	poll_init(poll_file);
+	spool_init(spool_prefix);
+	capture_init(capture_prefix);
+	replay_init();
+	mqtt_conn_start();
+
+	TaskHandle_t task;
+	xTaskCreate(mqtt_pub_task, "mqtt_pub", 1024*4, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_MQTT_PUB, task);
+	xTaskCreate(mqtt_sub_task, "mqtt_sub", 1024*4, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_MQTT_SUB, task);
+	xTaskCreate(twai_task, "twai_rx", 1024*6, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_TWAI_RX, task);
+	xTaskCreate(twai_tx_task, "twai_tx", 1024*3, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_TWAI_TX, task);
+	// formats the deferred log when nothing else runs
+	xTaskCreate(dlog_task, "dlog", 1024*3, NULL, tskIDLE_PRIORITY + 1, NULL);
+	xTaskCreate(capture_task, "capture", 1024*3, NULL, tskIDLE_PRIORITY + 1, NULL);
+	xTaskCreate(replay_task, "replay", 1024*3, NULL, tskIDLE_PRIORITY + 1, NULL);
+	// let the subscriptions be made
+	sim_sleep(SECONDS(1));
+
+	if (replayLog) {
+		int ret = sim_replay_log(replayLog, replaySpeed, replayStream);
+		sim_remove(dir);
+		return ret;
+	}
+
+#if CONFIG_WPM_PUBLISH_STATE
+	bool stateOnly = true;
+#else
+	bool stateOnly = false;
+#endif
+	if (stateOnly) {
+		phase_state(steady);
+		phase_get();
+	} else {
+		phase_steady(steady);
+		phase_get();
+		phase_reinstall();
+		phase_write();
+		phase_outage(outage);
+		phase_flood(flood);
+		phase_trace();
+		phase_log();
+		phase_capture(dir);
+		phase_replay(trace);
+	}
+	sim_summary();
+	sim_remove(dir);
+
+	printf("%s, %d check%s failed\n", s_failed ? "FAILED" : "PASSED", s_failed, s_failed == 1 ? "" : "s");
+	return s_failed ? 1 : 0;
+}
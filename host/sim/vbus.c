@@ -0,0 +1,104 @@
+/*
+	Simulated CAN bus. Frames of all nodes wait in one queue and occupy the
+	bus one after the other for their length at the bit rate of the
+	installed driver (without stuff bits), then reach the other side: the
+	gateway's acceptance filter and RX queue, or the simulated devices.
+	Arbitration is first come first served.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <string.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "shim.h"
+
+#include "vbus.h"
+
+#define VBUS_QUEUE_LEN 32
+// SOF, arbitration, control, CRC, ACK, EOF and interframe space of a standard frame
+#define FRAME_OVERHEAD_BITS 47
+
+typedef struct {
+	twai_message_t msg;
+	bool fromGateway;
+	int64_t queued;
+} VBUS_FRAME_t;
+
+static QueueHandle_t s_queue;
+static vbus_node_t s_node;
+static vbus_tap_t s_tap;
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static VBUS_STATS_t s_stats;
+
+static void vbus_task(void *pvParameters)
+{
+	VBUS_FRAME_t frame;
+	int64_t free = 0; // end of the frame on the bus
+	while (1) {
+		xQueueReceive(s_queue, &frame, portMAX_DELAY);
+		uint32_t bitrate = twai_shim_bitrate();
+		int bits = FRAME_OVERHEAD_BITS + 8 * (frame.msg.rtr ? 0 : frame.msg.data_length_code);
+		int64_t duration = bitrate ? (int64_t)bits * 1000000 / bitrate : 0;
+		// back to back while frames wait. After a late wake-up the bus catches
+		// up by at most two frames, a longer burst would overrun the gateway's
+		// RX queue in a way the hardware never does.
+		int64_t earliest = esp_timer_get_time() - 2 * duration;
+		if (free < earliest) free = earliest;
+		if (free < frame.queued) free = frame.queued;
+		free += duration;
+		shim_sleep_until(free);
+
+		if (s_tap) s_tap(&frame.msg, frame.fromGateway);
+		bool received = false;
+		if (frame.fromGateway) {
+			if (s_node) s_node(&frame.msg);
+		} else {
+			received = twai_shim_deliver(&frame.msg);
+		}
+		pthread_mutex_lock(&s_mutex);
+		s_stats.frames++;
+		if (frame.fromGateway) s_stats.fromGateway++;
+		if (received) s_stats.toGateway++;
+		s_stats.busyUs += duration;
+		pthread_mutex_unlock(&s_mutex);
+	}
+}
+
+static bool vbus_queue(const twai_message_t *msg, TickType_t wait, bool fromGateway)
+{
+	VBUS_FRAME_t frame = { .msg = *msg, .fromGateway = fromGateway, .queued = esp_timer_get_time() };
+	return xQueueSend(s_queue, &frame, wait) == pdPASS;
+}
+
+// The TWAI shim's transmit hook
+static bool vbus_gateway_tx(const twai_message_t *msg, TickType_t wait)
+{
+	return vbus_queue(msg, wait, true);
+}
+
+void vbus_init(vbus_node_t node, vbus_tap_t tap)
+{
+	s_node = node;
+	s_tap = tap;
+	s_queue = xQueueCreate(VBUS_QUEUE_LEN, sizeof(VBUS_FRAME_t));
+	configASSERT( s_queue );
+	twai_shim_set_tx(vbus_gateway_tx);
+	xTaskCreate(vbus_task, "vbus", 4096, NULL, 5, NULL);
+}
+
+bool vbus_send(const twai_message_t *msg, TickType_t wait)
+{
+	return vbus_queue(msg, wait, false);
+}
+
+void vbus_get_stats(VBUS_STATS_t *stats)
+{
+	pthread_mutex_lock(&s_mutex);
+	*stats = s_stats;
+	pthread_mutex_unlock(&s_mutex);
+}
@@ -0,0 +1,35 @@
+/*
+	Simulated CAN bus between the gateway's TWAI shim and the WPM.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef VBUS_H
+#define VBUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/twai.h"
+
+// Receives the frames the gateway transmits
+typedef void (*vbus_node_t)(const twai_message_t *msg);
+// Sees every frame when it has been on the bus
+typedef void (*vbus_tap_t)(const twai_message_t *msg, bool fromGateway);
+
+typedef struct {
+	uint32_t frames;        // frames on the bus
+	uint32_t fromGateway;
+	uint32_t toGateway;     // frames that reached the gateway's RX queue
+	int64_t busyUs;         // time the bus was occupied
+} VBUS_STATS_t;
+
+// Starts the bus, node stands for all devices other than the gateway. tap
+// may be NULL.
+void vbus_init(vbus_node_t node, vbus_tap_t tap);
+// Puts a frame of a device on the bus, blocks up to wait while the bus is
+// backed up
+bool vbus_send(const twai_message_t *msg, TickType_t wait);
+void vbus_get_stats(VBUS_STATS_t *stats);
+
+#endif
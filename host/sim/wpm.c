@@ -0,0 +1,257 @@
+/*
+	Simulated WPM answering the gateway from a recorded trace.
+
+	The devices answer a READ after WPM_RESPONSE_US with the next value
+	recorded for it, so values change like they did during the recording.
+	A WRITE replaces the recorded values by the one written. Broadcasts and
+	the traffic between other devices are replayed in a loop. Everything runs in one task that sleeps until the
+	next answer or replayed frame is due.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "elster.h"
+#include "vbus.h"
+#include "wpm.h"
+#include "candump.h"
+
+static const char *TAG = "WPM";
+
+#define PENDING_MAX 32
+
+typedef struct {
+	uint16_t device;
+	uint16_t index;
+	uint8_t count;
+	uint8_t next;        // value answered next
+	uint16_t values[WPM_MAX_SERIES];
+} WPM_VALUE_t;
+
+typedef struct {
+	int64_t offset;      // from the first replayed frame
+	twai_message_t msg;
+} WPM_REPLAY_t;
+
+typedef struct {
+	int64_t due;
+	uint16_t device;
+	uint16_t index;
+} WPM_PENDING_t;
+
+static WPM_VALUE_t s_values[WPM_MAX_VALUES];
+static int s_nvalues;
+static WPM_REPLAY_t s_replay[WPM_MAX_REPLAY];
+static twai_message_t s_broadcasts[WPM_MAX_BROADCASTS]; // for wpm_flood()
+static int s_nbroadcasts;
+static int s_nreplay;
+static int64_t s_period;          // of the replay loop
+static volatile bool s_flood;
+static QueueHandle_t s_frames;
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static WPM_STATS_t s_stats;
+
+// Call with s_mutex held
+static WPM_VALUE_t *wpm_find(uint16_t device, uint16_t index, bool create)
+{
+	for (int i = 0; i < s_nvalues; i++) {
+		if (s_values[i].device == device && s_values[i].index == index) return &s_values[i];
+	}
+	if (!create || s_nvalues >= WPM_MAX_VALUES) return NULL;
+	WPM_VALUE_t *v = &s_values[s_nvalues++];
+	memset(v, 0, sizeof(*v));
+	v->device = device;
+	v->index = index;
+	return v;
+}
+
+int wpm_load(const char *file)
+{
+	FILE *f = fopen(file, "r");
+	if (f == NULL) return -1;
+
+	char line[128];
+	double first = -1, last = 0;
+	int used = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double time;
+		twai_message_t msg;
+		if (line[0] == '#' || !candump_parse(line, &time, &msg) || msg.extd || msg.rtr || msg.data_length_code != 7) continue;
+		ElsterPacketReceive packet = ElsterRawToReceivePacket(msg.identifier, msg.data_length_code, msg.data);
+		if (packet.receiver == 0x680 && packet.packetType == ELSTER_PT_RESPONSE) {
+			WPM_VALUE_t *v = wpm_find(packet.sender, packet.index, true);
+			if (v == NULL || v->count >= WPM_MAX_SERIES) continue;
+			// only changes, a static value is answered the same every time
+			if (v->count > 0 && v->values[v->count - 1] == packet.value) continue;
+			v->values[v->count++] = packet.value;
+			used++;
+		} else if (msg.identifier != 0x680 && packet.receiver != 0x680 && s_nreplay < WPM_MAX_REPLAY) {
+			// broadcasts and what the other devices say to each other
+			if (first < 0) first = time;
+			last = time;
+			s_replay[s_nreplay].offset = (int64_t)((time - first) * 1000000);
+			s_replay[s_nreplay].msg = msg;
+			s_nreplay++;
+			if (packet.receiver == ELSTER_BROADCAST && s_nbroadcasts < WPM_MAX_BROADCASTS) {
+				s_broadcasts[s_nbroadcasts++] = msg;
+			}
+			used++;
+		}
+	}
+	fclose(f);
+	// the loop starts over a second after the last frame
+	s_period = (int64_t)((last - (first < 0 ? 0 : first)) * 1000000) + 1000000;
+	ESP_LOGI(TAG, "%d values, %d frames replayed every %lld ms", s_nvalues, s_nreplay, (long long)s_period / 1000);
+	return used;
+}
+
+static void wpm_answer(const WPM_PENDING_t *p)
+{
+	twai_message_t msg = { .identifier = p->device, .data_length_code = 7 };
+	pthread_mutex_lock(&s_mutex);
+	WPM_VALUE_t *v = wpm_find(p->device, p->index, false);
+	uint16_t value = 0;
+	if (v != NULL) {
+		value = v->values[v->next];
+		v->next = (v->next + 1) % v->count;
+		s_stats.answered++;
+	}
+	pthread_mutex_unlock(&s_mutex);
+	if (v == NULL) return;
+
+	ElsterPacketSend send = { 0x680, ELSTER_PT_RESPONSE, p->index };
+	ElsterPrepareSendPacket(7, msg.data, send);
+	ElsterSetValueDefault(7, msg.data, value);
+	vbus_send(&msg, portMAX_DELAY);
+}
+
+// Takes a frame of the gateway, returns true if an answer is due
+static bool wpm_receive(const twai_message_t *msg, WPM_PENDING_t *pending)
+{
+	if (msg->data_length_code != 7) return false;
+	ElsterPacketReceive packet = ElsterRawToReceivePacket(msg->identifier, msg->data_length_code, msg->data);
+	pthread_mutex_lock(&s_mutex);
+	bool answer = false;
+	if (packet.packetType == ELSTER_PT_READ) {
+		s_stats.reads++;
+		if (wpm_find(packet.receiver, packet.index, false) != NULL) {
+			pending->due = esp_timer_get_time() + WPM_RESPONSE_US;
+			pending->device = packet.receiver;
+			pending->index = packet.index;
+			answer = true;
+		} else {
+			s_stats.unknown++;
+		}
+	} else if (packet.packetType == ELSTER_PT_WRITE) {
+		s_stats.writes++;
+		WPM_VALUE_t *v = wpm_find(packet.receiver, packet.index, true);
+		if (v != NULL) {
+			v->values[0] = packet.value;
+			v->count = 1;
+			v->next = 0;
+		}
+	}
+	pthread_mutex_unlock(&s_mutex);
+	return answer;
+}
+
+static void wpm_task(void *pvParameters)
+{
+	WPM_PENDING_t pending[PENDING_MAX];
+	int npending = 0;
+	int64_t loopStart = esp_timer_get_time();
+	int nextReplay = 0;
+	uint16_t floodValue = 0;
+
+	while (1) {
+		int64_t now = esp_timer_get_time();
+		int64_t due = INT64_MAX;
+		for (int i = 0; i < npending; i++) {
+			if (pending[i].due < due) due = pending[i].due;
+		}
+		if (s_nreplay > 0) {
+			int64_t next = loopStart + s_replay[nextReplay].offset;
+			if (next < due) due = next;
+		}
+		if (s_flood) due = now;
+
+		twai_message_t msg;
+		TickType_t wait = due == INT64_MAX ? portMAX_DELAY : due <= now ? 0 : pdMS_TO_TICKS((due - now) / 1000) + 1;
+		if (xQueueReceive(s_frames, &msg, wait) == pdTRUE) {
+			if (wpm_receive(&msg, &pending[npending]) && npending < PENDING_MAX - 1) npending++;
+			continue;
+		}
+
+		now = esp_timer_get_time();
+		for (int i = 0; i < npending; i++) {
+			if (pending[i].due > now) continue;
+			wpm_answer(&pending[i]);
+			pending[i--] = pending[--npending];
+		}
+		if (s_nreplay > 0 && loopStart + s_replay[nextReplay].offset <= now) {
+			vbus_send(&s_replay[nextReplay].msg, portMAX_DELAY);
+			pthread_mutex_lock(&s_mutex);
+			s_stats.replayed++;
+			pthread_mutex_unlock(&s_mutex);
+			if (++nextReplay == s_nreplay) {
+				nextReplay = 0;
+				loopStart += s_period;
+			}
+		}
+		if (s_flood && s_nbroadcasts > 0) {
+			// the recorded broadcasts with values far enough apart to pass any deadband
+			twai_message_t flood = s_broadcasts[floodValue % s_nbroadcasts];
+			ElsterSetValueDefault(7, flood.data, (floodValue * 7) & 0x7fff);
+			floodValue++;
+			vbus_send(&flood, portMAX_DELAY);
+			pthread_mutex_lock(&s_mutex);
+			s_stats.flood++;
+			pthread_mutex_unlock(&s_mutex);
+		}
+	}
+}
+
+void wpm_start(void)
+{
+	s_frames = xQueueCreate(PENDING_MAX, sizeof(twai_message_t));
+	configASSERT( s_frames );
+	xTaskCreate(wpm_task, "wpm", 4096, NULL, 5, NULL);
+}
+
+void wpm_frame(const twai_message_t *msg)
+{
+	if (xQueueSend(s_frames, msg, 0) != pdPASS) {
+		ESP_LOGW(TAG, "frame of the gateway lost");
+	}
+}
+
+void wpm_flood(bool on)
+{
+	s_flood = on;
+}
+
+bool wpm_value(uint16_t device, uint16_t index, uint16_t *value)
+{
+	pthread_mutex_lock(&s_mutex);
+	WPM_VALUE_t *v = wpm_find(device, index, false);
+	if (v != NULL) *value = v->values[v->next];
+	pthread_mutex_unlock(&s_mutex);
+	return v != NULL;
+}
+
+void wpm_get_stats(WPM_STATS_t *stats)
+{
+	pthread_mutex_lock(&s_mutex);
+	*stats = s_stats;
+	pthread_mutex_unlock(&s_mutex);
+}
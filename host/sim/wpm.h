@@ -0,0 +1,43 @@
+/*
+	Simulated WPM answering the gateway from a recorded trace.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef WPM_H
+#define WPM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/twai.h"
+
+#define WPM_MAX_VALUES   256  // (device, index) pairs
+#define WPM_MAX_SERIES   32   // values kept per pair, answered in turn
+#define WPM_MAX_REPLAY   1024 // broadcasts and traffic between other devices
+#define WPM_MAX_BROADCASTS 64 // sent by wpm_flood()
+#define WPM_RESPONSE_US  20000 // time the devices take to answer a READ
+
+typedef struct {
+	uint32_t reads;      // READs from the gateway
+	uint32_t answered;
+	uint32_t unknown;    // READs for a value not in the trace, not answered
+	uint32_t writes;
+	uint32_t replayed;   // frames of the replay loop
+	uint32_t flood;      // frames sent by wpm_flood()
+} WPM_STATS_t;
+
+// Loads a candump log ("(seconds) can0 ID#DATA"): responses to 0x680 are
+// the values READs are answered with, all frames not from or to 0x680 are
+// replayed with their original spacing over and over. Returns the number of frames used,
+// -1 if the file cannot be read.
+int wpm_load(const char *file);
+void wpm_start(void);
+// vbus node, takes the frames of the gateway
+void wpm_frame(const twai_message_t *msg);
+// Broadcasts changing values as fast as the bus takes them while on
+void wpm_flood(bool on);
+// Value the device holds now, false if unknown
+bool wpm_value(uint16_t device, uint16_t index, uint16_t *value);
+void wpm_get_stats(WPM_STATS_t *stats);
+
+#endif
@@ -0,0 +1,522 @@
+/*
+	Capture of the raw CAN frames to flash, exported in the candump -l format.
+
+	twai_task filters every frame received while a capture runs and copies
+	those that pass into a block of CAPTURE_BLOCK_RECORDS records of 16
+	bytes. A full block (or one not filled up within a minute) is
+	handed to capture_task, which appends it to the flash as one page and
+	returns it to the pool. twai_task never waits for the flash: without a
+	free block the frame is dropped and counted.
+
+	Like the spool, blocks are appended to segment files
+	<prefix>NNNNNNNN.bin of CAPTURE_SEGMENT_SIZE bytes and the oldest
+	segment is deleted when the capture would exceed CONFIG_WPM_CAPTURE_SIZE
+	KB, so the capture is a ring holding the latest frames. The segments
+	survive a reset.
+
+	The time of a record is kept relative to the wall clock time of its
+	block, which is handed over early when a record would not fit into the
+	28 bits for it.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#if CONFIG_WPM_METRICS_HTTP
+#include "esp_http_server.h"
+#endif
+
+#include "elster.h"
+#include "capture.h"
+
+static const char *TAG = "CAPTURE";
+
+#define BLOCKS        4
+#define IDLE_MS       60000
+#define MAX_DELTA_US  (1 << 28)
+#define MAX_SEGMENTS  ((CONFIG_WPM_CAPTURE_SIZE * 1024) / CAPTURE_SEGMENT_SIZE)
+#define FLUSH_WAIT_MS 2000
+
+static char s_prefix[32];
+static bool s_any;                // segments s_first..s_last exist
+static uint32_t s_first;
+static uint32_t s_last;
+static FILE *s_writeFile;         // segment s_last while it is being written
+static uint32_t s_writeSize;
+static SemaphoreHandle_t s_fileMutex;
+
+static CAPTURE_BLOCK_t s_blocks[BLOCKS];
+static QueueHandle_t s_freeQueue;
+static QueueHandle_t s_fullQueue;
+static SemaphoreHandle_t s_blockMutex;
+static CAPTURE_BLOCK_t *s_current;  // filled by twai_task
+static int64_t s_blockStart;        // esp_timer_get_time() of its first record
+static uint32_t s_seq;
+static uint32_t s_pending;          // blocks handed over, not yet written
+
+static CAPTURE_FILTER_t s_filter;  // replaced by capture_start() under s_blockMutex
+static bool s_active;
+static CAPTURE_STATS_t s_stats;
+
+static void capture_path(char *path, size_t size, uint32_t seq)
+{
+	snprintf(path, size, "%s%08"PRIu32".bin", s_prefix, seq);
+}
+
+static int64_t capture_wall_time(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint8_t capture_check(const CAPTURE_BLOCK_t *block)
+{
+	const uint8_t *p = (const uint8_t *)block->records;
+	uint8_t check = 0x5a ^ block->count;
+	for (int i = 0; i < block->count * (int)sizeof(CAPTURE_RECORD_t); i++) check ^= p[i];
+	return check;
+}
+
+void capture_init(const char *prefix)
+{
+	strlcpy(s_prefix, prefix, sizeof(s_prefix));
+	s_fileMutex = xSemaphoreCreateMutex();
+	configASSERT( s_fileMutex );
+	s_blockMutex = xSemaphoreCreateMutex();
+	configASSERT( s_blockMutex );
+	s_freeQueue = xQueueCreate( BLOCKS, sizeof(CAPTURE_BLOCK_t *) );
+	configASSERT( s_freeQueue );
+	s_fullQueue = xQueueCreate( BLOCKS, sizeof(CAPTURE_BLOCK_t *) );
+	configASSERT( s_fullQueue );
+	for (int i = 0; i < BLOCKS; i++) {
+		CAPTURE_BLOCK_t *block = &s_blocks[i];
+		xQueueSend(s_freeQueue, &block, 0);
+	}
+
+	// split "/spiffs/cap" into directory and file name
+	char dir[32];
+	strlcpy(dir, prefix, sizeof(dir));
+	char *slash = strrchr(dir, '/');
+	const char *base = prefix + (slash ? slash - dir + 1 : 0);
+	if (slash) *slash = 0;
+
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		ESP_LOGE(TAG, "Failed to open %s", dir);
+		return;
+	}
+	struct dirent *entry;
+	size_t baselen = strlen(base);
+	while ((entry = readdir(d)) != NULL) {
+		uint32_t seq;
+		if (strncmp(entry->d_name, base, baselen) != 0) continue;
+		if (sscanf(entry->d_name + baselen, "%08"SCNu32".bin", &seq) != 1) continue;
+		if (!s_any || seq < s_first) s_first = seq;
+		if (!s_any || seq > s_last) s_last = seq;
+		s_any = true;
+	}
+	closedir(d);
+	s_stats.segments = s_any ? s_last - s_first + 1 : 0;
+	ESP_LOGI(TAG, "%"PRIu32" segments captured before", s_stats.segments);
+}
+
+static bool capture_match(const CAPTURE_FILTER_t *filter, const twai_message_t *msg)
+{
+	if (filter->ids > 0) {
+		bool found = false;
+		for (int i = 0; i < filter->ids && !found; i++) found = filter->id[i] == msg->identifier;
+		if (!found) return false;
+	}
+	if (filter->receivers == 0 && filter->indexes == 0) return true;
+	if (msg->extd || msg->rtr || msg->data_length_code != 7) return false;
+
+	ElsterPacketReceive packet = ElsterRawToReceivePacket((uint16_t)msg->identifier, 7, msg->data);
+	if (filter->receivers > 0) {
+		bool found = false;
+		for (int i = 0; i < filter->receivers && !found; i++) found = filter->receiver[i] == packet.receiver;
+		if (!found) return false;
+	}
+	if (filter->indexes > 0) {
+		bool found = false;
+		for (int i = 0; i < filter->indexes && !found; i++) found = filter->index[i] == packet.index;
+		if (!found) return false;
+	}
+	return true;
+}
+
+// Passes s_current to capture_task, call with s_blockMutex held
+static void capture_hand_over(void)
+{
+	s_current->seq = s_seq++;
+	s_current->check = capture_check(s_current);
+	__atomic_fetch_add(&s_pending, 1, __ATOMIC_RELAXED);
+	// as many places as blocks, never full
+	xQueueSend(s_fullQueue, &s_current, 0);
+	s_current = NULL;
+}
+
+void capture_frame(const twai_message_t *msg, int64_t rxTime)
+{
+	if (!__atomic_load_n(&s_active, __ATOMIC_ACQUIRE)) return;
+	xSemaphoreTake(s_blockMutex, portMAX_DELAY);
+	if (!capture_match(&s_filter, msg)) {
+		xSemaphoreGive(s_blockMutex);
+		s_stats.filtered++;
+		return;
+	}
+
+	if (s_current != NULL && rxTime - s_blockStart >= MAX_DELTA_US) capture_hand_over();
+	if (s_current == NULL && xQueueReceive(s_freeQueue, &s_current, 0) == pdTRUE) {
+		memcpy(s_current->magic, "CB", 2);
+		s_current->count = 0;
+		s_current->time = capture_wall_time() - (esp_timer_get_time() - rxTime);
+		s_blockStart = rxTime;
+	}
+	if (s_current == NULL) {
+		xSemaphoreGive(s_blockMutex);
+		s_stats.dropped++;
+		return;
+	}
+
+	CAPTURE_RECORD_t *r = &s_current->records[s_current->count++];
+	uint8_t dlc = msg->data_length_code > 8 ? 8 : msg->data_length_code;
+	r->time = (uint32_t)(rxTime - s_blockStart) | (uint32_t)dlc << 28;
+	r->id = (msg->identifier & 0x1fffffff) | (msg->rtr ? 1u << 29 : 0) | (msg->extd ? 1u << 30 : 0);
+	memset(r->data, 0, sizeof(r->data));
+	memcpy(r->data, msg->data, dlc);
+	if (s_current->count == CAPTURE_BLOCK_RECORDS) capture_hand_over();
+	xSemaphoreGive(s_blockMutex);
+	s_stats.frames++;
+}
+
+static void capture_close(void)
+{
+	if (s_writeFile == NULL) return;
+	fclose(s_writeFile);
+	s_writeFile = NULL;
+}
+
+// Call with s_fileMutex held
+static void capture_write(const CAPTURE_BLOCK_t *block)
+{
+	char path[48];
+	if (s_writeFile == NULL) {
+		if (s_any && s_last - s_first + 1 >= MAX_SEGMENTS) {
+			capture_path(path, sizeof(path), s_first);
+			remove(path);
+			s_first++;
+		}
+		uint32_t seq = s_any ? s_last + 1 : 0;
+		capture_path(path, sizeof(path), seq);
+		s_writeFile = fopen(path, "ab");
+		if (s_writeFile == NULL) {
+			ESP_LOGE(TAG, "Failed to open %s for writing", path);
+			return;
+		}
+		if (!s_any) s_first = seq;
+		s_last = seq;
+		s_any = true;
+		s_writeSize = 0;
+		s_stats.segments = s_last - s_first + 1;
+	}
+
+	// one page, written at once
+	if (fwrite(block, sizeof(*block), 1, s_writeFile) != 1 || fflush(s_writeFile) != 0) {
+		ESP_LOGE(TAG, "write failed");
+		capture_close();
+		return;
+	}
+	s_stats.blocks++;
+	s_stats.bytesWritten += sizeof(*block);
+	s_writeSize += sizeof(*block);
+	if (s_writeSize + sizeof(*block) > CAPTURE_SEGMENT_SIZE) capture_close();
+}
+
+void capture_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
+	CAPTURE_BLOCK_t *block;
+	while (1) {
+		if (xQueueReceive(s_fullQueue, &block, pdMS_TO_TICKS(IDLE_MS)) != pdTRUE) {
+			// a block that does not fill up is written anyway
+			xSemaphoreTake(s_blockMutex, portMAX_DELAY);
+			if (s_current != NULL && s_current->count > 0 && esp_timer_get_time() - s_blockStart >= IDLE_MS * 1000LL) {
+				capture_hand_over();
+			}
+			xSemaphoreGive(s_blockMutex);
+			continue;
+		}
+		xSemaphoreTake(s_fileMutex, portMAX_DELAY);
+		capture_write(block);
+		xSemaphoreGive(s_fileMutex);
+		xQueueSend(s_freeQueue, &block, 0);
+		__atomic_fetch_sub(&s_pending, 1, __ATOMIC_RELAXED);
+	}
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+// Hands over the block being filled and waits until capture_task wrote it
+static void capture_flush(void)
+{
+	xSemaphoreTake(s_blockMutex, portMAX_DELAY);
+	if (s_current != NULL && s_current->count > 0) capture_hand_over();
+	xSemaphoreGive(s_blockMutex);
+	for (int i = 0; i < FLUSH_WAIT_MS / 10 && __atomic_load_n(&s_pending, __ATOMIC_RELAXED) > 0; i++) {
+		vTaskDelay(pdMS_TO_TICKS(10));
+	}
+}
+
+static bool capture_parse_values(const char *str, int len, uint32_t *values, uint8_t *count, uint32_t max)
+{
+	while (len > 0) {
+		char *end;
+		uint32_t v = strtoul(str, &end, 0);
+		if (end == str || end - str > len || v > max || *count == CAPTURE_FILTERS) return false;
+		values[(*count)++] = v;
+		len -= end - str;
+		str = end;
+		if (len > 0) {
+			if (*str != ',') return false;
+			str++;
+			len--;
+		}
+	}
+	return true;
+}
+
+bool capture_parse_filter(const char *str, CAPTURE_FILTER_t *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+	while (1) {
+		while (isspace((unsigned char)*str)) str++;
+		if (*str == 0) return true;
+		int len = 0;
+		while (str[len] && !isspace((unsigned char)str[len])) len++;
+		const char *eq = memchr(str, '=', len);
+		if (eq == NULL) return false;
+		int keyLen = eq - str;
+		const char *values = eq + 1;
+		int valuesLen = len - keyLen - 1;
+		uint32_t v[CAPTURE_FILTERS];
+		uint8_t n = 0;
+		if (keyLen == 2 && strncmp(str, "id", 2) == 0) {
+			if (!capture_parse_values(values, valuesLen, filter->id, &filter->ids, 0x1fffffff)) return false;
+		} else if (keyLen == 8 && strncmp(str, "receiver", 8) == 0) {
+			if (!capture_parse_values(values, valuesLen, v, &n, 0xffff)) return false;
+			for (int i = 0; i < n && filter->receivers < CAPTURE_FILTERS; i++) filter->receiver[filter->receivers++] = v[i];
+		} else if (keyLen == 5 && strncmp(str, "index", 5) == 0) {
+			if (!capture_parse_values(values, valuesLen, v, &n, 0xffff)) return false;
+			for (int i = 0; i < n && filter->indexes < CAPTURE_FILTERS; i++) filter->index[filter->indexes++] = v[i];
+		} else {
+			return false;
+		}
+		str += len;
+	}
+}
+
+void capture_start(const CAPTURE_FILTER_t *filter)
+{
+	// not while twai_task matches a frame against the filter
+	xSemaphoreTake(s_blockMutex, portMAX_DELAY);
+	s_filter = *filter;
+	xSemaphoreGive(s_blockMutex);
+	__atomic_store_n(&s_active, true, __ATOMIC_RELEASE);
+	ESP_LOGI(TAG, "started, filter %d ids %d receivers %d indexes", filter->ids, filter->receivers, filter->indexes);
+}
+
+void capture_stop(void)
+{
+	__atomic_store_n(&s_active, false, __ATOMIC_RELEASE);
+	capture_flush();
+	ESP_LOGI(TAG, "stopped, %"PRIu32" frames captured", s_stats.frames);
+}
+
+void capture_clear(void)
+{
+	capture_flush();
+	xSemaphoreTake(s_fileMutex, portMAX_DELAY);
+	capture_close();
+	for (uint32_t seq = s_first; s_any && seq <= s_last; seq++) {
+		char path[48];
+		capture_path(path, sizeof(path), seq);
+		remove(path);
+	}
+	s_any = false;
+	s_stats.segments = 0;
+	xSemaphoreGive(s_fileMutex);
+	ESP_LOGI(TAG, "cleared");
+}
+
+int capture_format_line(char *line, size_t size, int64_t time, const CAPTURE_RECORD_t *record)
+{
+	int64_t t = time + (record->time & 0x0fffffff);
+	int dlc = record->time >> 28;
+	if (dlc > 8) dlc = 8;
+	uint32_t id = record->id & 0x1fffffff;
+	int len = snprintf(line, size, (record->id & (1u << 30)) ? "(%"PRId64".%06d) can0 %08"PRIX32"#" : "(%"PRId64".%06d) can0 %03"PRIX32"#",
+		t / 1000000, (int)(t % 1000000), id);
+	if (record->id & (1u << 29)) {
+		len += snprintf(&line[len], size - len, "R");
+	} else {
+		for (int i = 0; i < dlc; i++) len += snprintf(&line[len], size - len, "%02X", record->data[i]);
+	}
+	len += snprintf(&line[len], size - len, "\n");
+	return (size_t)len < size ? len : -1;
+}
+
+void capture_reader_init(CAPTURE_READER_t *reader)
+{
+	capture_flush();
+	xSemaphoreTake(s_fileMutex, portMAX_DELAY);
+	reader->seq = s_first;
+	xSemaphoreGive(s_fileMutex);
+	reader->offset = 0;
+	reader->next = 0;
+	reader->block.count = 0;
+}
+
+// Reads the next valid block. The file is opened per block, capture_task
+// may append to it meanwhile.
+static bool capture_read_block(CAPTURE_READER_t *reader)
+{
+	bool ok = false;
+	xSemaphoreTake(s_fileMutex, portMAX_DELAY);
+	// the oldest segments may have been deleted meanwhile
+	if (reader->seq < s_first) {
+		reader->seq = s_first;
+		reader->offset = 0;
+	}
+	while (!ok && s_any && reader->seq <= s_last) {
+		char path[48];
+		capture_path(path, sizeof(path), reader->seq);
+		FILE *f = fopen(path, "rb");
+		if (f != NULL && fseek(f, reader->offset, SEEK_SET) == 0 && fread(&reader->block, sizeof(reader->block), 1, f) == 1) {
+			reader->offset += sizeof(reader->block);
+			if (memcmp(reader->block.magic, "CB", 2) == 0 && reader->block.count <= CAPTURE_BLOCK_RECORDS &&
+				reader->block.check == capture_check(&reader->block)) {
+				ok = true;
+			} else {
+				s_stats.corrupt++;
+			}
+		} else {
+			reader->seq++;
+			reader->offset = 0;
+		}
+		if (f != NULL) fclose(f);
+	}
+	xSemaphoreGive(s_fileMutex);
+	reader->next = 0;
+	if (!ok) reader->block.count = 0;
+	return ok;
+}
+
+bool capture_reader_next(void *ctx, twai_message_t *msg, int64_t *time)
+{
+	CAPTURE_READER_t *reader = ctx;
+	while (reader->next >= reader->block.count) {
+		if (!capture_read_block(reader)) return false;
+	}
+	const CAPTURE_RECORD_t *record = &reader->block.records[reader->next++];
+	int dlc = record->time >> 28;
+	memset(msg, 0, sizeof(*msg));
+	msg->identifier = record->id & 0x1fffffff;
+	msg->extd = (record->id >> 30) & 1;
+	msg->rtr = (record->id >> 29) & 1;
+	msg->data_length_code = dlc > 8 ? 8 : dlc;
+	memcpy(msg->data, record->data, sizeof(msg->data));
+	*time = reader->block.time + (record->time & 0x0fffffff);
+	return true;
+}
+
+// s_fileMutex is only held while a block is read, not while emit() sends
+// it: capture_task keeps writing.
+int capture_export(char *buf, size_t size, capture_emit_t emit, void *ctx)
+{
+	CAPTURE_READER_t reader;
+	capture_reader_init(&reader);
+	int frames = 0;
+	size_t len = 0;
+	bool ok = true;
+	while (ok && capture_read_block(&reader)) {
+		for (int i = 0; ok && i < reader.block.count; i++) {
+			if (len + CAPTURE_LINE_SIZE > size) {
+				ok = emit(ctx, buf, len);
+				len = 0;
+			}
+			int n = capture_format_line(&buf[len], size - len, reader.block.time, &reader.block.records[i]);
+			if (n > 0) {
+				len += n;
+				frames++;
+			}
+		}
+	}
+	if (ok && len > 0) ok = emit(ctx, buf, len);
+	ESP_LOGI(TAG, "exported %d frames", frames);
+	return ok ? frames : -1;
+}
+
+int capture_render_status(char *buf, size_t size)
+{
+	CAPTURE_STATS_t stats;
+	capture_get_stats(&stats);
+	int len = snprintf(buf, size,
+		"{\"active\":%s,\"frames\":%"PRIu32",\"filtered\":%"PRIu32",\"dropped\":%"PRIu32",\"blocks\":%"PRIu32
+		",\"corrupt\":%"PRIu32",\"segments\":%"PRIu32",\"size\":%d,\"bytes_written\":%"PRIu32"}",
+		stats.active ? "true" : "false", stats.frames, stats.filtered, stats.dropped, stats.blocks,
+		stats.corrupt, stats.segments, CONFIG_WPM_CAPTURE_SIZE * 1024, stats.bytesWritten);
+	return (len >= 0 && (size_t)len < size) ? len : -1;
+}
+
+#if CONFIG_WPM_METRICS_HTTP
+static bool capture_http_emit(void *ctx, const char *text, size_t len)
+{
+	return httpd_resp_send_chunk((httpd_req_t *)ctx, text, len) == ESP_OK;
+}
+
+static esp_err_t capture_http_get(httpd_req_t *req)
+{
+	// the server has one task, requests are served one after the other
+	static char buf[1024];
+	httpd_resp_set_type(req, "text/plain");
+	if (capture_export(buf, sizeof(buf), capture_http_emit, req) < 0) return ESP_FAIL;
+	return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+void capture_http_register(void *server)
+{
+	if (server == NULL) return;
+	static const httpd_uri_t uri = {
+		.uri = "/capture.log",
+		.method = HTTP_GET,
+		.handler = capture_http_get
+	};
+	httpd_register_uri_handler(server, &uri);
+}
+#else
+void capture_http_register(void *server)
+{
+}
+#endif
+
+void capture_get_stats(CAPTURE_STATS_t *stats)
+{
+	*stats = s_stats;
+	stats->active = __atomic_load_n(&s_active, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,103 @@
+/*
+	Capture of the raw CAN frames to flash, exported in the candump -l format.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "driver/twai.h"
+
+#define CAPTURE_BLOCK_SIZE    256        // a SPIFFS page
+#define CAPTURE_BLOCK_RECORDS 15
+#define CAPTURE_SEGMENT_SIZE  (16 * 1024)
+#define CAPTURE_FILTERS       8          // values per filter kind
+#define CAPTURE_LINE_SIZE     64         // of a candump -l line
+
+typedef struct __attribute__((packed)) {
+	uint32_t time;     // bits 0-27: us after the time of the block, 28-31: dlc
+	uint32_t id;       // bits 0-28: identifier, 29: rtr, 30: extended
+	uint8_t data[8];
+} CAPTURE_RECORD_t;
+
+// Unit of buffering and of writing to flash, little endian as in memory
+typedef struct __attribute__((packed)) {
+	char magic[2];     // "CB"
+	uint8_t count;     // records used
+	uint8_t check;     // xor of the used records, detects torn writes
+	uint32_t seq;      // blocks written since capture_init()
+	int64_t time;      // gettimeofday() of the first record in us
+	CAPTURE_RECORD_t records[CAPTURE_BLOCK_RECORDS];
+} CAPTURE_BLOCK_t;
+
+_Static_assert(sizeof(CAPTURE_BLOCK_t) == CAPTURE_BLOCK_SIZE, "a block is one page");
+
+// A frame is captured if it matches one of the values of every kind given.
+// Receiver and index are those of Elster telegrams, other frames never
+// match them.
+typedef struct {
+	uint8_t ids;
+	uint8_t receivers;
+	uint8_t indexes;
+	uint32_t id[CAPTURE_FILTERS];
+	uint16_t receiver[CAPTURE_FILTERS];
+	uint16_t index[CAPTURE_FILTERS];
+} CAPTURE_FILTER_t;
+
+// Position of capture_reader_next() in the segments on flash
+typedef struct {
+	uint32_t seq;          // segment
+	long offset;           // of the next block in it
+	uint8_t next;          // record of block
+	CAPTURE_BLOCK_t block;
+} CAPTURE_READER_t;
+
+typedef struct {
+	bool active;
+	uint32_t frames;     // captured
+	uint32_t filtered;   // not captured, did not pass the filter
+	uint32_t dropped;    // no free block, flash too slow
+	uint32_t blocks;     // written to flash
+	uint32_t corrupt;    // blocks skipped on export
+	uint32_t segments;   // on flash
+	uint32_t bytesWritten;
+} CAPTURE_STATS_t;
+
+// Picks up the segments of the last run. prefix is e.g. "/spiffs/cap".
+void capture_init(const char *prefix);
+// Writes the filled blocks to flash, lowest priority
+void capture_task(void *pvParameters);
+// Called by twai_task for every frame received
+void capture_frame(const twai_message_t *msg, int64_t rxTime);
+// "id=0x180 receiver=0x680 index=0x000c,0x0112", empty for all frames.
+// Returns false for an invalid filter.
+bool capture_parse_filter(const char *str, CAPTURE_FILTER_t *filter);
+void capture_start(const CAPTURE_FILTER_t *filter);
+// Stops capturing and writes the frames buffered so far
+void capture_stop(void);
+// Deletes everything captured
+void capture_clear(void);
+// Writes the frames captured so far as candump -l lines to emit, in chunks
+// of at most size bytes of buf. Capturing and writing to flash go on, frames
+// written meanwhile are exported too. Returns the number of frames or -1 if
+// emit failed.
+typedef bool (*capture_emit_t)(void *ctx, const char *text, size_t len);
+int capture_export(char *buf, size_t size, capture_emit_t emit, void *ctx);
+// "(1697551234.123456) can0 180#A0790C00F60000"
+int capture_format_line(char *line, size_t size, int64_t time, const CAPTURE_RECORD_t *record);
+// Starts reading at the oldest frame captured so far
+void capture_reader_init(CAPTURE_READER_t *reader);
+// Returns the next frame of ctx, a CAPTURE_READER_t, and its gettimeofday()
+// time in us, false after the last. Fits replay_start().
+bool capture_reader_next(void *ctx, twai_message_t *msg, int64_t *time);
+// {"active":true,"frames":..}. Returns the length or -1 if it does not fit.
+int capture_render_status(char *buf, size_t size);
+// Serves capture_export() on http://<ip>:CONFIG_WPM_METRICS_HTTP_PORT/capture.log
+void capture_http_register(void *server);
+void capture_get_stats(CAPTURE_STATS_t *stats);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+	Last value cache deciding which received values are published.
+
+	Every (sender, index) has the value last published. A new value is only
+	published if it differs from that by more than the deadband or if the
+	value was not published for the heartbeat time. Values of the same index
+	from different devices are kept apart.
+
+	The cache is an open addressing hash table of CHANGE_SLOTS entries. When
+	it is full, values without an entry are always published.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "elster.h"
+#include "change.h"
+
+#define TAG "CHANGE"
+
+typedef struct {
+	uint32_t key;        // sender << 16 | index, 0 = free
+	uint16_t deadband;
+	uint16_t heartbeat;  // seconds, 0 = CONFIG_WPM_HEARTBEAT
+	bool valid;          // value published at least once
+	uint16_t value;      // raw value last published
+	int64_t published;   // esp_timer_get_time() of that
+} CHANGE_t;
+
+static CHANGE_t s_cache[CHANGE_SLOTS];
+static CHANGE_STATS_t s_stats;
+static SemaphoreHandle_t s_mutex;
+
+// Finds the entry of key, creates it if there is room. Call with s_mutex held.
+static CHANGE_t *change_find(uint32_t key)
+{
+	uint32_t slot = (key * 0x9e3779b1u) >> 16;
+	for (int i = 0; i < CHANGE_SLOTS; i++) {
+		CHANGE_t *entry = &s_cache[(slot + i) & (CHANGE_SLOTS - 1)];
+		if (entry->key == key) return entry;
+		if (entry->key == 0) {
+			entry->key = key;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Numeric value of raw in the type's fixed-point units, false if the type has none
+static bool change_numeric(ElsterValueType type, uint16_t raw, int32_t *value)
+{
+	switch (type) {
+		case et_default:
+		case et_dec_val:
+		case et_cent_val:
+		case et_mil_val:
+			*value = (int16_t)raw;
+			return true;
+		case et_byte:
+			*value = (uint8_t)raw;
+			return true;
+		case et_little_endian:
+			*value = (raw >> 8) + 256 * (raw & 0xff);
+			return true;
+		default:
+			return false;
+	}
+}
+
+void change_init(void)
+{
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	memset(s_cache, 0, sizeof(s_cache));
+	memset(&s_stats, 0, sizeof(s_stats));
+}
+
+void change_configure(uint16_t sender, uint16_t index, uint16_t deadband, uint16_t heartbeat)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	CHANGE_t *entry = change_find(((uint32_t)sender << 16) | index);
+	if (entry) {
+		entry->deadband = deadband;
+		entry->heartbeat = heartbeat;
+	}
+	xSemaphoreGive(s_mutex);
+}
+
+bool change_filter(const ElsterPacketReceive *packet, bool force)
+{
+	int64_t now = esp_timer_get_time();
+	bool publish = true;
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	CHANGE_t *entry = change_find(((uint32_t)packet->sender << 16) | packet->index);
+	if (entry && entry->valid) {
+		int32_t last, value;
+		bool changed;
+		if (packet->value == 0x8000 || entry->value == 0x8000) {
+			// "not available" is not a number
+			changed = packet->value != entry->value;
+		} else if (change_numeric(ElsterPacketValueType(packet), packet->value, &value) &&
+			change_numeric(ElsterPacketValueType(packet), entry->value, &last)) {
+			int32_t delta = value > last ? value - last : last - value;
+			changed = delta > entry->deadband;
+		} else {
+			changed = packet->value != entry->value;
+		}
+
+		int64_t heartbeat = (int64_t)(entry->heartbeat ? entry->heartbeat : CONFIG_WPM_HEARTBEAT) * 1000000;
+		if (changed) {
+			s_stats.forwarded++;
+		} else if (heartbeat > 0 && now - entry->published >= heartbeat) {
+			s_stats.heartbeats++;
+		} else if (force) {
+			s_stats.requested++;
+		} else {
+			s_stats.suppressed++;
+			publish = false;
+		}
+	} else {
+		s_stats.forwarded++;
+	}
+	if (entry && publish) {
+		entry->valid = true;
+		entry->value = packet->value;
+		entry->published = now;
+	}
+	if ((s_stats.forwarded + s_stats.heartbeats + s_stats.suppressed + s_stats.requested) % 100 == 0) {
+		ESP_LOGI(TAG, "forwarded=%"PRIu32" heartbeats=%"PRIu32" suppressed=%"PRIu32" requested=%"PRIu32,
+			s_stats.forwarded, s_stats.heartbeats, s_stats.suppressed, s_stats.requested);
+	}
+	xSemaphoreGive(s_mutex);
+	return publish;
+}
+
+void change_get_stats(CHANGE_STATS_t *stats)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	*stats = s_stats;
+	xSemaphoreGive(s_mutex);
+}
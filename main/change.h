@@ -0,0 +1,33 @@
+/*
+	Last value cache deciding which received values are published.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef CHANGE_H
+#define CHANGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "elster.h"
+
+#define CHANGE_SLOTS 256 // power of two
+
+typedef struct {
+	uint32_t forwarded;  // published because the value changed
+	uint32_t heartbeats; // published unchanged because it was silent too long
+	uint32_t suppressed; // not published, within the deadband
+	uint32_t requested;  // published unchanged because it was asked for
+} CHANGE_STATS_t;
+
+void change_init(void);
+// Deadband in the value's raw fixed-point units (0 = any change) and the
+// longest time in seconds an unchanged value is not published
+// (0 = CONFIG_WPM_HEARTBEAT) for the value index of sender.
+void change_configure(uint16_t sender, uint16_t index, uint16_t deadband, uint16_t heartbeat);
+// Returns true if the packet's value is to be published. With force it is
+// published anyway (e.g. asked for by wp/get) and taken as the last value.
+bool change_filter(const ElsterPacketReceive *packet, bool force);
+void change_get_stats(CHANGE_STATS_t *stats);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+	Deferred logging for the hot paths.
+
+	printf() and ESP_LOGx() format and write to the UART in the calling
+	task, which costs twai_task far more than a frame takes on the bus.
+	DLOGx() only copies a format id and up to DLOG_MAX_ARGS integers into a
+	ring, dlog_task formats them at the lowest priority when nothing else
+	runs.
+
+	Any task may write. A writer reserves a slot by advancing the head with
+	a compare and swap while the slot is free, fills it and publishes it by
+	setting its sequence number. dlog_task formats the slots in order up to
+	the first one not yet published. When the ring is full, new records are
+	dropped and counted, the records already written are never overwritten.
+
+	The format strings know two conversions of their own: %N is the name of
+	an Elster table index and %V the value text of a raw value of the table
+	index given to the %N before it. Both are only looked up when the record
+	is formatted.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "elster.h"
+#include "metrics.h"
+#include "dlog.h"
+
+static const char *TAG = "DLOG";
+
+#define RING_SIZE    CONFIG_WPM_DLOG_RING
+#define LINE_SIZE    160
+#define DRAIN_MS     100
+
+_Static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "CONFIG_WPM_DLOG_RING must be a power of two");
+
+typedef struct {
+	const char *tag;
+	const char *format;
+} DLOG_FORMAT_ENTRY_t;
+
+static const DLOG_FORMAT_ENTRY_t s_formats[DLOG_FORMATS] = {
+	[DLOG_CAN_FRAME]     = { "TWAI", "id=0x%03x ext=%u rtr=%u dlc=%u data=%08x%08x" },
+	[DLOG_CAN_DECODED]   = { "ELSTER", "sender: 0x%x, receiver: 0x%x, type: 0x%x, index: 0x%04x, %N, raw: 0x%04x" },
+	[DLOG_CAN_TX_QUEUED] = { "TWAI", "send_2_can id=0x%03x dlc=%u front=%u" },
+	[DLOG_CAN_TX]        = { "TWAI", "tx_msg.identifier=[0x%x] tx_msg.extd=%u" },
+	[DLOG_PUBLISH]       = { "PUB", "TOPIC=[wp/read/%N] DATA=[%V]" },
+};
+
+static const char s_levelLetters[] = "NEWIDV";
+static const char * const s_levelNames[] = { "none", "error", "warn", "info", "debug", "verbose" };
+
+uint8_t dlog_level = ESP_LOG_INFO;
+
+static DLOG_RECORD_t s_ring[RING_SIZE];
+static uint32_t s_head;   // next slot to reserve, advanced by the writers
+static uint32_t s_tail;   // next slot to format, advanced by dlog_flush() only
+static DLOG_STATS_t s_stats;
+static dlog_output_t s_output;
+
+void dlog_write(esp_log_level_t level, DLOG_FORMAT_t format, int nargs, const uint32_t *args)
+{
+	int64_t now = esp_timer_get_time();
+	uint32_t head = __atomic_load_n(&s_head, __ATOMIC_RELAXED);
+	do {
+		if (head - __atomic_load_n(&s_tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+			__atomic_fetch_add(&s_stats.dropped, 1, __ATOMIC_RELAXED);
+			metrics_inc(METRIC_LOG_DROPPED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&s_head, &head, head + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	DLOG_RECORD_t *r = &s_ring[head & (RING_SIZE - 1)];
+	if (nargs > DLOG_MAX_ARGS) nargs = DLOG_MAX_ARGS;
+	r->time = now;
+	r->format = format;
+	r->level = level;
+	r->nargs = nargs;
+	r->reserved = 0;
+	memcpy(r->args, args, nargs * sizeof(uint32_t));
+	// the record is complete before dlog_flush() can see it
+	__atomic_store_n(&r->seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&s_stats.written, 1, __ATOMIC_RELAXED);
+}
+
+// Appends the text of one conversion spec (e.g. "%04x", "%N") with arg.
+// tableIndex is the argument of the last %N, for %V.
+static int dlog_convert(char *buf, size_t size, const char *spec, size_t specLen, uint32_t arg, uint32_t tableIndex)
+{
+	char conv = spec[specLen - 1];
+	if (conv == 'N' || conv == 'V') {
+		ElsterPacketReceive packet = { .tableIndex = conv == 'N' ? arg : tableIndex, .value = arg & 0xffff };
+		char text[ELSTER_VALUE_LEN];   // also holds a name
+		if (conv == 'N') ElsterPacketName(&packet, text);
+		else ElsterPacketValue(&packet, text);
+		// not in the table
+		if (text[0] == 0 && conv == 'N') return snprintf(buf, size, "#%u", (unsigned int)packet.tableIndex);
+		if (text[0] == 0) return snprintf(buf, size, "0x%04x", (unsigned int)packet.value);
+		return snprintf(buf, size, "%s", text);
+	}
+
+	char format[16];
+	if (specLen >= sizeof(format)) return 0;
+	memcpy(format, spec, specLen);
+	format[specLen] = 0;
+	if (conv == 'd' || conv == 'i') return snprintf(buf, size, format, (int)arg);
+	return snprintf(buf, size, format, (unsigned int)arg);
+}
+
+static void dlog_print(const DLOG_RECORD_t *r)
+{
+	char line[LINE_SIZE];
+	if (r->format >= DLOG_FORMATS) return;
+	const DLOG_FORMAT_ENTRY_t *f = &s_formats[r->format];
+	int len = snprintf(line, sizeof(line), "%c (%"PRId64") %s: ",
+		s_levelLetters[r->level < ESP_LOG_VERBOSE ? r->level : ESP_LOG_VERBOSE], r->time / 1000, f->tag);
+
+	int arg = 0;
+	uint32_t tableIndex = ELSTER_NO_TABLE_INDEX;
+	for (const char *p = f->format; *p && len < (int)sizeof(line) - 1; p++) {
+		if (*p != '%' || p[1] == '%') {
+			line[len++] = *p;
+			if (*p == '%') p++;
+			continue;
+		}
+		size_t specLen = strspn(&p[1], "0123456789-+ #") + 2;
+		uint32_t value = arg < r->nargs ? r->args[arg] : 0;
+		arg++;
+		int n = dlog_convert(&line[len], sizeof(line) - len, p, specLen, value, tableIndex);
+		if (p[specLen - 1] == 'N') tableIndex = value;
+		if (n > 0) len += n;
+		if (len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+		p += specLen - 1;
+	}
+	line[len] = 0;
+	if (s_output) s_output(line);
+	else puts(line);
+}
+
+uint32_t dlog_flush(void)
+{
+	uint32_t count = 0;
+	uint32_t tail = s_tail;
+	while (1) {
+		DLOG_RECORD_t *r = &s_ring[tail & (RING_SIZE - 1)];
+		if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1) break;
+		dlog_print(r);
+		tail++;
+		count++;
+		// the slot may be reserved again
+		__atomic_store_n(&s_tail, tail, __ATOMIC_RELEASE);
+	}
+	if (count > 0) {
+		fflush(stdout);
+		__atomic_fetch_add(&s_stats.printed, count, __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+void dlog_set_output(dlog_output_t output)
+{
+	s_output = output;
+}
+
+void dlog_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
+	uint32_t dropped = 0;
+	while (1) {
+		dlog_flush();
+		uint32_t now = __atomic_load_n(&s_stats.dropped, __ATOMIC_RELAXED);
+		if (now != dropped) {
+			ESP_LOGW(TAG, "%"PRIu32" records dropped, ring full", now - dropped);
+			dropped = now;
+		}
+		vTaskDelay(pdMS_TO_TICKS(DRAIN_MS));
+	}
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+void dlog_set_level(esp_log_level_t level)
+{
+	if (level > ESP_LOG_VERBOSE) level = ESP_LOG_VERBOSE;
+	__atomic_store_n(&dlog_level, (uint8_t)level, __ATOMIC_RELAXED);
+	esp_log_level_set("*", level);
+	ESP_LOGW(TAG, "log level %s", s_levelNames[level]);
+}
+
+bool dlog_parse_level(const char *str, esp_log_level_t *level)
+{
+	while (*str == ' ') str++;
+	if (str[0] >= '0' && str[0] <= '5' && (str[1] == 0 || str[1] == '\n' || str[1] == '\r')) {
+		*level = (esp_log_level_t)(str[0] - '0');
+		return true;
+	}
+	for (int i = 0; i <= ESP_LOG_VERBOSE; i++) {
+		size_t len = strlen(s_levelNames[i]);
+		if (strncasecmp(str, s_levelNames[i], len) == 0 && (str[len] == 0 || str[len] == '\n' || str[len] == '\r')) {
+			*level = (esp_log_level_t)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+void dlog_get_stats(DLOG_STATS_t *stats)
+{
+	stats->written = __atomic_load_n(&s_stats.written, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&s_stats.dropped, __ATOMIC_RELAXED);
+	stats->printed = __atomic_load_n(&s_stats.printed, __ATOMIC_RELAXED);
+}
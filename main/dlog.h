@@ -0,0 +1,76 @@
+/*
+	Deferred logging for the hot paths.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef DLOG_H
+#define DLOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_log.h"
+
+// Messages that can be logged deferred. The format strings are in s_formats
+// of dlog.c, in this order.
+typedef enum {
+	DLOG_CAN_FRAME = 0,   // identifier, ext/rtr/dlc, data[0..3], data[4..7]
+	DLOG_CAN_DECODED,     // sender, receiver, type, index, table index, raw value
+	DLOG_CAN_TX_QUEUED,   // identifier, dlc, front
+	DLOG_CAN_TX,          // identifier, extd
+	DLOG_PUBLISH,         // table index, raw value
+	DLOG_FORMATS
+} DLOG_FORMAT_t;
+
+#define DLOG_MAX_ARGS 6
+
+// A record is written by any task and formatted later by dlog_task
+typedef struct {
+	int64_t time;       // esp_timer_get_time()
+	uint32_t seq;       // position in the ring + 1, set last
+	uint8_t format;     // DLOG_FORMAT_t
+	uint8_t level;      // esp_log_level_t
+	uint8_t nargs;
+	uint8_t reserved;
+	uint32_t args[DLOG_MAX_ARGS];
+} DLOG_RECORD_t;
+
+typedef struct {
+	uint32_t written;
+	uint32_t dropped;   // ring full
+	uint32_t printed;
+} DLOG_STATS_t;
+
+// Current level of the deferred log, set by dlog_set_level()
+extern uint8_t dlog_level;
+
+void dlog_write(esp_log_level_t level, DLOG_FORMAT_t format, int nargs, const uint32_t *args);
+
+// The arguments are evaluated only when level is enabled. Every argument
+// is stored as uint32_t.
+#define DLOG_LEVEL(level, format, ...) do { \
+		if ((level) <= dlog_level) { \
+			const uint32_t dlogArgs_[] = { __VA_ARGS__ }; \
+			dlog_write(level, format, sizeof(dlogArgs_) / sizeof(dlogArgs_[0]), dlogArgs_); \
+		} \
+	} while (0)
+#define DLOGE(format, ...) DLOG_LEVEL(ESP_LOG_ERROR, format, __VA_ARGS__)
+#define DLOGW(format, ...) DLOG_LEVEL(ESP_LOG_WARN, format, __VA_ARGS__)
+#define DLOGI(format, ...) DLOG_LEVEL(ESP_LOG_INFO, format, __VA_ARGS__)
+#define DLOGD(format, ...) DLOG_LEVEL(ESP_LOG_DEBUG, format, __VA_ARGS__)
+#define DLOGV(format, ...) DLOG_LEVEL(ESP_LOG_VERBOSE, format, __VA_ARGS__)
+
+// Sets the level of the deferred log and of esp_log for all tags
+void dlog_set_level(esp_log_level_t level);
+// "none", "error", "warn", "info", "debug", "verbose" or 0-5
+bool dlog_parse_level(const char *str, esp_log_level_t *level);
+// Formatted lines go to output instead of stdout, NULL for stdout again
+typedef void (*dlog_output_t)(const char *line);
+void dlog_set_output(dlog_output_t output);
+// Formats the records to stdout, lowest priority
+void dlog_task(void *pvParameters);
+// Formats all written records, returns how many
+uint32_t dlog_flush(void);
+void dlog_get_stats(DLOG_STATS_t *stats);
+
+#endif
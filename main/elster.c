@@ -22,12 +22,13 @@
 #include "esp_log.h"
 #include "elster.h"
 #include "elsterTable.inc"
+#include "elsterTableGen.inc"
 
 static const char *TAG = "ELSTER";
 
 #define High(A)     (sizeof(A)/sizeof(A[0]) - 1)
 
-static signed short ElsterTabIndex[0x10000];
+_Static_assert(ELSTER_NAME_COUNT <= 0xFFFF, "ElsterNameRef is 16 bit");
 
 static const char * ElsterTypeStr[] =
 {
@@ -48,6 +49,56 @@ static const char * ElsterTypeStr[] =
 
 static bool Get_Time(const char * str, uint16_t * hour, uint16_t * min);
 
+// Integer only formatting helpers for SetValueType(). They replace sprintf
+// ("%d", "%2.2d" and "%.1f" etc. of a fixed-point value) and produce the same
+// bytes without pulling in the (double) printf machinery.
+static char * PutUInt(char * Val, uint32_t Value, uint8_t MinDigits)
+{
+  char buf[10];
+  uint8_t len = 0;
+
+  do
+  {
+    buf[len++] = (char)('0' + Value % 10);
+    Value /= 10;
+  } while (Value || len < MinDigits);
+
+  while (len)
+    *Val++ = buf[--len];
+  *Val = 0;
+  return Val;
+}
+
+static char * PutInt(char * Val, int32_t Value)
+{
+  if (Value < 0)
+  {
+    *Val++ = '-';
+    return PutUInt(Val, (uint32_t)(-Value), 1);
+  }
+  return PutUInt(Val, (uint32_t) Value, 1);
+}
+
+// Value / 10^Decimals with exactly Decimals digits after the point
+static char * PutFixed(char * Val, int16_t Value, uint8_t Decimals)
+{
+  static const uint16_t Scale[] = { 1, 10, 100, 1000 };
+  uint32_t abs = Value < 0 ? (uint32_t)(-(int32_t)Value) : (uint32_t)Value;
+
+  if (Value < 0)
+    *Val++ = '-';
+  Val = PutUInt(Val, abs / Scale[Decimals], 1);
+  *Val++ = '.';
+  return PutUInt(Val, abs % Scale[Decimals], Decimals);
+}
+
+static char * PutChar(char * Val, char c)
+{
+  *Val++ = c;
+  *Val = 0;
+  return Val;
+}
+
 void SetValueType(char * Val, uint8_t Type, uint16_t Value)
 {
    if (Value == 0x8000)
@@ -56,23 +107,23 @@ void SetValueType(char * Val, uint8_t Type, uint16_t Value)
    switch (Type)
    {
      case et_byte:
-       sprintf(Val, "%d", (uint8_t)Value);
+       PutUInt(Val, (uint8_t)Value, 1);
        break;
 
      case et_dec_val:
-       sprintf(Val, "%.1f", ((double)((int16_t)Value)) / 10.0);
+       PutFixed(Val, (int16_t)Value, 1);
        break;
 
      case et_cent_val:
-       sprintf(Val, "%.2f", ((double)((int16_t)Value)) / 100.0);
+       PutFixed(Val, (int16_t)Value, 2);
        break;
 
      case et_mil_val:
-       sprintf(Val, "%.3f", ((double)((int16_t)Value)) / 1000.0);
+       PutFixed(Val, (int16_t)Value, 3);
        break;
 
      case et_little_endian:
-       sprintf(Val, "%d", (Value >> 8) + 256*(Value & 0xff));
+       PutUInt(Val, (Value >> 8) + 256*(Value & 0xff), 1);
        break;
        
      case et_little_bool:
@@ -97,52 +148,59 @@ void SetValueType(char * Val, uint8_t Type, uint16_t Value)
        break;
 
      case et_zeit:
-       sprintf(Val, "%2.2d:%2.2d", Value & 0xff, Value >> 8);
+       Val = PutUInt(Val, Value & 0xff, 2);
+       Val = PutChar(Val, ':');
+       PutUInt(Val, Value >> 8, 2);
        break;
 
      case et_datum:
-       sprintf(Val, "%2.2d.%2.2d.", Value >> 8, Value & 0xff);
+       Val = PutUInt(Val, Value >> 8, 2);
+       Val = PutChar(Val, '.');
+       Val = PutUInt(Val, Value & 0xff, 2);
+       PutChar(Val, '.');
        break;
 
      case et_time_domain:
        if (Value & 0x8080)
          strcpy(Val, "not used time domain");
        else
-         sprintf(Val, "%2.2d:%2.2d-%2.2d:%2.2d",
-                 (Value >> 8) / 4, 15*((Value >> 8) % 4),
-                 (Value & 0xff) / 4, 15*(Value % 4));
+       {
+         Val = PutUInt(Val, (Value >> 8) / 4, 2);
+         Val = PutChar(Val, ':');
+         Val = PutUInt(Val, 15*((Value >> 8) % 4), 2);
+         Val = PutChar(Val, '-');
+         Val = PutUInt(Val, (Value & 0xff) / 4, 2);
+         Val = PutChar(Val, ':');
+         PutUInt(Val, 15*(Value % 4), 2);
+       }
        break;
 
      case et_dev_nr:
        if (Value >= 0x80)
          strcpy(Val, "--");
        else
-         sprintf(Val, "%d", Value + 1);
+         PutUInt(Val, Value + 1, 1);
        break;
 
      case et_dev_id:
-       sprintf(Val, "%d-%2.2d", (Value >> 8), Value & 0xff);
+       Val = PutUInt(Val, Value >> 8, 1);
+       Val = PutChar(Val, '-');
+       PutUInt(Val, Value & 0xff, 2);
        break;
 
      case et_err_nr:
-     {
-       int idx = -1;
-       for (unsigned i = 0; i <= High(ErrorList); i++)
-         if (ErrorList[i].Index == Value)
-         {
-           idx = i;
-           break;
-         }
-       if (idx >= 0)
-         strcpy(Val, ErrorList[idx].Name);
+       if (Value < ELSTER_ERROR_SLOTS && ElsterErrorSlot[Value] <= High(ErrorList))
+         strcpy(Val, ErrorList[ElsterErrorSlot[Value]].Name);
        else
-         sprintf(Val, "ERR %d", Value);
+       {
+         strcpy(Val, "ERR ");
+         PutUInt(Val + 4, Value, 1);
+       }
        break;
-     }
 
      case et_default:
      default:
-       sprintf(Val, "%d", (signed short)Value);
+       PutInt(Val, (signed short)Value);
        break;
    }
 }
@@ -165,18 +223,57 @@ void SetDoubleType(char * Val, unsigned char Type, double Value)
   }
 }
 
+// Must match elster_hash() in gen_elster_table.py
+static inline uint32_t ElsterHash(uint32_t key, uint32_t seed)
+{
+  key ^= seed * 0x9e3779b1u;
+  key ^= key >> 16;
+  key *= 0x85ebca6bu;
+  key ^= key >> 13;
+  key *= 0xc2b2ae35u;
+  key ^= key >> 16;
+  return key;
+}
+
+// Perfect hash lookup: one bucket seed and one slot read, independent of the
+// number of rows in the table.
 int GetElsterTableIndex(uint16_t Index)
 {
-  return ElsterTabIndex[Index];
+  uint32_t bucket = ElsterHash(Index, 0) % ELSTER_HASH_BUCKETS;
+  uint32_t slot = ElsterHash(Index, ElsterHashSeed[bucket] + 1u) & (ELSTER_HASH_SLOTS - 1);
+  uint16_t row = ElsterHashSlot[slot];
+
+  if (row < ELSTER_TABLE_ROWS && ElsterKeys[row] == Index)
+    return row;
+
+  return -1;
 }
 
-const char * GetElsterTableName(uint16_t Index)
+// Decodes name number NameRef from the front coded ElsterNamePool: starting
+// at the block's first (complete) name every following name overwrites the
+// buffer behind the prefix it shares with its predecessor.
+static const char * GetElsterName(uint16_t NameRef, char * Name)
 {
-  int ind = GetElsterTableIndex(Index);
-  if (ind >= 0)
-    return ElsterTable[ind].Name;
-  else
-    return "";
+  const uint8_t * p = &ElsterNamePool[ElsterNameBlock[NameRef / ELSTER_NAME_BLOCK]];
+
+  for (uint16_t i = 0; i <= NameRef % ELSTER_NAME_BLOCK; i++)
+  {
+    uint8_t len = *p++;
+    while ((Name[len++] = (char) *p++) != 0)
+      ;
+  }
+  return Name;
+}
+
+bool GetElsterTableEntry(uint16_t TableIndex, ElsterIndex * Entry, char * Name)
+{
+  if (TableIndex >= ELSTER_TABLE_ROWS)
+    return false;
+
+  Entry->Name = GetElsterName(ElsterNameRef[TableIndex], Name);
+  Entry->Index = ElsterKeys[TableIndex];
+  Entry->Type = (ElsterValueType) ElsterTypes[TableIndex];
+  return true;
 }
 
 ElsterValueType GetElsterType(const char * str)
@@ -198,13 +295,6 @@ const char * ElsterTypeToName(ElsterValueType Type)
   return ElsterTypeStr[et_default];
 }
 
-const ElsterIndex * GetElsterIndex(uint16_t Index)
-{
-  int Ind = GetElsterTableIndex(Index);
-
-  return Ind >= 0 ? &ElsterTable[Ind] : NULL;
-}
-
 // bool FormElsterTable(const KCanFrame & Frame, char * str)
 // {
 //   strcpy(str, "?");
@@ -229,19 +319,42 @@ const ElsterIndex * GetElsterIndex(uint16_t Index)
 //   return true;
 // }
 
-const ElsterIndex * GetElsterIndexFromString(const char * str)
+// Must match elster_name_hash() in gen_elster_table.py (FNV-1a)
+static inline uint32_t ElsterNameHash(const char * str)
 {
-  for (int i = 0; i <= (int) High(ElsterTable); i++)
-    if (!strcmp(str, ElsterTable[i].Name))
-      return &ElsterTable[i];
+  uint32_t h = 0x811c9dc5u;
+  while (*str)
+  {
+    h ^= (uint8_t) *str++;
+    h *= 0x01000193u;
+  }
+  return h;
+}
 
-  return NULL;
+// Perfect hash over the table names: hashing and the final compare are both
+// O(strlen(str)), independent of the number of rows in the table.
+int GetElsterTableIndexFromString(const char * str)
+{
+  char name[ELSTER_NAME_LEN];
+
+  if (str == NULL)
+    return -1;
+
+  uint32_t h = ElsterNameHash(str);
+  uint32_t bucket = ElsterHash(h, 0) % ELSTER_NAME_BUCKETS;
+  uint32_t slot = ElsterHash(h, ElsterNameSeed[bucket] + 1u) & (ELSTER_NAME_SLOTS - 1);
+  uint16_t row = ElsterNameSlot[slot];
+
+  if (row < ELSTER_TABLE_ROWS && !strcmp(str, GetElsterName(ElsterNameRef[row], name)))
+    return row;
+
+  return -1;
 }
 
 uint16_t getElsterReceiver(uint8_t length, uint8_t const * const data)
 {
   if (length < 2 || data[1] == 0x79)
-    return 0xFF;
+    return ELSTER_BROADCAST;
 
   return (((uint16_t)(data[0] & 0xf0)) << 3) | (uint16_t)(data[1] & 0x7f);
 }
@@ -326,35 +439,49 @@ uint16_t getElsterRawValue(uint8_t length, uint8_t const * const data)
 
 ElsterPacketReceive ElsterRawToReceivePacket(uint16_t sender, uint8_t length, uint8_t const * const data)
 {
-  ElsterPacketReceive p;
+  ElsterPacketReceive p = { sender, 0xFF, 0xFF, 0xFFFF, ELSTER_NO_TABLE_INDEX, ELSTER_PT_invalid };
   if (length != 7)
   {
     ESP_LOGE(TAG,"ParseElster failed: invalid length");
-    p.packetType = ELSTER_PT_invalid;
     return p;
   }
 
-  p.sender = sender;
   p.receiver = getElsterReceiver(length, data);
   p.packetType = getElsterPacketType(length, data);
   p.index = getElsterIndex(length, data);
-  uint16_t rawValue = getElsterRawValue(length, data);
+  p.value = getElsterRawValue(length, data);
 
-  for (uint16_t tableIndex = 0; tableIndex <= High(ElsterTable); tableIndex++)
+  int tableIndex = GetElsterTableIndex(p.index);
+  if (tableIndex >= 0)
   {
-      if (ElsterTable[tableIndex].Index == p.index)
-      {
-          p.valueType = ElsterTable[tableIndex].Type;
-          SetValueType(p.value, p.valueType, rawValue);
-          strncpy(p.indexName, ElsterTable[tableIndex].Name, sizeof(p.indexName));
-          ESP_LOGI(TAG, "sender: 0x%x, receiver: 0x%x, type: 0x%x, index: 0x%04x, %d (%s), val: %s", p.sender, p.receiver, p.packetType, p.index, tableIndex, p.indexName, p.value);
-          break;
-      }
+      p.tableIndex = (uint16_t) tableIndex;
   }
 
   return p;
 }
 
+const char * ElsterPacketName(const ElsterPacketReceive * packet, char * Name)
+{
+  if (packet->tableIndex < ELSTER_TABLE_ROWS)
+    return GetElsterName(ElsterNameRef[packet->tableIndex], Name);
+
+  Name[0] = 0;
+  return Name;
+}
+
+ElsterValueType ElsterPacketValueType(const ElsterPacketReceive * packet)
+{
+  if (packet->tableIndex < ELSTER_TABLE_ROWS)
+    return (ElsterValueType) ElsterTypes[packet->tableIndex];
+
+  return et_default;
+}
+
+void ElsterPacketValue(const ElsterPacketReceive * packet, char * Val)
+{
+  SetValueType(Val, ElsterPacketValueType(packet), packet->value);
+}
+
 void ElsterPrepareSendPacket(uint8_t length, uint8_t * const data, ElsterPacketSend packet)
 {
   if (length != 7 || data == NULL)
@@ -71,15 +71,19 @@ typedef enum
   ELSTER_PT_invalid = 8
 } ElsterPacketType;
 
+#define ELSTER_NO_TABLE_INDEX 0xFFFF
+#define ELSTER_BROADCAST      0xFF    // receiver of the periodic 0x79 telegrams
+
+// Received packet as it travels through the queues. Name and value text are
+// only rendered by the sink (ElsterPacketName / ElsterPacketValue).
 typedef struct
 {
   uint16_t sender;
   uint16_t receiver;
-  ElsterPacketType packetType;
-  ElsterValueType valueType;
   uint16_t index;
-  char indexName[64];
-  char value[64];
+  uint16_t value;       // raw value
+  uint16_t tableIndex;  // row in ElsterTable or ELSTER_NO_TABLE_INDEX
+  uint8_t packetType;   // ElsterPacketType
 } ElsterPacketReceive;
 
 typedef struct
@@ -89,8 +93,14 @@ typedef struct
   uint16_t index;
 } ElsterPacketSend;
 
-const ElsterIndex * GetElsterIndex(uint16_t Index);
-const ElsterIndex * GetElsterIndexFromString(const char * str);
+#define ELSTER_NAME_LEN 48  // size of a buffer for a table name
+#define ELSTER_VALUE_LEN 64 // size of a buffer for ElsterPacketValue()
+
+// Row (table index) of an Elster index / name in the table, -1 if unknown
+int GetElsterTableIndex(uint16_t Index);
+int GetElsterTableIndexFromString(const char * str);
+// Entry->Name is decoded into Name (ELSTER_NAME_LEN bytes)
+bool GetElsterTableEntry(uint16_t TableIndex, ElsterIndex * Entry, char * Name);
 ElsterValueType GetElsterType(const char * str);
 void SetValueType(char * Val, uint8_t Type, uint16_t Value);
 void SetDoubleType(char * Val, unsigned char Type, double Value);
@@ -99,6 +109,9 @@ const char * ElsterTypeToName(ElsterValueType Type);
 uint32_t TranslateString(const char * str, uint8_t elster_type);
 
 ElsterPacketReceive ElsterRawToReceivePacket(uint16_t sender, uint8_t length, uint8_t const * const data);
+const char * ElsterPacketName(const ElsterPacketReceive * packet, char * Name);
+ElsterValueType ElsterPacketValueType(const ElsterPacketReceive * packet);
+void ElsterPacketValue(const ElsterPacketReceive * packet, char * Val);
 
 void ElsterPrepareSendPacket(uint8_t length, uint8_t * const data, ElsterPacketSend packet);
 void ElsterSetValueDefault(uint8_t length, uint8_t * const data, uint32_t value);
@@ -0,0 +1,248 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+#
+# Generates the flash resident Elster table for elsterTable.inc.
+#
+# The rows of ElsterTable[] (those not commented out) are turned into a
+# struct of arrays, sorted by Elster index:
+#
+#   ElsterKeys[]       Elster index of each row
+#   ElsterTypes[]      ElsterValueType of each row, one byte per row
+#   ElsterNameRef[]    number of the row's name in the name pool
+#   ElsterNamePool[]   deduplicated, alphabetically sorted names, front coded
+#                      in blocks of ELSTER_NAME_BLOCK names: every name is
+#                      stored as <length of prefix shared with the previous
+#                      name> <rest of the name> '\0'; the first name of a
+#                      block is stored completely
+#   ElsterNameBlock[]  pool offset of each block
+#
+# Two perfect hashes are emitted on top: Elster index -> row and name -> row.
+# Both use a "hash and displace" scheme: every key falls into a bucket, and
+# each bucket gets a seed that places all of its keys into free slots of a
+# power of two sized slot table. The lookups in elster.c
+# (GetElsterTableIndex, GetElsterTableIndexFromString) must use the same
+# ElsterHash() and ElsterNameHash() as below.
+#
+# Additionally ErrorList[] gets a direct error number -> row index so that
+# SetValueType() does not have to search it.
+#
+# usage: gen_elster_table.py <elsterTable.inc> <output.inc>
+
+import re
+import sys
+
+ROW_RE = re.compile(r'\{\s*"([^"]+)"\s*,\s*(0x[0-9a-fA-F]+|\d+)\s*,\s*(\w+)\s*\}')
+ERROR_RE = re.compile(r'\{\s*(0x[0-9a-fA-F]+|\d+)\s*,\s*"([^"]*)"\s*\}')
+EMPTY = 0xFFFF
+MAX_SEED = 0xFFFF
+NAME_BLOCK = 16
+NAME_LEN = 48  # ELSTER_NAME_LEN in elster.h
+ARRAY_RE = re.compile(r'static const (\w+) \w+\[\w*\] =\n\{\n(.*?)\};', re.S)
+CTYPE_SIZE = {'uint8_t': 1, 'uint16_t': 2, 'uint32_t': 4}
+
+# order of ElsterValueType in elster.h
+VALUE_TYPES = [
+	'et_default', 'et_dec_val', 'et_cent_val', 'et_mil_val', 'et_byte',
+	'et_bool', 'et_little_bool', 'et_double_val', 'et_triple_val',
+	'et_little_endian', 'et_betriebsart', 'et_zeit', 'et_datum',
+	'et_time_domain', 'et_dev_nr', 'et_err_nr', 'et_dev_id',
+]
+
+
+def elster_hash(key, seed):
+	key = (key ^ (seed * 0x9e3779b1)) & 0xFFFFFFFF
+	key ^= key >> 16
+	key = (key * 0x85ebca6b) & 0xFFFFFFFF
+	key ^= key >> 13
+	key = (key * 0xc2b2ae35) & 0xFFFFFFFF
+	key ^= key >> 16
+	return key
+
+
+def elster_name_hash(name):
+	# FNV-1a
+	h = 0x811c9dc5
+	for c in name.encode('utf-8'):
+		h = ((h ^ c) * 0x01000193) & 0xFFFFFFFF
+	return h
+
+
+def read_block(text, name, regex):
+	start = text.index(name + '[]')
+	end = text.index('};', start)
+	rows = []
+	for line in text[start:end].splitlines():
+		if line.strip().startswith('//'):
+			continue
+		m = regex.search(line)
+		if m:
+			rows.append(m.groups())
+	return rows
+
+
+def value_type(et):
+	if et.isdigit():
+		return int(et)
+	return VALUE_TYPES.index(et)
+
+
+def read_table(path):
+	with open(path, encoding='utf-8') as f:
+		text = f.read()
+	rows = [(name, int(index, 0), value_type(et)) for name, index, et in read_block(text, 'ElsterTable', ROW_RE)]
+	errors = [int(index, 0) for index, _ in read_block(text, 'ErrorList', ERROR_RE)]
+	return rows, errors
+
+
+def build_hash(keys):
+	"""keys: list of (key, row). Returns (seeds, slots)."""
+	n = max(len(keys), 1)
+	nbuckets = max((n + 1) // 2, 1)
+	nslots = 1
+	while nslots * 9 < n * 10:
+		nslots <<= 1
+
+	buckets = [[] for _ in range(nbuckets)]
+	for key, row in keys:
+		buckets[elster_hash(key, 0) % nbuckets].append((key, row))
+
+	seeds = [0] * nbuckets
+	slots = [EMPTY] * nslots
+	for b in sorted(range(nbuckets), key=lambda b: -len(buckets[b])):
+		if not buckets[b]:
+			break
+		for seed in range(MAX_SEED + 1):
+			pos = [elster_hash(key, seed + 1) & (nslots - 1) for key, _ in buckets[b]]
+			if len(set(pos)) == len(pos) and all(slots[p] == EMPTY for p in pos):
+				break
+		else:
+			sys.exit('gen_elster_table: no seed found for bucket %d' % b)
+		seeds[b] = seed
+		for p, (_, row) in zip(pos, buckets[b]):
+			slots[p] = row
+	return seeds, slots
+
+
+def build_name_pool(names):
+	"""names: sorted, unique. Returns (pool bytes, block offsets)."""
+	pool = bytearray()
+	blocks = []
+	prev = b''
+	for i, name in enumerate(names):
+		name = name.encode('utf-8')
+		prefix = 0
+		if i % NAME_BLOCK == 0:
+			blocks.append(len(pool))
+		else:
+			while prefix < min(len(prev), len(name), 0xFF) and prev[prefix] == name[prefix]:
+				prefix += 1
+		pool.append(prefix)
+		pool += name[prefix:] + b'\0'
+		prev = name
+	return pool, blocks
+
+
+def array_bytes(text):
+	"""Bytes of the c_array()s in a generated file."""
+	total = 0
+	for ctype, values in ARRAY_RE.findall(text):
+		total += CTYPE_SIZE[ctype] * values.count(',')
+	return total
+
+
+def c_array(ctype, name, size, values, fmt='0x%04x', per_line=12):
+	out = 'static const %s %s[%s] =\n{\n' % (ctype, name, size)
+	for i in range(0, len(values), per_line):
+		out += '  ' + ', '.join(fmt % v for v in values[i:i + per_line]) + ',\n'
+	return out + '};\n\n'
+
+
+def main():
+	if len(sys.argv) != 3:
+		sys.exit('usage: gen_elster_table.py <elsterTable.inc> <output.inc>')
+
+	source, errors = read_table(sys.argv[1])
+
+	# like the former linear search the first row of a duplicated index wins
+	rows = []
+	seen = set()
+	for name, index, et in source:
+		if index not in seen:
+			seen.add(index)
+			rows.append((name, index, et))
+	rows.sort(key=lambda r: r[1])
+	if not rows or len(rows) >= EMPTY:
+		sys.exit('gen_elster_table: invalid number of rows')
+	if max(len(name.encode('utf-8')) for name, _, _ in rows) >= NAME_LEN:
+		sys.exit('gen_elster_table: name longer than ELSTER_NAME_LEN')
+
+	names = sorted(set(name for name, _, _ in rows), key=lambda n: n.encode('utf-8'))
+	name_ids = dict((name, i) for i, name in enumerate(names))
+	pool, blocks = build_name_pool(names)
+
+	keys = [(index, row) for row, (_, index, _) in enumerate(rows)]
+
+	# a name used by several rows resolves to the first of them in elsterTable.inc
+	row_of_index = dict((index, row) for row, (_, index, _) in enumerate(rows))
+	name_rows = {}
+	for name, index, _ in source:
+		row = row_of_index[index]
+		if rows[row][0] == name:
+			name_rows.setdefault(name, row)
+	name_keys = [(elster_name_hash(name), row) for name, row in name_rows.items()]
+	if len(set(h for h, _ in name_keys)) != len(name_keys):
+		sys.exit('gen_elster_table: name hash collision')
+
+	if len(errors) >= 0xFF or max(errors, default=0) > 0xFF:
+		sys.exit('gen_elster_table: ErrorList does not fit the error index')
+	error_slots = [0xFF] * (max(errors, default=0) + 1)
+	for row, index in enumerate(errors):
+		if error_slots[index] == 0xFF:
+			error_slots[index] = row
+
+	seeds, slots = build_hash(keys)
+	name_seeds, name_slots = build_hash(name_keys)
+	block_type = 'uint16_t' if len(pool) <= 0xFFFF else 'uint32_t'
+
+	out = '// Generated by gen_elster_table.py from elsterTable.inc - do not edit!\n\n'
+	out += '#define ELSTER_TABLE_ROWS    %d\n' % len(rows)
+	out += '#define ELSTER_NAME_COUNT    %d\n' % len(names)
+	out += '#define ELSTER_NAME_BLOCK    %d\n' % NAME_BLOCK
+	out += '#define ELSTER_HASH_BUCKETS  %d\n' % len(seeds)
+	out += '#define ELSTER_HASH_SLOTS    %d\n' % len(slots)
+	out += '#define ELSTER_NAME_BUCKETS  %d\n' % len(name_seeds)
+	out += '#define ELSTER_NAME_SLOTS    %d\n' % len(name_slots)
+	out += '#define ELSTER_ERROR_SLOTS   %d\n\n' % len(error_slots)
+	out += c_array('uint16_t', 'ElsterKeys', 'ELSTER_TABLE_ROWS', [r[1] for r in rows])
+	out += c_array('uint8_t', 'ElsterTypes', 'ELSTER_TABLE_ROWS', [r[2] for r in rows], '%2d', 24)
+	out += c_array('uint16_t', 'ElsterNameRef', 'ELSTER_TABLE_ROWS', [name_ids[r[0]] for r in rows])
+	out += c_array(block_type, 'ElsterNameBlock', '', blocks)
+	out += c_array('uint8_t', 'ElsterNamePool', '', pool, '0x%02x', 16)
+	out += c_array('uint16_t', 'ElsterHashSeed', 'ELSTER_HASH_BUCKETS', seeds)
+	out += c_array('uint16_t', 'ElsterHashSlot', 'ELSTER_HASH_SLOTS', slots)
+	out += c_array('uint16_t', 'ElsterNameSeed', 'ELSTER_NAME_BUCKETS', name_seeds)
+	out += c_array('uint16_t', 'ElsterNameSlot', 'ELSTER_NAME_SLOTS', name_slots)
+	out += c_array('uint8_t', 'ElsterErrorSlot', 'ELSTER_ERROR_SLOTS', error_slots, '0x%02x')
+
+	# The size of the arrays only, without alignment and the code using them;
+	# 'idf.py size' tells what the image grew by.
+	try:
+		with open(sys.argv[2]) as f:
+			previous = array_bytes(f.read())
+	except OSError:
+		previous = None
+	with open(sys.argv[2], 'w') as f:
+		f.write(out)
+
+	generated = array_bytes(out)
+	print('gen_elster_table: %d rows, %d names, name pool %d bytes (%d uncompressed)' %
+		(len(rows), len(names), len(pool), sum(len(n.encode('utf-8')) + 1 for n in names)))
+	if previous is None:
+		print('gen_elster_table: tables %d bytes of flash' % generated)
+	else:
+		print('gen_elster_table: tables %d bytes of flash, %+d bytes compared to the previous %s' %
+			(generated, generated - previous, sys.argv[2]))
+
+
+if __name__ == '__main__':
+	main()
@@ -0,0 +1,188 @@
+/*
+	On-demand reads requested through wp/get.
+
+	Every received value is kept with its receive time per (sender, index).
+	A wp/get for a value younger than CONFIG_WPM_GET_MAX_AGE is answered from
+	this cache right away. Otherwise a READ is sent through the in-flight
+	table, which folds requests for a value already in flight into the one
+	bus transaction, and the entry is marked as waiting: the answer is then
+	published even if the change filter would hold it back.
+
+	The receiver of a name is taken from the poll list, then from the device
+	that sent the value last, CONFIG_WPM_GET_RECEIVER otherwise.
+
+	The cache is an open addressing hash table of GET_SLOTS entries like the
+	one in change.c. When it is full, values without an entry are read every
+	time.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "elster.h"
+#include "mqtt.h"
+#include "request.h"
+#include "poll.h"
+#include "get.h"
+
+static const char *TAG = "GET";
+
+#define MAX_AGE_US ((int64_t)CONFIG_WPM_GET_MAX_AGE * 1000000)
+// a wp/get waits as long as the in-flight table retries
+#define WAIT_US    (((int64_t)CONFIG_WPM_REQUEST_TIMEOUT_MS * 1000) << (CONFIG_WPM_REQUEST_RETRIES + 1))
+
+typedef struct {
+	uint32_t key;        // sender << 16 | index, 0 = free
+	uint16_t value;      // raw value last received
+	uint8_t packetType;
+	int64_t received;    // esp_timer_get_time() of that, 0 = none yet
+	int64_t requested;   // wp/get waiting since, 0 = none
+} GET_t;
+
+static GET_t s_cache[GET_SLOTS];
+static GET_STATS_t s_stats;
+static SemaphoreHandle_t s_mutex;
+
+extern QueueHandle_t xQueue_mqtt_tx;
+
+// Finds the entry of key, creates it if there is room. Call with s_mutex held.
+static GET_t *get_find(uint32_t key)
+{
+	uint32_t slot = (key * 0x9e3779b1u) >> 16;
+	for (int i = 0; i < GET_SLOTS; i++) {
+		GET_t *entry = &s_cache[(slot + i) & (GET_SLOTS - 1)];
+		if (entry->key == key) return entry;
+		if (entry->key == 0) {
+			entry->key = key;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Device that sent index last, 0 if none. Call with s_mutex held.
+static uint16_t get_sender(uint16_t index)
+{
+	uint16_t sender = 0;
+	int64_t latest = 0;
+	for (int i = 0; i < GET_SLOTS; i++) {
+		if ((s_cache[i].key & 0xffff) == index && s_cache[i].received > latest) {
+			latest = s_cache[i].received;
+			sender = s_cache[i].key >> 16;
+		}
+	}
+	return sender;
+}
+
+void get_init(void)
+{
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	memset(s_cache, 0, sizeof(s_cache));
+	memset(&s_stats, 0, sizeof(s_stats));
+}
+
+void get_request(const char *name)
+{
+	int64_t now = esp_timer_get_time();
+
+	int tableIndex = GetElsterTableIndexFromString(name);
+	ElsterIndex entry;
+	char entryName[ELSTER_NAME_LEN];
+	if (tableIndex < 0 || !GetElsterTableEntry(tableIndex, &entry, entryName)) {
+		ESP_LOGW(TAG, "unknown parameter %s", name);
+		xSemaphoreTake(s_mutex, portMAX_DELAY);
+		s_stats.unknown++;
+		xSemaphoreGive(s_mutex);
+		return;
+	}
+
+	uint16_t receiver;
+	bool polled = poll_receiver(entry.Index, &receiver);
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	s_stats.requests++;
+	if (!polled) {
+		receiver = get_sender(entry.Index);
+		if (receiver == 0) receiver = CONFIG_WPM_GET_RECEIVER;
+	}
+	GET_t *cached = get_find(((uint32_t)receiver << 16) | entry.Index);
+	if (cached && cached->received != 0 && now - cached->received < MAX_AGE_US) {
+		PACKET_t packet = {
+			.answer = true,
+			.cached = true,
+			.packet = {
+				.sender = receiver,
+				.receiver = 0x680,
+				.index = entry.Index,
+				.value = cached->value,
+				.tableIndex = tableIndex,
+				.packetType = cached->packetType
+			}
+		};
+		s_stats.cached++;
+		xSemaphoreGive(s_mutex);
+		ESP_LOGD(TAG, "%s from cache", name);
+		if (xQueueSend(xQueue_mqtt_tx, &packet, 0) != pdPASS) {
+			ESP_LOGW(TAG, "%s: publish queue full", name);
+			xSemaphoreTake(s_mutex, portMAX_DELAY);
+			s_stats.dropped++;
+			xSemaphoreGive(s_mutex);
+		}
+		return;
+	}
+	bool waiting = cached && cached->requested != 0 && now - cached->requested < WAIT_US;
+	if (waiting) {
+		s_stats.coalesced++;
+	} else {
+		if (cached) cached->requested = now;
+		s_stats.sent++;
+	}
+	if (s_stats.requests % 20 == 0) {
+		ESP_LOGI(TAG, "requests=%"PRIu32" cached=%"PRIu32" coalesced=%"PRIu32" sent=%"PRIu32" unknown=%"PRIu32" dropped=%"PRIu32,
+			s_stats.requests, s_stats.cached, s_stats.coalesced, s_stats.sent, s_stats.unknown, s_stats.dropped);
+	}
+	xSemaphoreGive(s_mutex);
+
+	// request_read() joins a read of the poll scheduler that is in flight
+	if (!waiting && !request_read(receiver, entry.Index)) {
+		ESP_LOGW(TAG, "%s: no free request slot", name);
+		xSemaphoreTake(s_mutex, portMAX_DELAY);
+		if (cached) cached->requested = 0;
+		xSemaphoreGive(s_mutex);
+	}
+}
+
+bool get_value(const ElsterPacketReceive *packet)
+{
+	int64_t now = esp_timer_get_time();
+	bool requested = false;
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	GET_t *entry = get_find(((uint32_t)packet->sender << 16) | packet->index);
+	if (entry) {
+		requested = entry->requested != 0 && now - entry->requested < WAIT_US;
+		entry->requested = 0;
+		entry->value = packet->value;
+		entry->packetType = packet->packetType;
+		entry->received = now;
+	}
+	xSemaphoreGive(s_mutex);
+	return requested;
+}
+
+void get_get_stats(GET_STATS_t *stats)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	*stats = s_stats;
+	xSemaphoreGive(s_mutex);
+}
@@ -0,0 +1,34 @@
+/*
+	On-demand reads requested through wp/get.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef GET_H
+#define GET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "elster.h"
+
+#define GET_SLOTS 256 // power of two
+
+typedef struct {
+	uint32_t requests;  // names asked for
+	uint32_t cached;    // answered from the cache
+	uint32_t coalesced; // joined a read already in flight
+	uint32_t sent;      // reads put on the bus
+	uint32_t unknown;   // names not in the Elster table
+	uint32_t dropped;   // answers from the cache not queued, xQueue_mqtt_tx full
+} GET_STATS_t;
+
+void get_init(void);
+// Answers the value name from the cache if it is younger than
+// CONFIG_WPM_GET_MAX_AGE, otherwise reads it from the WPM.
+void get_request(const char *name);
+// Called for every received value. Returns true if a wp/get waits for it,
+// it is then to be published even if unchanged.
+bool get_value(const ElsterPacketReceive *packet);
+void get_get_stats(GET_STATS_t *stats);
+
+#endif
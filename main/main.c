@@ -25,15 +25,26 @@
 #include "nvs_flash.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_spiffs.h"
 #include "driver/twai.h" // Update from V4.2
 #include "mdns.h"
 
+#include "elster.h"
 #include "mqtt.h"
+#include "request.h"
+#include "poll.h"
+#include "change.h"
+#include "spool.h"
+#include "get.h"
+#include "write.h"
+#include "mqtt_conn.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "capture.h"
+#include "replay.h"
 
 #define TAG	"MAIN"
 
-static const twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
-
 #if CONFIG_CAN_BITRATE_20
 static const twai_timing_config_t t_config = TWAI_TIMING_CONFIG_20KBITS();
 #define BITRATE "Bitrate is 20 Kbit/s"
@@ -413,9 +424,47 @@ void dump_table(TOPIC_t *topics, int16_t ntopic)
 
 }
 
+esp_err_t mountSPIFFS(char * partition_label, char * base_path)
+{
+	ESP_LOGI(TAG, "Initializing SPIFFS file system");
+
+	esp_vfs_spiffs_conf_t conf = {
+		.base_path = base_path,
+		.partition_label = partition_label,
+		.max_files = 5,
+		.format_if_mount_failed = true
+	};
+
+	// Use settings defined above to initialize and mount SPIFFS filesystem.
+	// Note: esp_vfs_spiffs_register is an all-in-one convenience function.
+	esp_err_t ret = esp_vfs_spiffs_register(&conf);
+
+	if (ret != ESP_OK) {
+		if (ret == ESP_FAIL) {
+			ESP_LOGE(TAG, "Failed to mount or format filesystem");
+		} else if (ret == ESP_ERR_NOT_FOUND) {
+			ESP_LOGE(TAG, "Failed to find SPIFFS partition");
+		} else {
+			ESP_LOGE(TAG, "Failed to initialize SPIFFS (%s)", esp_err_to_name(ret));
+		}
+		return ret;
+	}
+
+	size_t total = 0, used = 0;
+	ret = esp_spiffs_info(partition_label, &total, &used);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
+	} else {
+		ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+	}
+	return ret;
+}
+
 void mqtt_pub_task(void *pvParameters);
 void mqtt_sub_task(void *pvParameters);
 void twai_task(void *pvParameters);
+void twai_tx_task(void *pvParameters);
+esp_err_t twai_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config);
 
 
 void app_main()
@@ -450,18 +499,64 @@ void app_main()
 	ESP_LOGI(TAG, "CRX_GPIO=%d",CONFIG_CRX_GPIO);
 
 	static const twai_general_config_t g_config = TWAI_GENERAL_CONFIG_DEFAULT(CONFIG_CTX_GPIO, CONFIG_CRX_GPIO, TWAI_MODE_NORMAL);
-	ESP_ERROR_CHECK(twai_driver_install(&g_config, &t_config, &f_config));
+	ESP_ERROR_CHECK(twai_install(&g_config, &t_config));
 	ESP_LOGI(TAG, "Driver installed");
 	ESP_ERROR_CHECK(twai_start());
 	ESP_LOGI(TAG, "Driver started");
 
 	// Create Queue
-	xQueue_mqtt_tx = xQueueCreate( 10, sizeof(MQTT_t) );
+	xQueue_mqtt_tx = xQueueCreate( 32, sizeof(PACKET_t) );
 	configASSERT( xQueue_mqtt_tx );
-	xQueue_twai_tx = xQueueCreate( 10, sizeof(twai_message_t) );
+	xQueue_twai_tx = xQueueCreate( 10, sizeof(TWAI_t) );
 	configASSERT( xQueue_twai_tx );
 
-	xTaskCreate(mqtt_pub_task, "mqtt_pub", 1024*4, NULL, 2, NULL);
-	xTaskCreate(mqtt_sub_task, "mqtt_sub", 1024*4, NULL, 2, NULL);
-	xTaskCreate(twai_task, "twai_rx", 1024*6, NULL, 2, NULL);
+	metrics_init();
+	metrics_watch_queue(METRIC_Q_MQTT_TX, xQueue_mqtt_tx);
+	metrics_watch_queue(METRIC_Q_TWAI_TX, xQueue_twai_tx);
+	request_init();
+	change_init();
+	get_init();
+	write_init();
+
+	// Mount SPIFFS, the poll list and the spool live there
+	mountSPIFFS("storage", "/spiffs");
+	poll_init("/spiffs/poll.csv");
+#if CONFIG_WPM_SPOOL
+	spool_init("/spiffs/spool");
+#endif
+#if CONFIG_WPM_CAPTURE
+	capture_init("/spiffs/cap");
+#endif
+#if CONFIG_WPM_REPLAY
+	replay_init();
+#endif
+
+	// One MQTT connection for publishing and subscribing
+	mqtt_conn_start();
+#if CONFIG_WPM_METRICS_HTTP
+	metrics_http_start();
+#endif
+#if CONFIG_WPM_CAPTURE && CONFIG_WPM_METRICS_HTTP
+	capture_http_register(metrics_http_server());
+#endif
+
+	TaskHandle_t task;
+	xTaskCreate(mqtt_pub_task, "mqtt_pub", 1024*4, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_MQTT_PUB, task);
+	xTaskCreate(mqtt_sub_task, "mqtt_sub", 1024*4, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_MQTT_SUB, task);
+	xTaskCreate(twai_task, "twai_rx", 1024*6, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_TWAI_RX, task);
+	xTaskCreate(twai_tx_task, "twai_tx", 1024*3, NULL, 2, &task);
+	metrics_watch_task(METRIC_STACK_TWAI_TX, task);
+	// formats the deferred log when nothing else runs
+	xTaskCreate(dlog_task, "dlog", 1024*3, NULL, tskIDLE_PRIORITY + 1, NULL);
+#if CONFIG_WPM_CAPTURE
+	// writes the captured frames to flash
+	xTaskCreate(capture_task, "capture", 1024*3, NULL, tskIDLE_PRIORITY + 1, NULL);
+#endif
+#if CONFIG_WPM_REPLAY
+	// injects the frames of wp/sys/replay, below the tasks it feeds
+	xTaskCreate(replay_task, "replay", 1024*3, NULL, tskIDLE_PRIORITY + 1, NULL);
+#endif
 }
@@ -0,0 +1,278 @@
+/*
+	Registry of runtime counters and gauges.
+
+	Every metric is a uint32_t in metrics_values[], indexed by METRIC_t. The
+	tasks update counters in place with one relaxed atomic operation, so
+	counting costs a few cycles and takes no lock. Gauges that can be read at
+	any time (heap, stack watermarks, queue depths, TWAI status) are only
+	read by metrics_sample() when a document is rendered. The peak queue
+	depths are raised where a message is queued. The error counters of the
+	TWAI driver restart from 0 when it is installed again, they are added
+	up here.
+
+	The metrics are published as one JSON document on wp/sys/metrics every
+	CONFIG_WPM_METRICS_PERIOD seconds (mqtt_pub.c) and, with
+	CONFIG_WPM_METRICS_HTTP, served in Prometheus text format.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "driver/twai.h"
+#include "sdkconfig.h"
+#if CONFIG_WPM_METRICS_HTTP
+#include "esp_http_server.h"
+#endif
+
+#include "metrics.h"
+#include "request.h"
+#include "msg_pool.h"
+#include "spool.h"
+
+#define TAG "METRICS"
+
+#if CONFIG_CAN_BITRATE_20
+#define CAN_BITRATE 20000
+#elif CONFIG_CAN_BITRATE_25
+#define CAN_BITRATE 25000
+#elif CONFIG_CAN_BITRATE_50
+#define CAN_BITRATE 50000
+#elif CONFIG_CAN_BITRATE_100
+#define CAN_BITRATE 100000
+#elif CONFIG_CAN_BITRATE_125
+#define CAN_BITRATE 125000
+#elif CONFIG_CAN_BITRATE_250
+#define CAN_BITRATE 250000
+#elif CONFIG_CAN_BITRATE_500
+#define CAN_BITRATE 500000
+#elif CONFIG_CAN_BITRATE_800
+#define CAN_BITRATE 800000
+#else
+#define CAN_BITRATE 1000000
+#endif
+
+typedef enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE
+} METRIC_TYPE_t;
+
+typedef struct {
+	const char *name;
+	METRIC_TYPE_t type;
+	const char *help;
+} METRIC_INFO_t;
+
+static const METRIC_INFO_t s_info[METRICS] = {
+	[METRIC_UPTIME]           = { "uptime",           METRIC_GAUGE,   "Seconds since boot" },
+	[METRIC_HEAP_FREE]        = { "heap_free",        METRIC_GAUGE,   "Free heap in bytes" },
+	[METRIC_HEAP_MIN]         = { "heap_min",         METRIC_GAUGE,   "Least free heap since boot in bytes" },
+	[METRIC_CAN_RX]           = { "can_rx",           METRIC_COUNTER, "Frames received from the TWAI controller" },
+	[METRIC_CAN_RX_USED]      = { "can_rx_used",      METRIC_COUNTER, "Received frames used" },
+	[METRIC_CAN_RX_REJECTED]  = { "can_rx_rejected",  METRIC_COUNTER, "Received frames rejected in software" },
+	[METRIC_CAN_RX_DROPPED]   = { "can_rx_dropped",   METRIC_COUNTER, "Values dropped because the publish queue was full" },
+	[METRIC_CAN_TX]           = { "can_tx",           METRIC_COUNTER, "Frames handed to the TWAI driver" },
+	[METRIC_CAN_TX_FAILED]    = { "can_tx_failed",    METRIC_COUNTER, "Frames the TWAI driver did not take" },
+	[METRIC_CAN_TX_DROPPED]   = { "can_tx_dropped",   METRIC_COUNTER, "Frames dropped because the transmit queue was full" },
+	[METRIC_CAN_BITS]         = { "can_bits",         METRIC_COUNTER, "Bits of the frames received and sent, without stuff bits" },
+	[METRIC_CAN_LOAD]         = { "can_load",         METRIC_GAUGE,   "Bus load in permille by the frames received and sent since the last sample" },
+	[METRIC_CAN_STATE]        = { "can_state",        METRIC_GAUGE,   "TWAI state, 0 stopped, 1 running, 2 bus-off, 3 recovering" },
+	[METRIC_CAN_BUS_OFF]      = { "can_bus_off",      METRIC_COUNTER, "Times the TWAI controller went bus-off" },
+	[METRIC_CAN_TX_ERRORS]    = { "can_tec",          METRIC_GAUGE,   "TWAI transmit error counter" },
+	[METRIC_CAN_RX_ERRORS]    = { "can_rec",          METRIC_GAUGE,   "TWAI receive error counter" },
+	[METRIC_CAN_RX_MISSED]    = { "can_rx_missed",    METRIC_COUNTER, "Frames lost because the driver RX queue was full" },
+	[METRIC_CAN_RX_OVERRUN]   = { "can_rx_overrun",   METRIC_COUNTER, "Frames lost by an RX FIFO overrun" },
+	[METRIC_CAN_ARB_LOST]     = { "can_arb_lost",     METRIC_COUNTER, "Lost arbitrations" },
+	[METRIC_CAN_BUS_ERRORS]   = { "can_bus_errors",   METRIC_COUNTER, "Bus errors" },
+	[METRIC_Q_MQTT_TX]        = { "q_pub",            METRIC_GAUGE,   "Values waiting for mqtt_pub_task" },
+	[METRIC_Q_MQTT_TX_PEAK]   = { "q_pub_peak",       METRIC_GAUGE,   "Most values waiting for mqtt_pub_task" },
+	[METRIC_Q_TWAI_TX]        = { "q_can_tx",         METRIC_GAUGE,   "Frames waiting for twai_tx_task" },
+	[METRIC_Q_TWAI_TX_PEAK]   = { "q_can_tx_peak",    METRIC_GAUGE,   "Most frames waiting for twai_tx_task" },
+	[METRIC_Q_SUB]            = { "q_sub",            METRIC_GAUGE,   "Messages waiting for mqtt_sub_task" },
+	[METRIC_Q_SUB_PEAK]       = { "q_sub_peak",       METRIC_GAUGE,   "Most messages waiting for mqtt_sub_task" },
+	[METRIC_SUB_DROPPED]      = { "sub_dropped",      METRIC_COUNTER, "Subscribed messages dropped because the queue was full" },
+	[METRIC_POOL_EXHAUSTED]   = { "pool_exhausted",   METRIC_COUNTER, "Subscribed messages dropped for want of a buffer" },
+	[METRIC_REQUEST_TIMEOUTS] = { "request_timeouts", METRIC_COUNTER, "Read requests given up without response" },
+	[METRIC_SPOOL_DROPPED]    = { "spool_dropped",    METRIC_COUNTER, "Spooled values dropped because the spool was full" },
+	[METRIC_LOG_DROPPED]      = { "log_dropped",      METRIC_COUNTER, "Deferred log records dropped because the ring was full" },
+	[METRIC_STACK_TWAI_RX]    = { "stack_can_rx",     METRIC_GAUGE,   "Least free stack of twai_task in bytes" },
+	[METRIC_STACK_TWAI_TX]    = { "stack_can_tx",     METRIC_GAUGE,   "Least free stack of twai_tx_task in bytes" },
+	[METRIC_STACK_MQTT_PUB]   = { "stack_pub",        METRIC_GAUGE,   "Least free stack of mqtt_pub_task in bytes" },
+	[METRIC_STACK_MQTT_SUB]   = { "stack_sub",        METRIC_GAUGE,   "Least free stack of mqtt_sub_task in bytes" },
+};
+
+uint32_t metrics_values[METRICS];
+
+static SemaphoreHandle_t s_mutex;
+static TaskHandle_t s_tasks[METRICS];
+static QueueHandle_t s_queues[METRICS];
+static uint32_t s_lastBits;
+static int64_t s_lastSample;
+
+// Driver counters added up in metrics_values[], their values then
+static const METRIC_t s_twaiMetrics[] = {
+	METRIC_CAN_RX_MISSED, METRIC_CAN_RX_OVERRUN, METRIC_CAN_ARB_LOST, METRIC_CAN_BUS_ERRORS
+};
+static uint32_t s_twaiCounts[sizeof(s_twaiMetrics) / sizeof(s_twaiMetrics[0])];
+
+void metrics_init(void)
+{
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	s_lastSample = esp_timer_get_time();
+}
+
+void metrics_watch_task(METRIC_t m, TaskHandle_t task)
+{
+	s_tasks[m] = task;
+}
+
+void metrics_watch_queue(METRIC_t m, QueueHandle_t queue)
+{
+	s_queues[m] = queue;
+}
+
+// Call with s_mutex held
+static void metrics_sample_twai(void)
+{
+	twai_status_info_t status;
+	if (twai_get_status_info(&status) != ESP_OK) return;
+	metrics_set(METRIC_CAN_STATE, status.state);
+	metrics_set(METRIC_CAN_TX_ERRORS, status.tx_error_counter);
+	metrics_set(METRIC_CAN_RX_ERRORS, status.rx_error_counter);
+	const uint32_t counts[] = {
+		status.rx_missed_count, status.rx_overrun_count, status.arb_lost_count, status.bus_error_count
+	};
+	for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		// less than before: installed again in between without metrics_twai_reinstall()
+		metrics_add(s_twaiMetrics[i], counts[i] >= s_twaiCounts[i] ? counts[i] - s_twaiCounts[i] : counts[i]);
+		s_twaiCounts[i] = counts[i];
+	}
+}
+
+void metrics_twai_reinstall(void)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	metrics_sample_twai();
+	memset(s_twaiCounts, 0, sizeof(s_twaiCounts));
+	xSemaphoreGive(s_mutex);
+}
+
+void metrics_sample(void)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	int64_t now = esp_timer_get_time();
+	metrics_set(METRIC_UPTIME, (uint32_t)(now / 1000000));
+	metrics_set(METRIC_HEAP_FREE, esp_get_free_heap_size());
+	metrics_set(METRIC_HEAP_MIN, esp_get_minimum_free_heap_size());
+
+	for (int m = 0; m < METRICS; m++) {
+		if (s_tasks[m]) metrics_set(m, uxTaskGetStackHighWaterMark(s_tasks[m]));
+		if (s_queues[m]) metrics_set(m, uxQueueMessagesWaiting(s_queues[m]));
+	}
+
+	metrics_sample_twai();
+
+	uint32_t bits = metrics_get(METRIC_CAN_BITS);
+	int64_t us = now - s_lastSample;
+	if (us > 0) {
+		metrics_set(METRIC_CAN_LOAD, (uint32_t)((int64_t)(bits - s_lastBits) * 1000000000LL / CAN_BITRATE / us));
+	}
+	s_lastBits = bits;
+	s_lastSample = now;
+
+	REQUEST_STATS_t request;
+	MSG_POOL_STATS_t pool;
+	SPOOL_STATS_t spool;
+	request_get_stats(&request);
+	msg_pool_get_stats(&pool);
+	spool_get_stats(&spool);
+	metrics_set(METRIC_REQUEST_TIMEOUTS, request.timeouts);
+	metrics_set(METRIC_POOL_EXHAUSTED, pool.exhausted);
+	metrics_set(METRIC_SPOOL_DROPPED, spool.dropped);
+	xSemaphoreGive(s_mutex);
+}
+
+int metrics_render_json(char *buf, size_t size)
+{
+	metrics_sample();
+	int len = 0;
+	for (int m = 0; m < METRICS && (size_t)len < size; m++) {
+		len += snprintf(&buf[len], size - len, "%c\"%s\":%"PRIu32, m == 0 ? '{' : ',', s_info[m].name, metrics_get(m));
+	}
+	if ((size_t)len < size) len += snprintf(&buf[len], size - len, "}");
+	return (size_t)len < size ? len : -1;
+}
+
+int metrics_render_prometheus(char *buf, size_t size)
+{
+	metrics_sample();
+	int len = 0;
+	for (int m = 0; m < METRICS && (size_t)len < size; m++) {
+		const METRIC_INFO_t *info = &s_info[m];
+		len += snprintf(&buf[len], size - len, "# HELP wpm_%s %s\n# TYPE wpm_%s %s\nwpm_%s %"PRIu32"\n",
+			info->name, info->help, info->name, info->type == METRIC_COUNTER ? "counter" : "gauge",
+			info->name, metrics_get(m));
+	}
+	return (size_t)len < size ? len : -1;
+}
+
+#if CONFIG_WPM_METRICS_HTTP
+static httpd_handle_t s_server;
+
+static esp_err_t metrics_http_get(httpd_req_t *req)
+{
+	// the server has one task, requests are served one after the other
+	static char buf[5120];
+	int len = metrics_render_prometheus(buf, sizeof(buf));
+	if (len < 0) {
+		ESP_LOGE(TAG, "metrics do not fit %d bytes", (int)sizeof(buf));
+		return httpd_resp_send_500(req);
+	}
+	httpd_resp_set_type(req, "text/plain; version=0.0.4");
+	return httpd_resp_send(req, buf, len);
+}
+
+void metrics_http_start(void)
+{
+	httpd_handle_t server = NULL;
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+	config.server_port = CONFIG_WPM_METRICS_HTTP_PORT;
+	esp_err_t ret = httpd_start(&server, &config);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "httpd_start failed %s", esp_err_to_name(ret));
+		return;
+	}
+	static const httpd_uri_t uri = {
+		.uri = "/metrics",
+		.method = HTTP_GET,
+		.handler = metrics_http_get
+	};
+	httpd_register_uri_handler(server, &uri);
+	s_server = server;
+	ESP_LOGI(TAG, "Prometheus metrics on port %d /metrics", CONFIG_WPM_METRICS_HTTP_PORT);
+}
+
+void *metrics_http_server(void)
+{
+	return s_server;
+}
+#else
+void metrics_http_start(void)
+{
+}
+
+void *metrics_http_server(void)
+{
+	return NULL;
+}
+#endif
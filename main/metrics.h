@@ -0,0 +1,104 @@
+/*
+	Registry of runtime counters and gauges.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+typedef enum {
+	METRIC_UPTIME = 0,
+	METRIC_HEAP_FREE,
+	METRIC_HEAP_MIN,
+	METRIC_CAN_RX,           // frames received from the controller
+	METRIC_CAN_RX_USED,
+	METRIC_CAN_RX_REJECTED,  // not an Elster telegram or not for us
+	METRIC_CAN_RX_DROPPED,   // xQueue_mqtt_tx full
+	METRIC_CAN_TX,
+	METRIC_CAN_TX_FAILED,
+	METRIC_CAN_TX_DROPPED,   // xQueue_twai_tx full
+	METRIC_CAN_BITS,         // of the frames received and sent
+	METRIC_CAN_LOAD,         // permille of the bit rate since the last sample
+	METRIC_CAN_STATE,        // twai_state_t
+	METRIC_CAN_BUS_OFF,      // times the controller went bus-off
+	METRIC_CAN_TX_ERRORS,    // TEC
+	METRIC_CAN_RX_ERRORS,    // REC
+	METRIC_CAN_RX_MISSED,
+	METRIC_CAN_RX_OVERRUN,
+	METRIC_CAN_ARB_LOST,
+	METRIC_CAN_BUS_ERRORS,
+	METRIC_Q_MQTT_TX,        // depth of xQueue_mqtt_tx
+	METRIC_Q_MQTT_TX_PEAK,
+	METRIC_Q_TWAI_TX,
+	METRIC_Q_TWAI_TX_PEAK,
+	METRIC_Q_SUB,            // depth of the queue of mqtt_sub_task
+	METRIC_Q_SUB_PEAK,
+	METRIC_SUB_DROPPED,      // subscribed messages dropped, queue full
+	METRIC_POOL_EXHAUSTED,
+	METRIC_REQUEST_TIMEOUTS,
+	METRIC_SPOOL_DROPPED,
+	METRIC_LOG_DROPPED,      // deferred log records dropped, ring full
+	METRIC_STACK_TWAI_RX,    // least free stack in bytes
+	METRIC_STACK_TWAI_TX,
+	METRIC_STACK_MQTT_PUB,
+	METRIC_STACK_MQTT_SUB,
+	METRICS
+} METRIC_t;
+
+// Updated in place by the tasks, read through metrics_render_*()
+extern uint32_t metrics_values[METRICS];
+
+static inline void metrics_add(METRIC_t m, uint32_t n)
+{
+	__atomic_fetch_add(&metrics_values[m], n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(METRIC_t m)
+{
+	__atomic_fetch_add(&metrics_values[m], 1, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_set(METRIC_t m, uint32_t v)
+{
+	__atomic_store_n(&metrics_values[m], v, __ATOMIC_RELAXED);
+}
+
+// Raises m to v, for the peaks
+static inline void metrics_max(METRIC_t m, uint32_t v)
+{
+	uint32_t old = __atomic_load_n(&metrics_values[m], __ATOMIC_RELAXED);
+	while (v > old && !__atomic_compare_exchange_n(&metrics_values[m], &old, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+}
+
+static inline uint32_t metrics_get(METRIC_t m)
+{
+	return __atomic_load_n(&metrics_values[m], __ATOMIC_RELAXED);
+}
+
+void metrics_init(void);
+// Stack of task is sampled into m (one of METRIC_STACK_*)
+void metrics_watch_task(METRIC_t m, TaskHandle_t task);
+// Depth of queue is sampled into m (one of METRIC_Q_*)
+void metrics_watch_queue(METRIC_t m, QueueHandle_t queue);
+// Reads the gauges: heap, stacks, queue depths, TWAI status, bus load and
+// the counters of the other modules. The render functions call it.
+void metrics_sample(void);
+// Takes the driver counters before the TWAI driver is uninstalled
+void metrics_twai_reinstall(void);
+// {"uptime":..,"heap_free":..,...} Returns the length or -1 if it does not fit.
+int metrics_render_json(char *buf, size_t size);
+// Prometheus text format. Returns the length or -1 if it does not fit.
+int metrics_render_prometheus(char *buf, size_t size);
+// Serves metrics_render_prometheus() on http://<ip>:CONFIG_WPM_METRICS_HTTP_PORT/metrics
+void metrics_http_start(void);
+// The server of metrics_http_start() for other handlers, NULL if none runs
+void *metrics_http_server(void);
+
+#endif
@@ -1,3 +1,9 @@
+#ifndef MQTT_H
+#define MQTT_H
+
+#include "driver/twai.h"
+#include "elster.h"
+
 #define	PUBLISH		100
 #define	SUBSCRIBE	200
 
@@ -6,9 +12,23 @@ typedef struct {
 	int16_t topic_len;
 	char topic[64];
 	int16_t data_len;
-	char data[64];
+	char data[256]; // wp/get takes a list of names
 } MQTT_t;
 
+typedef struct {
+	twai_message_t msg;
+	int64_t queued; // esp_timer_get_time() when queued
+} TWAI_t;
+
+// Item of xQueue_mqtt_tx
+typedef struct {
+	ElsterPacketReceive packet;
+	uint32_t trace; // frame id for trace.h, 0 if not traced
+	bool answer;    // asked for by wp/get, goes to wp/read/ in every publish mode
+	bool cached;    // answer of get.c from its cache, not a new value
+	bool replay;    // injected by replay.c, published to wp/replay/
+} PACKET_t;
+
 typedef struct {
 	uint16_t frame;
 	uint32_t canid;
@@ -16,3 +36,4 @@ typedef struct {
 	int16_t topic_len;
 } TOPIC_t;
 
+#endif
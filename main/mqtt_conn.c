@@ -0,0 +1,267 @@
+/*
+	The one MQTT connection shared by all tasks.
+
+	mqtt_pub_task and mqtt_sub_task used to open a connection each, with its
+	own broker lookup, client id, keepalive and (with secure MQTT) TLS
+	session. Now one client is created here. Publishing goes through
+	mqtt_conn_publish(); incoming messages are dispatched by topic filter to
+	the handlers registered with mqtt_conn_subscribe().
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_mac.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "mqtt_client.h"
+#include "sdkconfig.h"
+
+#include "mqtt_conn.h"
+#include "trace.h"
+
+static const char *TAG = "MQTT";
+
+extern const uint8_t root_cert_pem_start[] asm("_binary_root_cert_pem_start");
+extern const uint8_t root_cert_pem_end[] asm("_binary_root_cert_pem_end");
+
+#define MQTT_CONNECTED_BIT BIT0
+
+typedef struct {
+	const char *filter;
+	int qos;
+	mqtt_conn_handler_t handler;
+} MQTT_HANDLER_t;
+
+static EventGroupHandle_t s_mqtt_event_group;
+static SemaphoreHandle_t s_mutex;
+static esp_mqtt_client_handle_t s_client;
+static MQTT_HANDLER_t s_handlers[MQTT_CONN_MAX_HANDLERS];
+static int s_nhandlers;
+
+// Heap and time at the start of (re)connecting, to log what it took
+static uint32_t s_heapBefore;
+static int64_t s_connectStart;
+
+esp_err_t query_mdns_host(const char * host_name, char *ip);
+void convert_mdns_host(char * from, char * to);
+
+// MQTT topic filter match, filter may contain + and #
+static bool mqtt_conn_match(const char *filter, const char *topic, int topic_len)
+{
+	const char *end = topic + topic_len;
+	while (*filter) {
+		if (*filter == '#') return true;
+		// "a/#" also matches "a"
+		if (topic == end && strcmp(filter, "/#") == 0) return true;
+		if (*filter == '+') {
+			while (topic < end && *topic != '/') topic++;
+			filter++;
+			continue;
+		}
+		if (topic == end || *filter != *topic) return false;
+		filter++;
+		topic++;
+	}
+	return topic == end;
+}
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+#else
+static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
+#endif
+{
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+	esp_mqtt_event_handle_t event = event_data;
+#endif
+	switch (event->event_id) {
+		case MQTT_EVENT_BEFORE_CONNECT:
+			if (s_connectStart == 0) s_connectStart = esp_timer_get_time();
+			break;
+		case MQTT_EVENT_CONNECTED:
+			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED after %"PRId64"ms, heap used by the connection %"PRId32" bytes",
+				(esp_timer_get_time() - s_connectStart) / 1000, (int32_t)(s_heapBefore - esp_get_free_heap_size()));
+			s_connectStart = 0;
+			// the broker may have dropped the session, subscribe again
+			xSemaphoreTake(s_mutex, portMAX_DELAY);
+			for (int i = 0; i < s_nhandlers; i++) {
+				esp_mqtt_client_subscribe(s_client, s_handlers[i].filter, s_handlers[i].qos);
+			}
+			xSemaphoreGive(s_mutex);
+			xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+			break;
+		case MQTT_EVENT_DISCONNECTED:
+			ESP_LOGW(TAG, "MQTT_EVENT_DISCONNECTED");
+			xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+			s_connectStart = esp_timer_get_time();
+			break;
+		case MQTT_EVENT_SUBSCRIBED:
+			ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+			break;
+		case MQTT_EVENT_UNSUBSCRIBED:
+			ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
+			break;
+		case MQTT_EVENT_PUBLISHED:
+			ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+			trace_record(TRACE_ACK, 0, (uint16_t)event->msg_id, esp_timer_get_time());
+			break;
+		case MQTT_EVENT_DATA:
+			ESP_LOGI(TAG, "MQTT_EVENT_DATA");
+			xSemaphoreTake(s_mutex, portMAX_DELAY);
+			for (int i = 0; i < s_nhandlers; i++) {
+				if (mqtt_conn_match(s_handlers[i].filter, event->topic, event->topic_len)) {
+					s_handlers[i].handler(event->topic, event->topic_len, event->data, event->data_len);
+					break;
+				}
+			}
+			xSemaphoreGive(s_mutex);
+			break;
+		case MQTT_EVENT_ERROR:
+			ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
+			break;
+		default:
+			ESP_LOGI(TAG, "Other event id:%d", event->event_id);
+			break;
+	}
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
+	return ESP_OK;
+#endif
+}
+
+void mqtt_conn_start(void)
+{
+#if CONFIG_ENABLE_SECURE_MQTT
+	ESP_LOGI(TAG, "Start Broker:%s", CONFIG_MQTTS_BROKER);
+#else
+	ESP_LOGI(TAG, "Start Broker:%s", CONFIG_MQTT_BROKER);
+#endif
+
+	/* Create Eventgroup */
+	s_mqtt_event_group = xEventGroupCreate();
+	configASSERT( s_mqtt_event_group );
+	xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+
+	// Set client id from mac
+	uint8_t mac[8];
+	ESP_ERROR_CHECK(esp_base_mac_addr_get(mac));
+	static char client_id[64];
+	sprintf(client_id, "wp-%02x%02x%02x%02x%02x%02x", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
+	ESP_LOGI(TAG, "client_id=[%s]", client_id);
+
+	// Resolve mDNS host name
+	char ip[128];
+	static char uri[138];
+#if CONFIG_ENABLE_SECURE_MQTT
+	convert_mdns_host(CONFIG_MQTTS_BROKER, ip);
+	sprintf(uri, "mqtts://%s", ip);
+#else
+	convert_mdns_host(CONFIG_MQTT_BROKER, ip);
+	sprintf(uri, "mqtt://%s", ip);
+#endif
+	ESP_LOGI(TAG, "uri=[%s]", uri);
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+	esp_mqtt_client_config_t mqtt_cfg = {
+		.broker.address.uri = uri,
+#if CONFIG_ENABLE_SECURE_MQTT
+		.broker.verification.certificate = (const char *)root_cert_pem_start,
+		.broker.address.port = 8883,
+#else
+		.broker.address.port = 1883,
+#endif
+#if CONFIG_BROKER_AUTHENTICATION
+		.credentials.username = CONFIG_AUTHENTICATION_USERNAME,
+		.credentials.authentication.password = CONFIG_AUTHENTICATION_PASSWORD,
+#endif
+		.credentials.client_id = client_id
+	};
+
+#else
+	esp_mqtt_client_config_t mqtt_cfg = {
+		.uri = uri,
+#if CONFIG_ENABLE_SECURE_MQTT
+		.cert_pem = (const char *)root_cert_pem_start,
+		.port = 8883,
+#else
+		.port = 1883,
+#endif
+		.event_handle = mqtt_event_handler,
+#if CONFIG_BROKER_AUTHENTICATION
+		.username = CONFIG_AUTHENTICATION_USERNAME,
+		.password = CONFIG_AUTHENTICATION_PASSWORD,
+#endif
+		.client_id = client_id
+	};
+#endif // ESP_IDF_VERSION
+
+	s_heapBefore = esp_get_free_heap_size();
+	s_connectStart = esp_timer_get_time();
+	s_client = esp_mqtt_client_init(&mqtt_cfg);
+
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+	esp_mqtt_client_register_event(s_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+#endif
+
+	esp_mqtt_client_start(s_client);
+}
+
+void mqtt_conn_wait(void)
+{
+	xEventGroupWaitBits(s_mqtt_event_group, MQTT_CONNECTED_BIT, false, true, portMAX_DELAY);
+}
+
+bool mqtt_conn_connected(void)
+{
+	return (xEventGroupGetBits(s_mqtt_event_group) & MQTT_CONNECTED_BIT) != 0;
+}
+
+esp_err_t mqtt_conn_subscribe(const char *filter, int qos, mqtt_conn_handler_t handler)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	if (s_nhandlers >= MQTT_CONN_MAX_HANDLERS) {
+		xSemaphoreGive(s_mutex);
+		ESP_LOGE(TAG, "no handler left for [%s]", filter);
+		return ESP_ERR_NO_MEM;
+	}
+	s_handlers[s_nhandlers].filter = filter;
+	s_handlers[s_nhandlers].qos = qos;
+	s_handlers[s_nhandlers].handler = handler;
+	s_nhandlers++;
+	// otherwise MQTT_EVENT_CONNECTED subscribes
+	if (mqtt_conn_connected()) {
+		esp_mqtt_client_subscribe(s_client, filter, qos);
+	}
+	xSemaphoreGive(s_mutex);
+	return ESP_OK;
+}
+
+int mqtt_conn_publish(const char *topic, const char *data, int len, int qos, int retain)
+{
+	if (!mqtt_conn_connected()) {
+		ESP_LOGE(TAG, "mqtt broker not connect");
+		return -1;
+	}
+	return esp_mqtt_client_publish(s_client, topic, data, len, qos, retain);
+}
+
+int mqtt_conn_enqueue(const char *topic, const char *data, int len, int qos, int retain)
+{
+	if (!mqtt_conn_connected()) {
+		ESP_LOGE(TAG, "mqtt broker not connect");
+		return -1;
+	}
+	return esp_mqtt_client_enqueue(s_client, topic, data, len, qos, retain, true);
+}
@@ -0,0 +1,33 @@
+/*
+	The one MQTT connection shared by all tasks.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef MQTT_CONN_H
+#define MQTT_CONN_H
+
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define MQTT_CONN_MAX_HANDLERS 16
+
+// Called from the MQTT client task for every message matching the filter.
+// topic and data are not null terminated.
+typedef void (*mqtt_conn_handler_t)(const char *topic, int topic_len, const char *data, int data_len);
+
+// Resolves the broker, creates the client and connects. Call once.
+void mqtt_conn_start(void);
+// Blocks until the client is connected.
+void mqtt_conn_wait(void);
+bool mqtt_conn_connected(void);
+// Subscribes to filter (+ and # allowed) and dispatches matching messages
+// to handler. Subscriptions are renewed on every reconnect.
+esp_err_t mqtt_conn_subscribe(const char *filter, int qos, mqtt_conn_handler_t handler);
+// Returns the message id, -1 if not connected or failed.
+int mqtt_conn_publish(const char *topic, const char *data, int len, int qos, int retain);
+// Like mqtt_conn_publish() but never blocks, the message is sent by the
+// client task.
+int mqtt_conn_enqueue(const char *topic, const char *data, int len, int qos, int retain);
+
+#endif
@@ -14,177 +14,284 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
-#include "freertos/event_groups.h"
 #include "esp_log.h"
-#include "esp_event.h"
-#include "esp_mac.h"
-#include "mqtt_client.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
 #include "driver/twai.h"
 
+#include "elster.h"
 #include "mqtt.h"
+#include "mqtt_conn.h"
+#include "state.h"
+#include "spool.h"
+#include "trace.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "replay.h"
 
 static const char *TAG = "PUB";
 
-static EventGroupHandle_t s_mqtt_event_group;
-
-extern const uint8_t root_cert_pem_start[] asm("_binary_root_cert_pem_start");
-extern const uint8_t root_cert_pem_end[] asm("_binary_root_cert_pem_end");
+extern QueueHandle_t xQueue_mqtt_tx;
 
-#define MQTT_CONNECTED_BIT BIT0
+#define PUBLISH_TOPIC (CONFIG_WPM_PUBLISH_TOPIC || CONFIG_WPM_PUBLISH_BOTH)
+#define PUBLISH_STATE (CONFIG_WPM_PUBLISH_STATE || CONFIG_WPM_PUBLISH_BOTH)
 
-extern QueueHandle_t xQueue_mqtt_tx;
-extern QueueHandle_t xQueue_twai_tx;
+#if PUBLISH_STATE
+#define STATE_PERIOD_US ((int64_t)CONFIG_WPM_STATE_PERIOD * 1000000)
+#define STATE_BUF_SIZE  (STATE_MAX_VALUES * 64)
 
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+// Publishes all latest values as one document if any of them changed
+static void mqtt_pub_state(void)
+{
+	static char buf[STATE_BUF_SIZE];
+	// keep it dirty until it can be sent
+	if (!state_dirty() || !mqtt_conn_connected()) return;
+#if CONFIG_WPM_STATE_CBOR
+	int len = state_render_cbor((uint8_t *)buf, sizeof(buf));
 #else
-static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
+	int len = state_render_json(buf, sizeof(buf));
 #endif
-{
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-	esp_mqtt_event_handle_t event = event_data;
-#endif
-	switch (event->event_id) {
-		case MQTT_EVENT_CONNECTED:
-			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-			xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
-			break;
-		case MQTT_EVENT_DISCONNECTED:
-			ESP_LOGW(TAG, "MQTT_EVENT_DISCONNECTED");
-			xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
-			break;
-		case MQTT_EVENT_SUBSCRIBED:
-			ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-			break;
-		case MQTT_EVENT_UNSUBSCRIBED:
-			ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
-			break;
-		case MQTT_EVENT_PUBLISHED:
-			ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-			break;
-		case MQTT_EVENT_DATA:
-			ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-			break;
-		case MQTT_EVENT_ERROR:
-			ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
-			break;
-		default:
-			ESP_LOGI(TAG, "Other event id:%d", event->event_id);
-			break;
+	if (len < 0) {
+		ESP_LOGE(TAG, "state does not fit %d bytes", STATE_BUF_SIZE);
+		return;
 	}
-#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
-	return ESP_OK;
-#endif
+	ESP_LOGI(TAG, "TOPIC=[wp/state] %d bytes", len);
+	mqtt_conn_publish("wp/state", buf, len, 1, 0);
 }
+#endif
 
-esp_err_t query_mdns_host(const char * host_name, char *ip);
-void convert_mdns_host(char * from, char * to);
+#if CONFIG_WPM_SPOOL
+#define REPLAY_PERIOD_US ((int64_t)CONFIG_WPM_SPOOL_BATCH_PERIOD * 1000)
 
-void mqtt_pub_task(void *pvParameters)
+static int64_t s_replayStart;   // first batch of the current backlog
+static uint32_t s_replayCount;
+
+// Publishes the next batch of spooled values to wp/history/<NAME>. They are
+// not sent to wp/read, where they would overwrite newer values.
+static void mqtt_pub_replay(void)
 {
-#if CONFIG_ENABLE_SECURE_MQTT
-	ESP_LOGI(TAG, "Start Subscribe Broker:%s", CONFIG_MQTTS_BROKER);
-#else
-	ESP_LOGI(TAG, "Start Subscribe Broker:%s", CONFIG_MQTT_BROKER);
-#endif
+	static SPOOL_RECORD_t records[CONFIG_WPM_SPOOL_BATCH];
+	char name[ELSTER_NAME_LEN];
+	char topic[64];
+	char val[ELSTER_VALUE_LEN];
+	char data[96];
 
-	/* Create Eventgroup */
-	s_mqtt_event_group = xEventGroupCreate();
-	configASSERT( s_mqtt_event_group );
-	xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+	int n = spool_peek(records, CONFIG_WPM_SPOOL_BATCH);
+	if (n > 0 && s_replayStart == 0) s_replayStart = esp_timer_get_time();
+	int done = 0;
+	for (; done < n; done++) {
+		if (records[done].packetType == ELSTER_PT_invalid) continue;
+		ElsterPacketReceive packet = {
+			.sender = records[done].sender,
+			.index = records[done].index,
+			.value = records[done].value,
+			.packetType = records[done].packetType,
+			.tableIndex = ELSTER_NO_TABLE_INDEX
+		};
+		int tableIndex = GetElsterTableIndex(packet.index);
+		if (tableIndex >= 0) packet.tableIndex = tableIndex;
+		snprintf(topic, sizeof(topic), "wp/history/%s", ElsterPacketName(&packet, name));
+		ElsterPacketValue(&packet, val);
+		int len = snprintf(data, sizeof(data), "{\"time\":%"PRIu32",\"value\":\"%s\"}", records[done].time, val);
+		// keep the rest for the next batch if the connection went away
+		if (mqtt_conn_publish(topic, data, len, 1, 0) < 0) break;
+	}
+	spool_consume(done);
+	s_replayCount += done;
 
-	// Set client id from mac
-	uint8_t mac[8];
-	ESP_ERROR_CHECK(esp_base_mac_addr_get(mac));
-	for(int i=0;i<8;i++) {
-		ESP_LOGD(TAG, "mac[%d]=%x", i, mac[i]);
+	if (s_replayStart != 0 && !spool_pending()) {
+		SPOOL_STATS_t stats;
+		spool_get_stats(&stats);
+		int64_t us = esp_timer_get_time() - s_replayStart;
+		ESP_LOGI(TAG, "replayed %"PRIu32" values in %"PRId64" ms (%"PRId64"/s)",
+			s_replayCount, us / 1000, us > 0 ? (int64_t)s_replayCount * 1000000 / us : 0);
+		// SPIFFS erases 4 KB blocks, appends fill them once
+		ESP_LOGI(TAG, "spool written=%"PRIu32" dropped=%"PRIu32" corrupt=%"PRIu32" flash bytes=%"PRIu32" (~%"PRIu32" block erases)",
+			stats.written, stats.dropped, stats.corrupt, stats.bytesWritten, stats.bytesWritten / 4096 + stats.segments);
+		s_replayStart = 0;
+		s_replayCount = 0;
 	}
-	char client_id[64];
-	sprintf(client_id, "pub-%02x%02x%02x%02x%02x%02x", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
-	ESP_LOGI(TAG, "client_id=[%s]", client_id);
-
-	// Resolve mDNS host name
-	char ip[128];
-	char uri[138];
-#if CONFIG_ENABLE_SECURE_MQTT
-	ESP_LOGI(TAG, "CONFIG_MQTTS_BROKER=[%s]", CONFIG_MQTTS_BROKER);
-	convert_mdns_host(CONFIG_MQTTS_BROKER, ip);
-	ESP_LOGI(TAG, "ip=[%s]", ip);
-	sprintf(uri, "mqtts://%s", ip);
-#else
-	ESP_LOGI(TAG, "CONFIG_MQTT_BROKER=[%s]", CONFIG_MQTT_BROKER);
-	convert_mdns_host(CONFIG_MQTT_BROKER, ip);
-	ESP_LOGI(TAG, "ip=[%s]", ip);
-	sprintf(uri, "mqtt://%s", ip);
-#endif
-	ESP_LOGI(TAG, "uri=[%s]", uri);
-
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-	esp_mqtt_client_config_t mqtt_cfg = {
-		.broker.address.uri = uri,
-#if CONFIG_ENABLE_SECURE_MQTT
-		.broker.verification.certificate = (const char *)root_cert_pem_start,
-		.broker.address.port = 8883,
-#else
-		.broker.address.port = 1883,
-#endif
-#if CONFIG_BROKER_AUTHENTICATION
-		.credentials.username = CONFIG_AUTHENTICATION_USERNAME,
-		.credentials.authentication.password = CONFIG_AUTHENTICATION_PASSWORD,
+}
 #endif
-		.credentials.client_id = client_id
-	};
 
-#else
-	esp_mqtt_client_config_t mqtt_cfg = {
-		.uri = uri,
-#if CONFIG_ENABLE_SECURE_MQTT
-		.cert_pem = (const char *)root_cert_pem_start,
-		.port = 8883,
-#else
-		.port = 1883,
-#endif
-		.event_handle = mqtt_event_handler,
-#if CONFIG_BROKER_AUTHENTICATION
-		.username = CONFIG_AUTHENTICATION_USERNAME,
-		.password = CONFIG_AUTHENTICATION_PASSWORD,
+#if CONFIG_WPM_TRACE
+#define LATENCY_PERIOD_US ((int64_t)CONFIG_WPM_TRACE_PERIOD * 1000000)
+#define COLLECT_PERIOD_US ((int64_t)TRACE_COLLECT_MS * 1000)
+
+// Publishes the latency histograms of the last period to wp/sys/latency
+static void mqtt_pub_latency(void)
+{
+	// mqtt_pub_task only, kept off its stack
+	static char buf[512];
+	int len = trace_render_latency(buf, sizeof(buf));
+	if (len < 0) {
+		ESP_LOGE(TAG, "latency does not fit %d bytes", (int)sizeof(buf));
+		return;
+	}
+	if (mqtt_conn_connected()) mqtt_conn_publish("wp/sys/latency", buf, len, 0, 0);
+}
+
+// Publishes the last trace records to wp/sys/trace, see TRACE_DUMP_HEADER_t
+static void mqtt_pub_trace_dump(void)
+{
+	static uint8_t buf[sizeof(TRACE_DUMP_HEADER_t) + CONFIG_WPM_TRACE_DUMP * sizeof(TRACE_RECORD_t)];
+	int len = trace_dump(buf, sizeof(buf));
+	ESP_LOGI(TAG, "TOPIC=[wp/sys/trace] %d bytes", len);
+	if (len > 0) mqtt_conn_publish("wp/sys/trace", (const char *)buf, len, 0, 0);
+}
 #endif
-		.client_id = client_id
-	};
-#endif // ESP_IDF_VERSION
 
-	esp_mqtt_client_handle_t mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+#if CONFIG_WPM_METRICS
+#define METRICS_PERIOD_US ((int64_t)CONFIG_WPM_METRICS_PERIOD * 1000000)
+
+// Publishes all counters and gauges to wp/sys/metrics
+static void mqtt_pub_metrics(void)
+{
+	// mqtt_pub_task only, kept off its stack
+	static char buf[1024];
+	int len = metrics_render_json(buf, sizeof(buf));
+	if (len < 0) {
+		ESP_LOGE(TAG, "metrics do not fit %d bytes", (int)sizeof(buf));
+		return;
+	}
+	if (mqtt_conn_connected()) mqtt_conn_publish("wp/sys/metrics", buf, len, 0, 0);
+}
+#endif
 
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-	esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+#if CONFIG_WPM_REPLAY
+// Replayed values are no live values: no state, no spool, no wp/read
+static void mqtt_pub_replayed(const ElsterPacketReceive *packet)
+{
+	char topic[64];
+	char name[ELSTER_NAME_LEN];
+	char value[ELSTER_VALUE_LEN];
+	snprintf(topic, sizeof(topic), "wp/replay/%s", ElsterPacketName(packet, name));
+	ElsterPacketValue(packet, value);
+	replay_published(mqtt_conn_publish(topic, value, strlen(value), 1, 0) >= 0);
+}
 #endif
 
-	esp_mqtt_client_start(mqtt_client);
-	xEventGroupWaitBits(s_mqtt_event_group, MQTT_CONNECTED_BIT, false, true, portMAX_DELAY);
+// Ticks from now until deadline, at least 0
+static TickType_t mqtt_pub_ticks(int64_t deadline, int64_t now)
+{
+	return deadline <= now ? 0 : pdMS_TO_TICKS((deadline - now) / 1000) + 1;
+}
+
+void mqtt_pub_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
+#if !CONFIG_WPM_SPOOL
+	// values received before the first connect wait in the queue
+	mqtt_conn_wait();
 	ESP_LOGI(TAG, "Connect to MQTT Server");
+#endif
 
+	PACKET_t item;
+	ElsterPacketReceive packet;
+	char name[ELSTER_NAME_LEN];
 	MQTT_t mqttBuf;
+	mqttBuf.topic_type = PUBLISH;
+#if PUBLISH_STATE
+	int64_t nextState = esp_timer_get_time() + STATE_PERIOD_US;
+#endif
+#if CONFIG_WPM_SPOOL
+	int64_t nextReplay = 0;
+#endif
+#if CONFIG_WPM_METRICS
+	int64_t nextMetrics = esp_timer_get_time() + METRICS_PERIOD_US;
+#endif
+#if CONFIG_WPM_TRACE
+	int64_t nextCollect = esp_timer_get_time() + COLLECT_PERIOD_US;
+	int64_t nextLatency = esp_timer_get_time() + LATENCY_PERIOD_US;
+#endif
 	while (1) {
-		xQueueReceive(xQueue_mqtt_tx, &mqttBuf, portMAX_DELAY);
-		if (mqttBuf.topic_type == PUBLISH) {
-			//ESP_LOGI(TAG, "TOPIC=%.*s\r", mqttBuf.topic_len, mqttBuf.topic);
-			ESP_LOGI(TAG, "TOPIC=[%s] LEN=%d", mqttBuf.topic, mqttBuf.data_len);
-			//memset(mqttBuf.data, 0, sizeof(mqttBuf.data));
-			for(int i=0;i<mqttBuf.data_len;i++) {
-				ESP_LOGI(TAG, "DATA=0x%x", mqttBuf.data[i]);
-			}
-			EventBits_t EventBits = xEventGroupGetBits(s_mqtt_event_group);
-			ESP_LOGI(TAG, "EventBits=0x%"PRIx32, EventBits);
-			if (EventBits & MQTT_CONNECTED_BIT) {
-				esp_mqtt_client_publish(mqtt_client, mqttBuf.topic, mqttBuf.data, mqttBuf.data_len, 1, 0);
-			} else {
-				ESP_LOGE(TAG, "mqtt broker not connect");
+		int64_t now = esp_timer_get_time();
+		TickType_t wait = portMAX_DELAY;
+#if PUBLISH_STATE
+		if (now >= nextState) {
+			mqtt_pub_state();
+			nextState += STATE_PERIOD_US;
+		}
+		wait = mqtt_pub_ticks(nextState, now);
+#endif
+#if CONFIG_WPM_SPOOL
+		if (spool_pending() && mqtt_conn_connected()) {
+			if (now >= nextReplay) {
+				mqtt_pub_replay();
+				nextReplay = now + REPLAY_PERIOD_US;
 			}
+			TickType_t replay = mqtt_pub_ticks(nextReplay, now);
+			if (replay < wait) wait = replay;
+		} else if (spool_pending() && wait > pdMS_TO_TICKS(1000)) {
+			// look for the connection to come back
+			wait = pdMS_TO_TICKS(1000);
 		}
+#endif
+#if CONFIG_WPM_METRICS
+		if (now >= nextMetrics) {
+			mqtt_pub_metrics();
+			nextMetrics += METRICS_PERIOD_US;
+		}
+		TickType_t metrics = mqtt_pub_ticks(nextMetrics, now);
+		if (metrics < wait) wait = metrics;
+#endif
+#if CONFIG_WPM_TRACE
+		// the rings must not overflow between two collections
+		if (now >= nextCollect) {
+			trace_collect();
+			nextCollect = now + COLLECT_PERIOD_US;
+		}
+		if (now >= nextLatency) {
+			mqtt_pub_latency();
+			nextLatency += LATENCY_PERIOD_US;
+		}
+		if (trace_dump_requested()) {
+			trace_collect();
+			mqtt_pub_trace_dump();
+		}
+		TickType_t collect = mqtt_pub_ticks(nextCollect, now);
+		if (collect < wait) wait = collect;
+#endif
+		if (xQueueReceive(xQueue_mqtt_tx, &item, wait) != pdTRUE) continue;
+		trace_record(TRACE_DEQUEUE, item.trace, 0, esp_timer_get_time());
+		packet = item.packet;
+#if CONFIG_WPM_REPLAY
+		if (item.replay) {
+			mqtt_pub_replayed(&packet);
+			continue;
+		}
+#endif
+#if PUBLISH_STATE
+		// an answer from the get cache is no new reception
+		if (!item.cached) state_update(&packet);
+#endif
+
+#if CONFIG_WPM_SPOOL
+		if (!mqtt_conn_connected()) {
+			// spooled with the time of now, an old value would reach wp/history as new
+			if (!item.cached) spool_write(&packet);
+			continue;
+		}
+#endif
+
+#if !PUBLISH_TOPIC
+		// a wp/get is answered right away, not with the next wp/state
+		if (!item.answer) continue;
+#endif
+		// Render topic and value only here, where the text is needed
+		strcpy(mqttBuf.topic, "wp/read/");
+		strlcpy(&mqttBuf.topic[8], ElsterPacketName(&packet, name), sizeof(mqttBuf.topic) - 8);
+		mqttBuf.topic_len = strlen(mqttBuf.topic);
+		ElsterPacketValue(&packet, mqttBuf.data);
+		mqttBuf.data_len = strlen(mqttBuf.data);
+
+		DLOGD(DLOG_PUBLISH, packet.tableIndex, packet.value);
+		int64_t publish = esp_timer_get_time();
+		int msgId = mqtt_conn_publish(mqttBuf.topic, mqttBuf.data, mqttBuf.data_len, 1, 0);
+		if (msgId >= 0) trace_record(TRACE_PUBLISH, item.trace, (uint16_t)msgId, publish);
 	} // end while
 
 	// Never reach here
 	ESP_LOGI(TAG, "Task Delete");
-	esp_mqtt_client_stop(mqtt_client);
 	vTaskDelete(NULL);
 }
@@ -11,250 +11,282 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
-#include "freertos/event_groups.h"
 #include "esp_log.h"
-#include "esp_event.h"
-#include "esp_mac.h"
-#include "mqtt_client.h"
 #include "driver/twai.h"
 
 #include "elster.h"
 #include "mqtt.h"
-
+#include "mqtt_conn.h"
+#include "request.h"
+#include "poll.h"
+#include "get.h"
+#include "write.h"
+#include "msg_pool.h"
+#include "trace.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "capture.h"
+#include "replay.h"
+
+// Parameters that may be written via wp/write/<NAME>. The name is resolved
+// through the Elster table, which also gives the value type.
 typedef struct
 {
-  char * topic;
-  uint16_t receiver;
   uint16_t index;
-  ElsterValueType valueType;
-} MqttTopic;
+  uint16_t receiver;
+  int16_t min;  // range of numeric values, no check if min == max
+  int16_t max;
+} MqttWritable;
 
 static const char *TAG = "SUB";
 
-static const MqttTopic s_subscribedTopics[] = {
-	{ "wp/write/KUEHLEN_AKTIVIERT",  0x180, 0x4f07, et_bool },
-	{ "wp/write/PROGRAMMSCHALTER",   0x480, 0x0112, et_little_endian },
-	{ "wp/write/DATUM",              0x180, 0x000a, et_datum },
-	{ "wp/write/TAG",                0x480, 0x0122, et_little_endian },
-	{ "wp/write/MONAT",              0x480, 0x0123, et_little_endian },
-	{ "wp/write/JAHR",               0x480, 0x0124, et_little_endian },
-	{ "wp/write/UHRZEIT",            0x480, 0x0009, et_zeit }
+static const MqttWritable s_writable[] = {
+	{ 0x4f07, 0x180, 0, 0 },  // KUEHLEN_AKTIVIERT
+	{ 0x0112, 0x480, 0, 5 },  // PROGRAMMSCHALTER
+	{ 0x000a, 0x180, 0, 0 },  // DATUM
+	{ 0x0122, 0x480, 1, 31 }, // TAG
+	{ 0x0123, 0x480, 1, 12 }, // MONAT
+	{ 0x0124, 0x480, 0, 99 }, // JAHR
+	{ 0x0009, 0x480, 0, 0 }   // UHRZEIT
 };
 
-static EventGroupHandle_t s_mqtt_event_group;
-
-extern const uint8_t root_cert_pem_start[] asm("_binary_root_cert_pem_start");
-extern const uint8_t root_cert_pem_end[] asm("_binary_root_cert_pem_end");
-
-#define MQTT_CONNECTED_BIT BIT0
+#define WRITE_PREFIX     "wp/write/"
+#define WRITE_PREFIX_LEN (sizeof(WRITE_PREFIX) - 1)
 
 extern QueueHandle_t xQueue_mqtt_tx;
 extern QueueHandle_t xQueue_twai_tx;
 
 static QueueHandle_t xQueueSubscribe;
 
-
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
-#else
-static esp_err_t mqtt_event_handler(esp_mqtt_event_handle_t event)
-#endif
+// Runs in the MQTT client task, hands the message over to mqtt_sub_task
+static void mqtt_sub_handler(const char *topic, int topic_len, const char *data, int data_len)
 {
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-	esp_mqtt_event_handle_t event = event_data;
-#endif
-
-	switch (event->event_id) {
-		case MQTT_EVENT_CONNECTED:
-			ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-			xEventGroupSetBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
-			//esp_mqtt_client_subscribe(mqtt_client, CONFIG_SUB_TOPIC, 0);
-			break;
-		case MQTT_EVENT_DISCONNECTED:
-			ESP_LOGW(TAG, "MQTT_EVENT_DISCONNECTED");
-			xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
-			break;
-		case MQTT_EVENT_SUBSCRIBED:
-			ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-			break;
-		case MQTT_EVENT_UNSUBSCRIBED:
-			ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
-			break;
-		case MQTT_EVENT_PUBLISHED:
-			ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
-			break;
-		case MQTT_EVENT_DATA:
-			ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-			//ESP_LOGI(TAG, "TOPIC=%.*s\r", event->topic_len, event->topic);
-			//ESP_LOGI(TAG, "DATA=%.*s\r", event->data_len, event->data);
-			MQTT_t mqttBuf;
-			mqttBuf.topic_type = SUBSCRIBE;
-			mqttBuf.topic_len = event->topic_len;
-			for(int i=0;i<event->topic_len;i++) {
-				mqttBuf.topic[i] = event->topic[i];
-				mqttBuf.topic[i+1] = 0;
-			}
-			mqttBuf.data_len = event->data_len;
-			for(int i=0;i<event->data_len;i++) {
-				mqttBuf.data[i] = event->data[i];
-			}
-			xQueueSend(xQueueSubscribe, &mqttBuf, 0);
-			break;
-		case MQTT_EVENT_ERROR:
-			ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
-			break;
-		default:
-			ESP_LOGI(TAG, "Other event id:%d", event->event_id);
-			break;
+	MQTT_t *msg = msg_pool_take(SUBSCRIBE, topic, topic_len, data, data_len, 0);
+	if (msg == NULL) return;
+	if (xQueueSend(xQueueSubscribe, &msg, 0) != pdPASS) {
+		ESP_LOGW(TAG, "queue full, dropped %s", msg->topic);
+		metrics_inc(METRIC_SUB_DROPPED);
+		msg_pool_put(msg);
+		return;
 	}
-#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
-	return ESP_OK;
-#endif
+	metrics_max(METRIC_Q_SUB_PEAK, uxQueueMessagesWaiting(xQueueSubscribe));
 }
 
-esp_err_t query_mdns_host(const char * host_name, char *ip);
-void convert_mdns_host(char * from, char * to);
+static const MqttWritable * mqtt_sub_writable(uint16_t index)
+{
+	for (uint32_t i = 0; i < sizeof(s_writable) / sizeof(s_writable[0]); i++)
+	{
+		if (s_writable[i].index == index) return &s_writable[i];
+	}
+	return NULL;
+}
 
-void mqtt_sub_task(void *pvParameters)
+// Handles wp/write/<NAME>, the outcome is published by write.c
+static void mqtt_sub_write(const char *name, const char *data)
 {
-#if CONFIG_ENABLE_SECURE_MQTT
-	ESP_LOGI(TAG, "Start Subscribe Broker:%s", CONFIG_MQTTS_BROKER);
-#else
-	ESP_LOGI(TAG, "Start Subscribe Broker:%s", CONFIG_MQTT_BROKER);
-#endif
+	char entryName[ELSTER_NAME_LEN];
+	ElsterIndex entry;
 
-	/* Create Eventgroup */
-	s_mqtt_event_group = xEventGroupCreate();
-	configASSERT( s_mqtt_event_group );
-	xEventGroupClearBits(s_mqtt_event_group, MQTT_CONNECTED_BIT);
+	int tableIndex = GetElsterTableIndexFromString(name);
+	if (tableIndex < 0 || !GetElsterTableEntry(tableIndex, &entry, entryName)) {
+		ESP_LOGW(TAG, "unknown parameter %s", name);
+		return;
+	}
+	const MqttWritable *writable = mqtt_sub_writable(entry.Index);
+	if (writable == NULL) {
+		ESP_LOGW(TAG, "%s is not writable", name);
+		return;
+	}
+	if (writable->min != writable->max) {
+		long n = strtol(data, NULL, 10);
+		if (n < writable->min || n > writable->max) {
+			ESP_LOGW(TAG, "%s: %s out of range %d-%d", name, data, writable->min, writable->max);
+			return;
+		}
+	}
+	uint32_t value = TranslateString(data, entry.Type);
+	if (value == 0xffff) {
+		ESP_LOGW(TAG, "%s: invalid value %s", name, data);
+		return;
+	}
 
-	/* Create Queue */
-	xQueueSubscribe = xQueueCreate( 10, sizeof(MQTT_t) );
-	configASSERT( xQueueSubscribe );
+	ESP_LOGI(TAG, "value: %x, rcv: %x, idx: %x", (unsigned int)value, (unsigned int)writable->receiver, (unsigned int)entry.Index);
+	write_request(writable->receiver, entry.Index, value);
+}
+
+#if CONFIG_WPM_CAPTURE
+static bool mqtt_sub_capture_emit(void *ctx, const char *text, size_t len)
+{
+	return mqtt_conn_publish("wp/sys/capture/log", text, len, 1, 0) >= 0;
+}
 
-	// Set client id from mac
-	uint8_t mac[8];
-	ESP_ERROR_CHECK(esp_base_mac_addr_get(mac));
-	for(int i=0;i<8;i++) {
-		ESP_LOGD(TAG, "mac[%d]=%x", i, mac[i]);
+// Handles wp/sys/capture: start [id=..] [receiver=..] [index=..], stop,
+// clear or dump. The status follows on wp/sys/capture/status.
+static void mqtt_sub_capture(const char *data)
+{
+	while (*data == ' ') data++;
+	if (strncmp(data, "start", 5) == 0) {
+		CAPTURE_FILTER_t filter;
+		if (!capture_parse_filter(&data[5], &filter)) {
+			ESP_LOGW(TAG, "invalid capture filter %s", &data[5]);
+			return;
+		}
+		capture_start(&filter);
+	} else if (strncmp(data, "stop", 4) == 0) {
+		capture_stop();
+	} else if (strncmp(data, "clear", 5) == 0) {
+		capture_clear();
+	} else if (strncmp(data, "dump", 4) == 0) {
+		// candump -l lines in chunks, an empty message ends the dump
+		static char buf[2048];
+		if (capture_export(buf, sizeof(buf), mqtt_sub_capture_emit, NULL) >= 0) {
+			mqtt_conn_publish("wp/sys/capture/log", "", 0, 1, 0);
+		}
+	} else {
+		ESP_LOGW(TAG, "unknown capture command %s", data);
+		return;
 	}
-	char client_id[64];
-	sprintf(client_id, "sub-%02x%02x%02x%02x%02x%02x", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
-	ESP_LOGI(TAG, "client_id=[%s]", client_id);
-
-	// Resolve mDNS host name
-	char ip[128];
-	char uri[138];
-#if CONFIG_ENABLE_SECURE_MQTT
-	ESP_LOGI(TAG, "CONFIG_MQTTS_BROKER=[%s]", CONFIG_MQTTS_BROKER);
-	convert_mdns_host(CONFIG_MQTTS_BROKER, ip);
-	ESP_LOGI(TAG, "ip=[%s]", ip);
-	sprintf(uri, "mqtts://%s", ip);
-#else
-	ESP_LOGI(TAG, "CONFIG_MQTT_BROKER=[%s]", CONFIG_MQTT_BROKER);
-	convert_mdns_host(CONFIG_MQTT_BROKER, ip);
-	ESP_LOGI(TAG, "ip=[%s]", ip);
-	sprintf(uri, "mqtt://%s", ip);
+
+	char status[256];
+	int len = capture_render_status(status, sizeof(status));
+	if (len > 0) mqtt_conn_publish("wp/sys/capture/status", status, len, 0, 0);
+}
 #endif
-	ESP_LOGI(TAG, "uri=[%s]", uri);
 
+#if CONFIG_WPM_REPLAY
+// Handles wp/sys/replay: start [speed|max] replays the capture on flash,
+// stop. The report follows on wp/sys/replay/status.
+static void mqtt_sub_replay(const char *data)
+{
+	// read by replay_task until the replay ended
+	static CAPTURE_READER_t reader;
+	while (*data == ' ') data++;
+	if (strncmp(data, "start", 5) == 0) {
+		uint32_t speed;
+		if (!replay_parse_speed(&data[5], &speed)) {
+			ESP_LOGW(TAG, "invalid replay speed %s", &data[5]);
+			return;
+		}
+		REPLAY_STATS_t stats;
+		replay_get_stats(&stats);
+		if (stats.active) {
+			ESP_LOGW(TAG, "replay running");
+			return;
+		}
+		capture_reader_init(&reader);
+		replay_start(capture_reader_next, &reader, speed);
+	} else if (strncmp(data, "stop", 4) == 0) {
+		replay_stop();
+	} else {
+		ESP_LOGW(TAG, "unknown replay command %s", data);
+		return;
+	}
 
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-	esp_mqtt_client_config_t mqtt_cfg = {
-		.broker.address.uri = uri,
-#if CONFIG_ENABLE_SECURE_MQTT
-		.broker.verification.certificate = (const char *)root_cert_pem_start,
-		.broker.address.port = 8883,
-#else
-		.broker.address.port = 1883,
-#endif
-#if CONFIG_BROKER_AUTHENTICATION
-		.credentials.username = CONFIG_AUTHENTICATION_USERNAME,
-		.credentials.authentication.password = CONFIG_AUTHENTICATION_PASSWORD,
-#endif
-		.credentials.client_id = client_id
-	};
-
-#else
-	esp_mqtt_client_config_t mqtt_cfg = {
-		.uri = uri,
-#if CONFIG_ENABLE_SECURE_MQTT
-		.cert_pem = (const char *)root_cert_pem_start,
-		.port = 8883,
-#else
-		.port = 1883,
-#endif
-		.event_handle = mqtt_event_handler,
-#if CONFIG_BROKER_AUTHENTICATION
-		.username = CONFIG_AUTHENTICATION_USERNAME,
-		.password = CONFIG_AUTHENTICATION_PASSWORD,
+	char status[384];
+	int len = replay_render_status(status, sizeof(status));
+	if (len > 0) mqtt_conn_publish("wp/sys/replay/status", status, len, 0, 0);
+}
 #endif
-		.client_id = client_id
-	};
-#endif // ESP_IDF_VERSION
 
-	esp_mqtt_client_handle_t mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
+static void mqtt_sub_dispatch(MQTT_t *msg)
+{
+	ESP_LOGD(TAG, "type=%d", msg->topic_type);
 
-#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
-	esp_mqtt_client_register_event(mqtt_client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-#endif
+	if (msg->topic_type != SUBSCRIBE) return;
+	ESP_LOGI(TAG, "TOPIC=[%s] DATA=[%.*s]", msg->topic, msg->data_len, msg->data);
 
-	esp_mqtt_client_start(mqtt_client);
-	xEventGroupWaitBits(s_mqtt_event_group, MQTT_CONNECTED_BIT, false, true, portMAX_DELAY);
-	ESP_LOGI(TAG, "Connect to MQTT Server");
+	if (strcmp(msg->topic, "wp/poll/set") == 0)
+	{
+		poll_set(msg->data);
+		return;
+	}
 
-	for (uint32_t i = 0; i < sizeof(s_subscribedTopics) / sizeof(s_subscribedTopics[0]); i++)
+	if (strcmp(msg->topic, "wp/sys/trace/dump") == 0)
 	{
-		esp_mqtt_client_subscribe(mqtt_client, s_subscribedTopics[i].topic, 0);
+		// the trace belongs to mqtt_pub_task, which publishes it
+		trace_request_dump();
+		return;
 	}
 
-	twai_message_t tx_msg;
-	MQTT_t mqttBuf;
-	while (1) {
-		xQueueReceive(xQueueSubscribe, &mqttBuf, portMAX_DELAY);
-		ESP_LOGI(TAG, "type=%d", mqttBuf.topic_type);
+	if (strcmp(msg->topic, "wp/sys/log/level") == 0)
+	{
+		esp_log_level_t level;
+		if (dlog_parse_level(msg->data, &level)) dlog_set_level(level);
+		else ESP_LOGW(TAG, "invalid log level %s", msg->data);
+		return;
+	}
 
-		if (mqttBuf.topic_type != SUBSCRIBE) continue;
-		ESP_LOGI(TAG, "TOPIC=[%s]", mqttBuf.topic);
-		for(int i=0;i<mqttBuf.data_len;i++) {
-			ESP_LOGI(TAG, "DATA=0x%x", mqttBuf.data[i]);
-		}
+#if CONFIG_WPM_CAPTURE
+	if (strcmp(msg->topic, "wp/sys/capture") == 0)
+	{
+		mqtt_sub_capture(msg->data);
+		return;
+	}
+#endif
+
+#if CONFIG_WPM_REPLAY
+	if (strcmp(msg->topic, "wp/sys/replay") == 0)
+	{
+		mqtt_sub_replay(msg->data);
+		return;
+	}
+#endif
 
-		tx_msg.extd = 0;
-		tx_msg.ss = 1;
-		tx_msg.self = 0;
-		tx_msg.dlc_non_comp = 0;
-		tx_msg.identifier = 0x680;
-		tx_msg.data_length_code = 7;
+	if (strncmp(msg->topic, WRITE_PREFIX, WRITE_PREFIX_LEN) == 0)
+	{
+		mqtt_sub_write(&msg->topic[WRITE_PREFIX_LEN], msg->data);
+	}
 
-		for (uint32_t i = 0; i < sizeof(s_subscribedTopics) / sizeof(s_subscribedTopics[0]); i++)
+	if (strncmp(msg->topic, "wp/get/", 7) == 0)
+	{
+		get_request(&msg->topic[7]);
+	}
+	else if (strcmp(msg->topic, "wp/get") == 0)
+	{
+		char *save;
+		for (char *name = strtok_r(msg->data, " ,;\r\n\t", &save); name; name = strtok_r(NULL, " ,;\r\n\t", &save))
 		{
-			MqttTopic topic = s_subscribedTopics[i];
-			if (strcmp(mqttBuf.topic, topic.topic) == 0)
-			{
-				ESP_LOGI(TAG, "match");
-				uint32_t value = TranslateString(mqttBuf.data, topic.valueType);
-				
-				ESP_LOGI(TAG, "value: %x, rcv: %x, idx: %x", (unsigned int)value, (unsigned int)topic.receiver, (unsigned int)topic.index);
+			get_request(name);
+		}
+	}
+}
 
-				// set value
-				ElsterPacketSend pSet = { topic.receiver, ELSTER_PT_WRITE, topic.index};
-				ElsterPrepareSendPacket(7, tx_msg.data, pSet);
-				ElsterSetValueDefault(7, tx_msg.data, value);
-				xQueueSend(xQueue_twai_tx, &tx_msg, portMAX_DELAY);
+void mqtt_sub_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
 
-				// get value right after setting
-				ElsterPacketSend pRead = { topic.receiver, ELSTER_PT_READ, topic.index};
-				ElsterPrepareSendPacket(7, tx_msg.data, pRead);
-				xQueueSend(xQueue_twai_tx, &tx_msg, portMAX_DELAY);
+	/* Create Queue, it carries buffers of the message pool */
+	msg_pool_init();
+	xQueueSubscribe = xQueueCreate( MSG_POOL_SIZE, sizeof(MQTT_t *) );
+	configASSERT( xQueueSubscribe );
+	metrics_watch_queue(METRIC_Q_SUB, xQueueSubscribe);
+
+	// one subscription for all writable parameters
+	mqtt_conn_subscribe(WRITE_PREFIX "#", 0, mqtt_sub_handler);
+	mqtt_conn_subscribe("wp/poll/set", 0, mqtt_sub_handler);
+	// wp/get/<NAME> and wp/get with a list of names
+	mqtt_conn_subscribe("wp/get/#", 0, mqtt_sub_handler);
+	mqtt_conn_subscribe("wp/sys/log/level", 0, mqtt_sub_handler);
+#if CONFIG_WPM_CAPTURE
+	mqtt_conn_subscribe("wp/sys/capture", 0, mqtt_sub_handler);
+#endif
+#if CONFIG_WPM_REPLAY
+	mqtt_conn_subscribe("wp/sys/replay", 0, mqtt_sub_handler);
+#endif
+#if CONFIG_WPM_TRACE
+	mqtt_conn_subscribe("wp/sys/trace/dump", 0, mqtt_sub_handler);
+#endif
 
-				break;
-			}
-		}
+	MQTT_t *msg;
+	while (1) {
+		xQueueReceive(xQueueSubscribe, &msg, portMAX_DELAY);
+		mqtt_sub_dispatch(msg);
+		msg_pool_put(msg);
 
 /*
 		if (strcmp(mqttBuf.topic, "wp/write/PROGRAMMSCHALTER") == 0)
@@ -280,6 +312,5 @@ void mqtt_sub_task(void *pvParameters)
 
 	// Never reach here
 	ESP_LOGI(TAG, "Task Delete");
-	esp_mqtt_client_stop(mqtt_client);
 	vTaskDelete(NULL);
 }
@@ -0,0 +1,77 @@
+/*
+	Fixed pool of MQTT_t buffers passed between tasks by pointer.
+
+	The free buffers are kept in a FreeRTOS queue of pointers, so taking and
+	returning a buffer is safe from any task. Queues between tasks then only
+	carry the pointer (4 bytes) instead of the whole MQTT_t, which was
+	copied into and out of the queue storage for every message.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+#include "mqtt.h"
+#include "msg_pool.h"
+
+static const char *TAG = "POOL";
+
+static MQTT_t s_buffers[MSG_POOL_SIZE];
+static QueueHandle_t s_free;
+static MSG_POOL_STATS_t s_stats;
+
+void msg_pool_init(void)
+{
+	s_free = xQueueCreate(MSG_POOL_SIZE, sizeof(MQTT_t *));
+	configASSERT( s_free );
+	for (int i = 0; i < MSG_POOL_SIZE; i++) {
+		MQTT_t *msg = &s_buffers[i];
+		xQueueSend(s_free, &msg, 0);
+	}
+	memset(&s_stats, 0, sizeof(s_stats));
+	s_stats.lowWater = MSG_POOL_SIZE;
+}
+
+MQTT_t *msg_pool_take(int16_t type, const char *topic, int topic_len, const char *data, int data_len, TickType_t wait)
+{
+	MQTT_t *msg;
+	// a cut topic could name another value, cut data write a wrong one
+	if (topic_len < 0 || topic_len >= sizeof(msg->topic) || data_len < 0 || data_len >= sizeof(msg->data)) {
+		s_stats.oversize++;
+		ESP_LOGW(TAG, "message too long, topic %d data %d bytes", topic_len, data_len);
+		return NULL;
+	}
+	if (xQueueReceive(s_free, &msg, wait) != pdTRUE) {
+		s_stats.exhausted++;
+		ESP_LOGW(TAG, "no free buffer, message dropped");
+		return NULL;
+	}
+	UBaseType_t free = uxQueueMessagesWaiting(s_free);
+	if (free < s_stats.lowWater) s_stats.lowWater = free;
+	s_stats.taken++;
+
+	msg->topic_type = type;
+	msg->topic_len = topic_len;
+	memcpy(msg->topic, topic, topic_len);
+	msg->topic[topic_len] = 0;
+	msg->data_len = data_len;
+	memcpy(msg->data, data, data_len);
+	msg->data[data_len] = 0;
+	return msg;
+}
+
+void msg_pool_put(MQTT_t *msg)
+{
+	if (msg == NULL) return;
+	xQueueSend(s_free, &msg, 0);
+}
+
+void msg_pool_get_stats(MSG_POOL_STATS_t *stats)
+{
+	*stats = s_stats;
+}
@@ -0,0 +1,32 @@
+/*
+	Fixed pool of MQTT_t buffers passed between tasks by pointer.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef MSG_POOL_H
+#define MSG_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "mqtt.h"
+
+#define MSG_POOL_SIZE 8
+
+typedef struct {
+	uint32_t taken;     // buffers handed out
+	uint32_t exhausted; // no free buffer, message dropped
+	uint32_t oversize;  // topic or data too long, message dropped
+	uint8_t lowWater;   // fewest free buffers seen
+} MSG_POOL_STATS_t;
+
+void msg_pool_init(void);
+// Copies topic and data into a free buffer, the one copy a message gets.
+// Returns NULL if no buffer is free within wait or topic or data do not fit;
+// nothing is truncated. Hand the buffer back with msg_pool_put().
+MQTT_t *msg_pool_take(int16_t type, const char *topic, int topic_len, const char *data, int data_len, TickType_t wait);
+void msg_pool_put(MQTT_t *msg);
+void msg_pool_get_stats(MSG_POOL_STATS_t *stats);
+
+#endif
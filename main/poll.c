@@ -0,0 +1,341 @@
+/*
+	Adaptive scheduler for the values polled from the WPM.
+
+	Every entry of the poll list has a min and max interval and a priority.
+	The current interval starts at the min interval, is halved whenever a
+	new value differs from the previous one and doubled while it does not
+	change, always within [min, max]. A value received by broadcast defers
+	the next poll by CONFIG_WPM_BROADCAST_TIMEOUT.
+
+	All polls together are limited to CONFIG_WPM_POLL_BUDGET requests per
+	minute (token bucket). When more entries are due than the budget and the
+	free in-flight slots allow, the highest priority and then the most
+	overdue entry goes first.
+
+	The list is read from a csv file and can be changed at runtime through
+	poll_set(), which writes it back.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "elster.h"
+#include "request.h"
+#include "change.h"
+#include "poll.h"
+
+static const char *TAG = "POLL";
+
+#define SECONDS_US(s) ((int64_t)(s) * 1000000)
+// one request in token units, CONFIG_WPM_POLL_BUDGET tokens are added per ms
+#define TOKEN_COST    (60 * 1000)
+#define TOKEN_MAX     ((int64_t)TOKEN_COST * CONFIG_WPM_MAX_INFLIGHT)
+
+typedef struct {
+	POLL_CONFIG_t cfg;
+	uint16_t interval;  // current interval in seconds
+	bool valid;         // value received at least once
+	uint16_t value;     // last raw value
+	int64_t due;        // esp_timer_get_time() of the next poll
+} POLL_t;
+
+// Used when there is no poll list file
+static const POLL_CONFIG_t s_defaultPolls[] = {
+	{ 0x480, 0x0112,  30,  600, 5, 0, 0 }, // PROGRAMMSCHALTER
+	{ 0x180, 0x4f07,  60,  600, 3, 0, 0 }, // KUEHLEN_AKTIVIERT
+	{ 0x180, 0x000e,  10,  300, 4, 2, 0 }, // SPEICHERISTTEMP
+	{ 0x500, 0x01d6,  10,  300, 4, 2, 0 }, // WPVORLAUFIST
+	{ 0x500, 0x0016,  10,  300, 4, 2, 0 }, // RUECKLAUFISTTEMP
+	{ 0x500, 0x000c,  30,  600, 3, 2, 0 }, // AUSSENTEMP
+	{ 0x601, 0x4ec7,  30,  600, 3, 1, 0 }, // RAUM_IST_TEMPERATUR
+	{ 0x601, 0x4ece,  60, 1800, 2, 0, 0 }, // RAUM_SOLL_TEMPERATUR
+	{ 0x601, 0x4ec8,  30,  600, 2, 5, 0 }, // RAUM_IST_FEUCHTE
+	{ 0x601, 0x4ee0,  60,  600, 2, 2, 0 }, // RAUM_TAUPUNKT_TEMPERATUR
+	{ 0x514, 0x091c,  60, 3600, 1, 0, 0 }, // WW_SUM_KWH
+	{ 0x514, 0x091d, 300, 3600, 0, 0, 0 }, // WW_SUM_MWH
+	{ 0x514, 0x0920,  60, 3600, 1, 0, 0 }, // HEIZ_SUM_KWH
+	{ 0x514, 0x0921, 300, 3600, 0, 0, 0 }, // HEIZ_SUM_MWH
+};
+
+static POLL_t s_polls[POLL_MAX_ENTRIES];
+static int s_npolls;
+static int64_t s_tokens;
+static int64_t s_lastTick;
+static const char *s_file;
+static SemaphoreHandle_t s_mutex;
+static TimerHandle_t s_timer;
+
+void twai_filter_set(const uint16_t *senders, int n);
+
+// Parses "receiver,index or name,min,max,priority[,deadband[,heartbeat]]".
+// Returns false if invalid.
+static bool poll_parse(const char *line, POLL_CONFIG_t *cfg)
+{
+	char buf[128];
+	strncpy(buf, line, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = 0;
+	char *pos = strpbrk(buf, "#\r\n");
+	if (pos) *pos = 0;
+
+	char *field[8];
+	char *save;
+	int n = 0;
+	for (char *ptr = strtok_r(buf, ", \t", &save); ptr != NULL && n < 8; ptr = strtok_r(NULL, ", \t", &save)) {
+		field[n++] = ptr;
+	}
+	if (n < 5 || n > 7) return false;
+
+	char *end;
+	unsigned long receiver = strtoul(field[0], &end, 16);
+	if (*end != 0 || receiver == 0 || receiver > 0x7ff) return false;
+	cfg->receiver = receiver;
+
+	// a name first, some are made of hex digits only, e.g. DCF
+	unsigned long index;
+	int tableIndex = GetElsterTableIndexFromString(field[1]);
+	ElsterIndex entry;
+	char name[ELSTER_NAME_LEN];
+	if (tableIndex >= 0 && GetElsterTableEntry(tableIndex, &entry, name)) {
+		index = entry.Index;
+	} else {
+		index = strtoul(field[1], &end, 16);
+		if (*end != 0) return false;
+	}
+	if (index > 0xffff) return false;
+	cfg->index = index;
+
+	cfg->minInterval = atoi(field[2]);
+	cfg->maxInterval = atoi(field[3]);
+	cfg->priority = atoi(field[4]);
+	cfg->deadband = n > 5 ? atoi(field[5]) : 0;
+	cfg->heartbeat = n > 6 ? atoi(field[6]) : 0;
+	if (cfg->minInterval > 0 && cfg->maxInterval < cfg->minInterval) return false;
+	return true;
+}
+
+static int poll_find(uint16_t receiver, uint16_t index)
+{
+	for (int i = 0; i < s_npolls; i++) {
+		if (s_polls[i].cfg.receiver == receiver && s_polls[i].cfg.index == index) return i;
+	}
+	return -1;
+}
+
+// Call with s_mutex held
+static bool poll_add(const POLL_CONFIG_t *cfg, int64_t now)
+{
+	int i = poll_find(cfg->receiver, cfg->index);
+	if (cfg->minInterval == 0) {
+		if (i < 0) return false;
+		s_polls[i] = s_polls[--s_npolls];
+		return true;
+	}
+	if (i < 0) {
+		if (s_npolls >= POLL_MAX_ENTRIES) return false;
+		i = s_npolls++;
+		memset(&s_polls[i], 0, sizeof(s_polls[i]));
+		s_polls[i].due = now;
+	}
+	s_polls[i].cfg = *cfg;
+	s_polls[i].interval = cfg->minInterval;
+	change_configure(cfg->receiver, cfg->index, cfg->deadband, cfg->heartbeat);
+	return true;
+}
+
+#if CONFIG_WPM_HW_FILTER
+// Lets the responses of all devices in the list pass the TWAI filter.
+// Call with s_mutex held.
+static void poll_filter_update(void)
+{
+	uint16_t senders[POLL_MAX_ENTRIES];
+	int n = 0;
+	for (int i = 0; i < s_npolls; i++) {
+		int j = 0;
+		while (j < n && senders[j] != s_polls[i].cfg.receiver) j++;
+		if (j == n) senders[n++] = s_polls[i].cfg.receiver;
+	}
+	twai_filter_set(senders, n);
+}
+#endif
+
+static void poll_load(const char *file)
+{
+	int64_t now = esp_timer_get_time();
+	FILE* f = fopen(file, "r");
+	if (f == NULL) {
+		ESP_LOGW(TAG, "%s not found, using the built in poll list", file);
+		for (int i = 0; i < sizeof(s_defaultPolls) / sizeof(s_defaultPolls[0]); i++) {
+			poll_add(&s_defaultPolls[i], now);
+		}
+		return;
+	}
+
+	char line[128];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') continue;
+		POLL_CONFIG_t cfg;
+		if (!poll_parse(line, &cfg) || cfg.minInterval == 0) {
+			ESP_LOGE(TAG, "This line is invalid [%s]", line);
+			continue;
+		}
+		if (!poll_add(&cfg, now)) {
+			ESP_LOGE(TAG, "Poll list is full");
+			break;
+		}
+	}
+	fclose(f);
+}
+
+// Call with s_mutex held
+static esp_err_t poll_save(const char *file)
+{
+	FILE* f = fopen(file, "w");
+	if (f == NULL) {
+		ESP_LOGE(TAG, "Failed to open %s for writing", file);
+		return ESP_FAIL;
+	}
+	fprintf(f, "# receiver,index or name,min interval s,max interval s,priority,deadband,heartbeat s\n");
+	for (int i = 0; i < s_npolls; i++) {
+		POLL_CONFIG_t *cfg = &s_polls[i].cfg;
+		int tableIndex = GetElsterTableIndex(cfg->index);
+		ElsterIndex entry;
+		char name[ELSTER_NAME_LEN];
+		if (tableIndex >= 0 && GetElsterTableEntry(tableIndex, &entry, name)) {
+			fprintf(f, "0x%03x,%s,%u,%u,%u,%u,%u\n", cfg->receiver, name,
+				cfg->minInterval, cfg->maxInterval, cfg->priority, cfg->deadband, cfg->heartbeat);
+		} else {
+			fprintf(f, "0x%03x,0x%04x,%u,%u,%u,%u,%u\n", cfg->receiver, cfg->index,
+				cfg->minInterval, cfg->maxInterval, cfg->priority, cfg->deadband, cfg->heartbeat);
+		}
+	}
+	fclose(f);
+	return ESP_OK;
+}
+
+static void vTimerCallbackPollExpired(TimerHandle_t xTimer)
+{
+	POLL_CONFIG_t next[CONFIG_WPM_MAX_INFLIGHT];
+	int nnext = 0;
+	int64_t now = esp_timer_get_time();
+	uint8_t free = request_free();
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	s_tokens += (now - s_lastTick) / 1000 * CONFIG_WPM_POLL_BUDGET;
+	if (s_tokens > TOKEN_MAX) s_tokens = TOKEN_MAX;
+	s_lastTick = now;
+
+	while (nnext < free && s_tokens >= TOKEN_COST) {
+		POLL_t *best = NULL;
+		for (int i = 0; i < s_npolls; i++) {
+			POLL_t *poll = &s_polls[i];
+			if (poll->due > now) continue;
+			if (best == NULL || poll->cfg.priority > best->cfg.priority ||
+				(poll->cfg.priority == best->cfg.priority && poll->due < best->due)) {
+				best = poll;
+			}
+		}
+		if (best == NULL) break;
+		// poll_value() reschedules when the answer arrives, this covers a lost one
+		best->due = now + SECONDS_US(best->interval);
+		next[nnext++] = best->cfg;
+		s_tokens -= TOKEN_COST;
+	}
+	xSemaphoreGive(s_mutex);
+
+	for (int i = 0; i < nnext; i++) {
+		ESP_LOGD(TAG, "poll 0x%x 0x%04x", next[i].receiver, next[i].index);
+		if (!request_read(next[i].receiver, next[i].index)) break;
+	}
+}
+
+void poll_init(const char *file)
+{
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	s_file = file;
+	s_npolls = 0;
+	poll_load(file);
+#if CONFIG_WPM_HW_FILTER
+	poll_filter_update();
+#endif
+	ESP_LOGI(TAG, "%d values to poll, budget %d requests/min", s_npolls, CONFIG_WPM_POLL_BUDGET);
+
+	s_lastTick = esp_timer_get_time();
+	s_tokens = TOKEN_COST;
+	s_timer = xTimerCreate("pollTimer", pdMS_TO_TICKS(POLL_TICK_MS), pdTRUE, (void*)0, vTimerCallbackPollExpired);
+	configASSERT( s_timer );
+	xTimerStart(s_timer, pdMS_TO_TICKS(3000));
+}
+
+esp_err_t poll_set(const char *line)
+{
+	POLL_CONFIG_t cfg;
+	if (!poll_parse(line, &cfg)) {
+		ESP_LOGE(TAG, "This line is invalid [%s]", line);
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	esp_err_t ret = poll_add(&cfg, esp_timer_get_time()) ? poll_save(s_file) : ESP_ERR_NOT_FOUND;
+#if CONFIG_WPM_HW_FILTER
+	poll_filter_update();
+#endif
+	xSemaphoreGive(s_mutex);
+	ESP_LOGI(TAG, "set [%s]: %s", line, esp_err_to_name(ret));
+	return ret;
+}
+
+bool poll_receiver(uint16_t index, uint16_t *receiver)
+{
+	bool found = false;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i = 0; i < s_npolls; i++) {
+		if (s_polls[i].cfg.index == index) {
+			*receiver = s_polls[i].cfg.receiver;
+			found = true;
+			break;
+		}
+	}
+	xSemaphoreGive(s_mutex);
+	return found;
+}
+
+void poll_value(uint16_t sender, uint16_t index, uint16_t value, bool broadcast)
+{
+	int64_t now = esp_timer_get_time();
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	int i = poll_find(sender, index);
+	if (i >= 0) {
+		POLL_t *poll = &s_polls[i];
+		if (poll->valid && poll->value != value) {
+			poll->interval /= 2;
+		} else if (poll->valid) {
+			poll->interval = poll->interval > UINT16_MAX / 2 ? UINT16_MAX : poll->interval * 2;
+		}
+		if (poll->interval < poll->cfg.minInterval) poll->interval = poll->cfg.minInterval;
+		if (poll->interval > poll->cfg.maxInterval) poll->interval = poll->cfg.maxInterval;
+		poll->valid = true;
+		poll->value = value;
+		poll->due = now + SECONDS_US(poll->interval);
+#if CONFIG_WPM_BROADCAST_LISTENER
+		// no need to ask for it while it keeps arriving by broadcast
+		if (broadcast && poll->interval < CONFIG_WPM_BROADCAST_TIMEOUT) {
+			poll->due = now + SECONDS_US(CONFIG_WPM_BROADCAST_TIMEOUT);
+		}
+#endif
+		ESP_LOGD(TAG, "0x%x 0x%04x next in %ds", sender, index, poll->interval);
+	}
+	xSemaphoreGive(s_mutex);
+}
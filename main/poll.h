@@ -0,0 +1,39 @@
+/*
+	Adaptive scheduler for the values polled from the WPM.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef POLL_H
+#define POLL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define POLL_MAX_ENTRIES 64
+#define POLL_TICK_MS     1000
+
+typedef struct {
+	uint16_t receiver;
+	uint16_t index;
+	uint16_t minInterval; // seconds, used while the value changes
+	uint16_t maxInterval; // seconds, reached while the value is static
+	uint8_t priority;     // higher is polled first when several are due
+	uint16_t deadband;    // see change_configure()
+	uint16_t heartbeat;
+} POLL_CONFIG_t;
+
+// Loads the poll list from file (built in defaults if it does not exist)
+// and starts the scheduler.
+void poll_init(const char *file);
+// Adds, replaces or (min interval 0) removes the entry given as a line of the
+// poll list ("receiver,index or name,min,max,priority[,deadband[,heartbeat]]")
+// and saves the list to the file.
+esp_err_t poll_set(const char *line);
+// Receiver of the first entry polling index, false if it is not polled.
+bool poll_receiver(uint16_t index, uint16_t *receiver);
+// Called for every received value to adapt the entry's poll interval.
+void poll_value(uint16_t sender, uint16_t index, uint16_t value, bool broadcast);
+
+#endif
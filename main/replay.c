@@ -0,0 +1,206 @@
+/*
+	Replay of recorded CAN frames through the receive path.
+
+	replay_task takes the frames of a source, e.g. the capture on flash,
+	and hands them to twai_replay_frame(), which decodes them like the
+	frames twai_task receives. The telegrams twai_task would publish are
+	queued for mqtt_pub_task, marked as replayed, and nothing else: no
+	request, write, poll, get or change filter state is touched, so every
+	value is published. mqtt_pub_task publishes them to wp/replay/<NAME>
+	instead of wp/read/, they never reach the state, the spool or the
+	history. REPLAY_HEADROOM places of xQueue_mqtt_tx are left to the
+	frames from the bus, a replayed value finding no more is dropped.
+
+	Frames are injected at the recorded pace times the speed. Frames due
+	within the same tick are injected back to back, a frame injected after
+	its time shows as lag. At speed 0 frames are injected as fast as
+	mqtt_pub_task takes the packets, without dropping, which measures the
+	throughput of the decode and publish path. When the source is exhausted
+	replay_task waits for the last publish and reports on
+	wp/sys/replay/status.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "mqtt_conn.h"
+#include "replay.h"
+
+static const char *TAG = "REPLAY";
+
+#define DRAIN_MS 10000   // for the last packets to be published
+#define STEP_MS  1000
+
+typedef struct {
+	replay_source_t source;
+	void *ctx;
+	uint32_t speed;
+} REPLAY_REQUEST_t;
+
+extern QueueHandle_t xQueue_mqtt_tx;
+
+int twai_replay_frame(const twai_message_t *msg);
+
+static QueueHandle_t s_requestQueue;
+static bool s_stop;
+static REPLAY_STATS_t s_stats;
+
+void replay_init(void)
+{
+	s_requestQueue = xQueueCreate( 1, sizeof(REPLAY_REQUEST_t) );
+	configASSERT( s_requestQueue );
+}
+
+bool replay_start(replay_source_t source, void *ctx, uint32_t speed)
+{
+	bool idle = false;
+	if (!__atomic_compare_exchange_n(&s_stats.active, &idle, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		ESP_LOGW(TAG, "replay running");
+		return false;
+	}
+	REPLAY_REQUEST_t request = { .source = source, .ctx = ctx, .speed = speed };
+	__atomic_store_n(&s_stop, false, __ATOMIC_RELAXED);
+	xQueueSend(s_requestQueue, &request, 0);
+	return true;
+}
+
+void replay_stop(void)
+{
+	__atomic_store_n(&s_stop, true, __ATOMIC_RELAXED);
+}
+
+bool replay_parse_speed(const char *str, uint32_t *speed)
+{
+	while (*str == ' ') str++;
+	if (*str == 0 || *str == '\n' || *str == '\r') {
+		*speed = 1;
+		return true;
+	}
+	if (strncmp(str, "max", 3) == 0) {
+		*speed = 0;
+		return true;
+	}
+	char *end;
+	unsigned long value = strtoul(str, &end, 10);
+	if (end == str || value < 1 || value > REPLAY_MAX_SPEED) return false;
+	while (*end == ' ' || *end == '\n' || *end == '\r') end++;
+	if (*end != 0) return false;
+	*speed = value;
+	return true;
+}
+
+void replay_published(bool ok)
+{
+	__atomic_fetch_add(ok ? &s_stats.published : &s_stats.failed, 1, __ATOMIC_RELAXED);
+}
+
+static bool replay_stopped(void)
+{
+	return __atomic_load_n(&s_stop, __ATOMIC_RELAXED);
+}
+
+static void replay_run(const REPLAY_REQUEST_t *request)
+{
+	twai_message_t msg;
+	int64_t time, first = 0;
+	int64_t start = esp_timer_get_time();
+
+	s_stats.speed = request->speed;
+	s_stats.frames = s_stats.telegrams = s_stats.queued = s_stats.dropped = 0;
+	__atomic_store_n(&s_stats.published, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&s_stats.failed, 0, __ATOMIC_RELAXED);
+	s_stats.injectUs = s_stats.elapsedUs = s_stats.maxLagUs = 0;
+	ESP_LOGI(TAG, "started, speed %"PRIu32, request->speed);
+
+	while (!replay_stopped() && request->source(request->ctx, &msg, &time)) {
+		if (s_stats.frames == 0) first = time;
+		int64_t now = esp_timer_get_time();
+		if (request->speed == 0) {
+			// never drop, wait for mqtt_pub_task instead
+			while (uxQueueSpacesAvailable(xQueue_mqtt_tx) <= REPLAY_HEADROOM && !replay_stopped()) vTaskDelay(1);
+		} else {
+			int64_t due = start + (time - first) / request->speed;
+			if (now - due > s_stats.maxLagUs) s_stats.maxLagUs = now - due;
+			// in steps, a stop is not kept waiting by a long pause
+			while (due > now && !replay_stopped()) {
+				int64_t ms = (due - now) / 1000;
+				vTaskDelay(pdMS_TO_TICKS(ms < STEP_MS ? ms : STEP_MS));
+				if (ms == 0) break;
+				now = esp_timer_get_time();
+			}
+		}
+
+		int queued = twai_replay_frame(&msg);
+		s_stats.frames++;
+		if (msg.extd == 0 && msg.rtr == 0 && msg.data_length_code == 7) s_stats.telegrams++;
+		if (queued > 0) s_stats.queued++;
+		if (queued < 0) s_stats.dropped++;
+		s_stats.injectUs = esp_timer_get_time() - start;
+	}
+
+	for (int i = 0; i < DRAIN_MS / 10; i++) {
+		uint32_t done = __atomic_load_n(&s_stats.published, __ATOMIC_RELAXED) + __atomic_load_n(&s_stats.failed, __ATOMIC_RELAXED);
+		if (done >= s_stats.queued) break;
+		vTaskDelay(pdMS_TO_TICKS(10));
+	}
+	s_stats.elapsedUs = esp_timer_get_time() - start;
+	__atomic_store_n(&s_stats.active, false, __ATOMIC_RELEASE);
+	ESP_LOGI(TAG, "%s, %"PRIu32" frames in %"PRId64" ms, %"PRIu32" published, %"PRIu32" dropped",
+		replay_stopped() ? "stopped" : "done", s_stats.frames, s_stats.injectUs / 1000,
+		__atomic_load_n(&s_stats.published, __ATOMIC_RELAXED), s_stats.dropped);
+
+	char status[384];
+	int len = replay_render_status(status, sizeof(status));
+	if (len > 0) mqtt_conn_publish("wp/sys/replay/status", status, len, 0, 0);
+}
+
+void replay_task(void *pvParameters)
+{
+	ESP_LOGI(TAG, "Start");
+	REPLAY_REQUEST_t request;
+	while (1) {
+		if (xQueueReceive(s_requestQueue, &request, portMAX_DELAY) != pdTRUE) continue;
+		replay_run(&request);
+	}
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+// Per second of us, 0 for no time
+static uint32_t replay_rate(uint32_t count, int64_t us)
+{
+	return us > 0 ? (uint32_t)((int64_t)count * 1000000 / us) : 0;
+}
+
+int replay_render_status(char *buf, size_t size)
+{
+	REPLAY_STATS_t stats;
+	replay_get_stats(&stats);
+	int len = snprintf(buf, size,
+		"{\"active\":%s,\"speed\":%"PRIu32",\"frames\":%"PRIu32",\"telegrams\":%"PRIu32",\"queued\":%"PRIu32
+		",\"dropped\":%"PRIu32",\"published\":%"PRIu32",\"failed\":%"PRIu32",\"inject_ms\":%"PRId64",\"elapsed_ms\":%"PRId64
+		",\"frames_per_s\":%"PRIu32",\"published_per_s\":%"PRIu32",\"max_lag_ms\":%"PRId64"}",
+		stats.active ? "true" : "false", stats.speed, stats.frames, stats.telegrams, stats.queued,
+		stats.dropped, stats.published, stats.failed, stats.injectUs / 1000, stats.elapsedUs / 1000,
+		replay_rate(stats.frames, stats.injectUs), replay_rate(stats.published, stats.elapsedUs), stats.maxLagUs / 1000);
+	return (len >= 0 && (size_t)len < size) ? len : -1;
+}
+
+void replay_get_stats(REPLAY_STATS_t *stats)
+{
+	*stats = s_stats;
+	stats->active = __atomic_load_n(&s_stats.active, __ATOMIC_ACQUIRE);
+	stats->published = __atomic_load_n(&s_stats.published, __ATOMIC_RELAXED);
+	stats->failed = __atomic_load_n(&s_stats.failed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+/*
+	Replay of recorded CAN frames through the receive path, results on
+	wp/replay/<NAME> and wp/sys/replay/status.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "driver/twai.h"
+
+#define REPLAY_MAX_SPEED 1000
+#define REPLAY_HEADROOM  4     // places of xQueue_mqtt_tx left to the frames from the bus
+
+// Returns the next recorded frame and its time in us, false after the last
+typedef bool (*replay_source_t)(void *ctx, twai_message_t *msg, int64_t *time);
+
+typedef struct {
+	bool active;
+	uint32_t speed;      // times real time, 0 as fast as possible
+	uint32_t frames;     // injected
+	uint32_t telegrams;  // of them Elster telegrams
+	uint32_t queued;     // packets queued for publishing
+	uint32_t dropped;    // not queued, xQueue_mqtt_tx down to REPLAY_HEADROOM
+	uint32_t published;  // to wp/replay/
+	uint32_t failed;     // publish failed
+	int64_t injectUs;    // from the first to the last frame injected
+	int64_t elapsedUs;   // from the first frame to the last publish
+	int64_t maxLagUs;    // frame injected late, the gateway did not keep up
+} REPLAY_STATS_t;
+
+void replay_init(void);
+// Injects the frames of the replay started last, lowest priority
+void replay_task(void *pvParameters);
+// Replays the frames of source at speed times the recorded pace, 0 for as
+// fast as mqtt_pub_task takes them. ctx has to live until the replay ended.
+// Returns false if a replay is running.
+bool replay_start(replay_source_t source, void *ctx, uint32_t speed);
+void replay_stop(void);
+// "", "10", "max". Returns false for an invalid speed.
+bool replay_parse_speed(const char *str, uint32_t *speed);
+// Called by mqtt_pub_task for every replayed packet
+void replay_published(bool ok);
+// {"active":false,"speed":10,"frames":..}. Returns the length or -1 if it does not fit.
+int replay_render_status(char *buf, size_t size);
+void replay_get_stats(REPLAY_STATS_t *stats);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+	In-flight table of the read requests sent to the WPM.
+
+	Every READ is tracked by (receiver, index) with a deadline. A response
+	completes its entry and yields the request latency; a missing response is
+	retried CONFIG_WPM_REQUEST_RETRIES times with a doubled timeout each time
+	before it is given up. Up to CONFIG_WPM_MAX_INFLIGHT requests may be
+	outstanding at once.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "elster.h"
+#include "request.h"
+
+static const char *TAG = "REQ";
+
+#define TIMEOUT_US ((int64_t)CONFIG_WPM_REQUEST_TIMEOUT_MS * 1000)
+
+typedef struct {
+	bool used;
+	uint8_t retries;
+	uint16_t receiver;
+	uint16_t index;
+	int64_t sent;       // first transmission
+	int64_t deadline;
+} REQUEST_t;
+
+static REQUEST_t s_requests[CONFIG_WPM_MAX_INFLIGHT];
+static REQUEST_STATS_t s_stats;
+static SemaphoreHandle_t s_mutex;
+static TimerHandle_t s_timer;
+
+bool send_2_can(uint32_t canid, int16_t data_len, uint8_t const * const data);
+bool send_2_can_first(uint32_t canid, int16_t data_len, uint8_t const * const data);
+void twai_filter_require(uint16_t sender);
+
+// A READ dropped for a full transmit queue is sent again at the timeout
+static void request_send(uint16_t receiver, uint16_t index, bool urgent)
+{
+	uint8_t raw[7] = { 0u };
+	ElsterPacketSend packet = { receiver, ELSTER_PT_READ, index };
+	ElsterPrepareSendPacket(7, raw, packet);
+	if (urgent) {
+		send_2_can_first(0x680, 7, raw);
+	} else {
+		send_2_can(0x680, 7, raw);
+	}
+}
+
+// (Re)arms the one-shot timer to the earliest deadline. Call with s_mutex held.
+static void request_arm(int64_t now)
+{
+	int64_t earliest = INT64_MAX;
+	for (int i = 0; i < CONFIG_WPM_MAX_INFLIGHT; i++) {
+		if (s_requests[i].used && s_requests[i].deadline < earliest) {
+			earliest = s_requests[i].deadline;
+		}
+	}
+	if (earliest == INT64_MAX) {
+		xTimerStop(s_timer, 0);
+		return;
+	}
+	TickType_t ticks = pdMS_TO_TICKS((earliest - now + 999) / 1000);
+	xTimerChangePeriod(s_timer, ticks > 0 ? ticks : 1, 0);
+}
+
+static void vTimerCallbackRequestExpired(TimerHandle_t xTimer)
+{
+	REQUEST_t resend[CONFIG_WPM_MAX_INFLIGHT];
+	int nresend = 0;
+	int64_t now = esp_timer_get_time();
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i = 0; i < CONFIG_WPM_MAX_INFLIGHT; i++) {
+		REQUEST_t *req = &s_requests[i];
+		if (!req->used || req->deadline > now) continue;
+
+		if (req->retries < CONFIG_WPM_REQUEST_RETRIES) {
+			req->retries++;
+			req->deadline = now + (TIMEOUT_US << req->retries);
+			resend[nresend++] = *req;
+			s_stats.retries++;
+		} else {
+			ESP_LOGW(TAG, "no response from 0x%x for index 0x%04x", req->receiver, req->index);
+			req->used = false;
+			s_stats.timeouts++;
+		}
+	}
+	request_arm(now);
+	xSemaphoreGive(s_mutex);
+
+	for (int i = 0; i < nresend; i++) {
+		ESP_LOGI(TAG, "retry %d 0x%x 0x%04x", resend[i].retries, resend[i].receiver, resend[i].index);
+		request_send(resend[i].receiver, resend[i].index, false);
+	}
+}
+
+void request_init(void)
+{
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	s_timer = xTimerCreate("reqTimer", 1, pdFALSE, (void*)0, vTimerCallbackRequestExpired);
+	configASSERT( s_timer );
+	memset(s_requests, 0, sizeof(s_requests));
+	memset(&s_stats, 0, sizeof(s_stats));
+	s_stats.latencyMin = INT64_MAX;
+}
+
+static bool request_start(uint16_t receiver, uint16_t index, bool urgent)
+{
+	int64_t now = esp_timer_get_time();
+	int slot = -1;
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i = 0; i < CONFIG_WPM_MAX_INFLIGHT; i++) {
+		if (!s_requests[i].used) {
+			if (slot < 0) slot = i;
+		} else if (s_requests[i].receiver == receiver && s_requests[i].index == index) {
+			if (!urgent) {
+				// the answer to the pending request will do
+				xSemaphoreGive(s_mutex);
+				return true;
+			}
+			// that answer may predate a write, ask again
+			s_requests[i].deadline = now + TIMEOUT_US;
+			request_arm(now);
+			xSemaphoreGive(s_mutex);
+			request_send(receiver, index, true);
+			return true;
+		}
+	}
+	if (slot >= 0) {
+		REQUEST_t *req = &s_requests[slot];
+		req->used = true;
+		req->retries = 0;
+		req->receiver = receiver;
+		req->index = index;
+		req->sent = now;
+		req->deadline = now + TIMEOUT_US;
+		s_stats.sent++;
+		request_arm(now);
+	}
+	xSemaphoreGive(s_mutex);
+
+	if (slot < 0) return false;
+#if CONFIG_WPM_HW_FILTER
+	twai_filter_require(receiver);
+#endif
+	request_send(receiver, index, urgent);
+	return true;
+}
+
+bool request_read(uint16_t receiver, uint16_t index)
+{
+	return request_start(receiver, index, false);
+}
+
+bool request_read_urgent(uint16_t receiver, uint16_t index)
+{
+	return request_start(receiver, index, true);
+}
+
+bool request_response(uint16_t sender, uint16_t index)
+{
+	int64_t now = esp_timer_get_time();
+	bool matched = false;
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i = 0; i < CONFIG_WPM_MAX_INFLIGHT; i++) {
+		REQUEST_t *req = &s_requests[i];
+		if (req->used && req->receiver == sender && req->index == index) {
+			int64_t latency = now - req->sent;
+			req->used = false;
+			s_stats.completed++;
+			s_stats.latencySum += latency;
+			if (latency < s_stats.latencyMin) s_stats.latencyMin = latency;
+			if (latency > s_stats.latencyMax) s_stats.latencyMax = latency;
+			ESP_LOGD(TAG, "0x%x 0x%04x answered after %"PRId64"us (%d retries)", sender, index, latency, req->retries);
+			matched = true;
+			request_arm(now);
+			break;
+		}
+	}
+	if (!matched) s_stats.unmatched++;
+	if (matched && (s_stats.completed % 100) == 0) {
+		ESP_LOGI(TAG, "sent=%"PRIu32" completed=%"PRIu32" retries=%"PRIu32" timeouts=%"PRIu32" unmatched=%"PRIu32" latency min=%"PRId64"us avg=%"PRId64"us max=%"PRId64"us",
+			s_stats.sent, s_stats.completed, s_stats.retries, s_stats.timeouts, s_stats.unmatched,
+			s_stats.latencyMin, s_stats.latencySum / s_stats.completed, s_stats.latencyMax);
+	}
+	xSemaphoreGive(s_mutex);
+	return matched;
+}
+
+uint8_t request_free(void)
+{
+	uint8_t free = 0;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i = 0; i < CONFIG_WPM_MAX_INFLIGHT; i++) {
+		if (!s_requests[i].used) free++;
+	}
+	xSemaphoreGive(s_mutex);
+	return free;
+}
+
+void request_get_stats(REQUEST_STATS_t *stats)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	*stats = s_stats;
+	xSemaphoreGive(s_mutex);
+}
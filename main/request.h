@@ -0,0 +1,37 @@
+/*
+	In-flight table of the read requests sent to the WPM.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+	uint32_t sent;       // requests put on the bus (without retries)
+	uint32_t completed;  // answered requests
+	uint32_t retries;    // repeated transmissions
+	uint32_t timeouts;   // requests given up after the last retry
+	uint32_t unmatched;  // responses to 0x680 without a request in flight (late or foreign)
+	int64_t latencyMin;  // us from the first transmission to the response
+	int64_t latencyMax;
+	int64_t latencySum;
+} REQUEST_STATS_t;
+
+void request_init(void);
+// Sends a READ for (receiver, index) unless it is already in flight.
+// Returns false if all CONFIG_WPM_MAX_INFLIGHT slots are busy.
+bool request_read(uint16_t receiver, uint16_t index);
+// Like request_read() but sent ahead of queued frames, and sent again if a
+// read is already in flight (its answer may predate a write).
+bool request_read_urgent(uint16_t receiver, uint16_t index);
+// Called for every response addressed to us. Returns true if it answers a
+// request in flight, which is then completed.
+bool request_response(uint16_t sender, uint16_t index);
+uint8_t request_free(void);
+void request_get_stats(REQUEST_STATS_t *stats);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+	Store-and-forward log for values received while the broker is unreachable.
+
+	Records of 12 bytes are appended to segment files <prefix>NNNNNNNN.bin of
+	up to SPOOL_SEGMENT_SIZE bytes. The log is bounded to
+	CONFIG_WPM_SPOOL_SIZE KB; when a new segment would exceed it the oldest
+	segment is deleted. Records are only appended and whole segments are
+	deleted once replayed, so flash is written once per record and SPIFFS
+	spreads the segments over the partition.
+
+	The read position within the oldest segment is kept in RAM only: after a
+	reset the records of that segment already replayed are replayed again.
+
+	Only used by mqtt_pub_task, hence no locking.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+
+#include "elster.h"
+#include "spool.h"
+
+static const char *TAG = "SPOOL";
+
+#define RECORD_SIZE  sizeof(SPOOL_RECORD_t)
+#define MAX_SEGMENTS ((CONFIG_WPM_SPOOL_SIZE * 1024) / SPOOL_SEGMENT_SIZE)
+
+static char s_prefix[32];
+static bool s_any;               // segments s_first..s_last exist
+static uint32_t s_first;
+static uint32_t s_last;
+static uint32_t s_records;       // not yet replayed
+static long s_readOffset;        // in segment s_first
+static FILE *s_writeFile;        // segment s_last while it is being written
+static uint32_t s_writeSize;
+static int s_unflushed;
+static SPOOL_STATS_t s_stats;
+
+static void spool_path(char *path, size_t size, uint32_t seq)
+{
+	snprintf(path, size, "%s%08"PRIu32".bin", s_prefix, seq);
+}
+
+static long spool_size(uint32_t seq)
+{
+	char path[48];
+	struct stat st;
+	spool_path(path, sizeof(path), seq);
+	return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+static uint8_t spool_check(const SPOOL_RECORD_t *record)
+{
+	const uint8_t *p = (const uint8_t *)record;
+	uint8_t check = 0x5a;
+	for (int i = 0; i < RECORD_SIZE - 1; i++) check ^= p[i];
+	return check;
+}
+
+static void spool_close(void)
+{
+	if (s_writeFile == NULL) return;
+	fclose(s_writeFile);
+	s_writeFile = NULL;
+	s_unflushed = 0;
+}
+
+// Deletes the oldest segment, call with at least one segment
+static void spool_remove_first(void)
+{
+	char path[48];
+	long unread = (spool_size(s_first) - s_readOffset) / RECORD_SIZE;
+	if (s_writeFile != NULL && s_first == s_last) spool_close();
+	spool_path(path, sizeof(path), s_first);
+	remove(path);
+	s_records -= unread > 0 ? unread : 0;
+	s_readOffset = 0;
+	if (s_first == s_last) {
+		s_any = false;
+	} else {
+		s_first++;
+	}
+}
+
+void spool_init(const char *prefix)
+{
+	strlcpy(s_prefix, prefix, sizeof(s_prefix));
+	memset(&s_stats, 0, sizeof(s_stats));
+
+	// split "/spiffs/spool" into directory and file name
+	char dir[32];
+	strlcpy(dir, prefix, sizeof(dir));
+	char *slash = strrchr(dir, '/');
+	const char *base = prefix + (slash ? slash - dir + 1 : 0);
+	if (slash) *slash = 0;
+
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		ESP_LOGE(TAG, "Failed to open %s", dir);
+		return;
+	}
+	struct dirent *entry;
+	size_t baselen = strlen(base);
+	while ((entry = readdir(d)) != NULL) {
+		uint32_t seq;
+		if (strncmp(entry->d_name, base, baselen) != 0) continue;
+		if (sscanf(entry->d_name + baselen, "%08"SCNu32".bin", &seq) != 1) continue;
+		if (!s_any || seq < s_first) s_first = seq;
+		if (!s_any || seq > s_last) s_last = seq;
+		s_any = true;
+	}
+	closedir(d);
+
+	if (s_any) {
+		for (uint32_t seq = s_first; seq <= s_last; seq++) {
+			s_records += spool_size(seq) / RECORD_SIZE;
+		}
+	}
+	ESP_LOGI(TAG, "%"PRIu32" records in %"PRIu32" segments to replay", s_records, s_any ? s_last - s_first + 1 : 0);
+}
+
+bool spool_write(const ElsterPacketReceive *packet)
+{
+	if (s_writeFile == NULL) {
+		if (s_any && s_last - s_first + 1 >= MAX_SEGMENTS) {
+			uint32_t before = s_records;
+			spool_remove_first();
+			s_stats.dropped += before - s_records;
+			ESP_LOGW(TAG, "log full, dropped %"PRIu32" records", before - s_records);
+		}
+		uint32_t seq = s_any ? s_last + 1 : 0;
+		char path[48];
+		spool_path(path, sizeof(path), seq);
+		s_writeFile = fopen(path, "ab");
+		if (s_writeFile == NULL) {
+			ESP_LOGE(TAG, "Failed to open %s for writing", path);
+			return false;
+		}
+		if (!s_any) s_first = seq;
+		s_last = seq;
+		s_any = true;
+		s_writeSize = 0;
+		s_stats.segments++;
+	}
+
+	SPOOL_RECORD_t record = {
+		.time = time(NULL),
+		.sender = packet->sender,
+		.index = packet->index,
+		.value = packet->value,
+		.packetType = packet->packetType
+	};
+	record.check = spool_check(&record);
+	if (fwrite(&record, RECORD_SIZE, 1, s_writeFile) != 1) {
+		ESP_LOGE(TAG, "write failed");
+		spool_close();
+		return false;
+	}
+	s_records++;
+	s_writeSize += RECORD_SIZE;
+	s_stats.written++;
+	s_stats.bytesWritten += RECORD_SIZE;
+	// flush in page sized chunks rather than per record
+	if (++s_unflushed >= SPOOL_FLUSH_RECORDS) {
+		fflush(s_writeFile);
+		s_unflushed = 0;
+	}
+	if (s_writeSize + RECORD_SIZE > SPOOL_SEGMENT_SIZE) spool_close();
+	return true;
+}
+
+bool spool_pending(void)
+{
+	return s_records > 0;
+}
+
+int spool_peek(SPOOL_RECORD_t *records, int max)
+{
+	while (s_any && s_records > 0) {
+		// never read the segment that is still being written
+		if (s_writeFile != NULL && s_first == s_last) spool_close();
+
+		char path[48];
+		spool_path(path, sizeof(path), s_first);
+		FILE *f = fopen(path, "rb");
+		int n = 0;
+		if (f != NULL) {
+			if (fseek(f, s_readOffset, SEEK_SET) == 0) {
+				n = fread(records, RECORD_SIZE, max, f);
+			}
+			fclose(f);
+		}
+		if (n > 0) {
+			for (int i = 0; i < n; i++) {
+				if (records[i].check != spool_check(&records[i])) {
+					records[i].packetType = ELSTER_PT_invalid;
+					s_stats.corrupt++;
+				}
+			}
+			return n;
+		}
+		// segment replayed completely (or unreadable)
+		spool_remove_first();
+	}
+	return 0;
+}
+
+void spool_consume(int n)
+{
+	s_readOffset += n * RECORD_SIZE;
+	s_records -= n;
+	s_stats.replayed += n;
+	if (s_any && s_readOffset >= spool_size(s_first) && !(s_writeFile != NULL && s_first == s_last)) {
+		spool_remove_first();
+	}
+}
+
+void spool_get_stats(SPOOL_STATS_t *stats)
+{
+	*stats = s_stats;
+}
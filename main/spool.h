@@ -0,0 +1,45 @@
+/*
+	Store-and-forward log for values received while the broker is unreachable.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "elster.h"
+
+#define SPOOL_SEGMENT_SIZE (16 * 1024)
+#define SPOOL_FLUSH_RECORDS 16
+
+typedef struct __attribute__((packed)) {
+	uint32_t time;      // time(NULL) when received
+	uint16_t sender;
+	uint16_t index;
+	uint16_t value;     // raw value
+	uint8_t packetType;
+	uint8_t check;      // xor of the other bytes, detects torn writes
+} SPOOL_RECORD_t;
+
+typedef struct {
+	uint32_t written;       // records
+	uint32_t dropped;       // oldest records dropped because the log was full
+	uint32_t replayed;      // records
+	uint32_t corrupt;       // records skipped on replay
+	uint32_t bytesWritten;  // to flash, for the wear estimate
+	uint32_t segments;      // segment files created
+} SPOOL_STATS_t;
+
+// Picks up the segments left by the last run. prefix is e.g. "/spiffs/spool".
+void spool_init(const char *prefix);
+bool spool_write(const ElsterPacketReceive *packet);
+bool spool_pending(void);
+// Reads up to max of the oldest records without removing them.
+int spool_peek(SPOOL_RECORD_t *records, int max);
+// Removes the n oldest records (those returned by spool_peek).
+void spool_consume(int n);
+void spool_get_stats(SPOOL_STATS_t *stats);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+	Snapshot of the latest values, published as one document on wp/state.
+
+	Values are kept as received (raw) per table row and only rendered when
+	the document is built. Values that SetValueType() renders as a decimal
+	number become JSON numbers, in CBOR integers or decimal fractions (tag 4)
+	so that no precision is lost; everything else becomes text.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+
+#include "elster.h"
+#include "state.h"
+
+static const char *TAG = "STATE";
+
+static ElsterPacketReceive s_values[STATE_MAX_VALUES];
+static int s_nvalues;
+static bool s_dirty;
+
+void state_update(const ElsterPacketReceive *packet)
+{
+	if (packet->tableIndex == ELSTER_NO_TABLE_INDEX) return;
+
+	int i = 0;
+	while (i < s_nvalues && s_values[i].tableIndex != packet->tableIndex) i++;
+	if (i == s_nvalues) {
+		if (s_nvalues >= STATE_MAX_VALUES) {
+			ESP_LOGW(TAG, "no room for index 0x%04x", packet->index);
+			return;
+		}
+		s_nvalues++;
+	} else if (s_values[i].value == packet->value) {
+		return;
+	}
+	s_values[i] = *packet;
+	s_dirty = true;
+}
+
+bool state_dirty(void)
+{
+	return s_dirty;
+}
+
+// Number of decimals if Val is a decimal number ("-12.3"), -1 otherwise
+static int state_decimals(const char *Val)
+{
+	const char *p = Val;
+	if (*p == '-') p++;
+	if (*p < '0' || *p > '9') return -1;
+	while (*p >= '0' && *p <= '9') p++;
+	if (*p == 0) return 0;
+	if (*p != '.') return -1;
+	const char *frac = ++p;
+	while (*p >= '0' && *p <= '9') p++;
+	return (*p == 0 && p > frac) ? (int)(p - frac) : -1;
+}
+
+int state_render_json(char *buf, size_t size)
+{
+	char name[ELSTER_NAME_LEN];
+	char val[ELSTER_VALUE_LEN];
+	size_t len = 0;
+
+	s_dirty = false;
+	if (size < 3) return -1;
+	buf[len++] = '{';
+	for (int i = 0; i < s_nvalues; i++) {
+		ElsterPacketName(&s_values[i], name);
+		ElsterPacketValue(&s_values[i], val);
+		const char *quote = state_decimals(val) < 0 ? "\"" : "";
+		int n = snprintf(buf + len, size - len, "%s\"%s\":%s%s%s", i ? "," : "", name, quote, val, quote);
+		if (n < 0 || len + n + 2 > size) return -1;
+		len += n;
+	}
+	buf[len++] = '}';
+	buf[len] = 0;
+	return len;
+}
+
+// CBOR data item head (RFC 8949 3.), returns its length or 0 if it does not fit
+static size_t cbor_head(uint8_t *buf, size_t size, uint8_t major, uint64_t arg)
+{
+	uint8_t n = arg < 24 ? 0 : arg <= 0xff ? 1 : arg <= 0xffff ? 2 : arg <= 0xffffffff ? 4 : 8;
+	if (size < 1u + n) return 0;
+	buf[0] = (major << 5) | (n == 0 ? arg : n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27);
+	for (int i = 0; i < n; i++) {
+		buf[n - i] = arg >> (8 * i);
+	}
+	return 1 + n;
+}
+
+static size_t cbor_int(uint8_t *buf, size_t size, int64_t value)
+{
+	return value < 0 ? cbor_head(buf, size, 1, -1 - value) : cbor_head(buf, size, 0, value);
+}
+
+static size_t cbor_text(uint8_t *buf, size_t size, const char *text)
+{
+	size_t n = strlen(text);
+	size_t head = cbor_head(buf, size, 3, n);
+	if (head == 0 || head + n > size) return 0;
+	memcpy(buf + head, text, n);
+	return head + n;
+}
+
+int state_render_cbor(uint8_t *buf, size_t size)
+{
+	char name[ELSTER_NAME_LEN];
+	char val[ELSTER_VALUE_LEN];
+
+	s_dirty = false;
+	size_t len = cbor_head(buf, size, 5, s_nvalues);
+	if (len == 0) return -1;
+	for (int i = 0; i < s_nvalues; i++) {
+		ElsterPacketName(&s_values[i], name);
+		ElsterPacketValue(&s_values[i], val);
+		size_t n = cbor_text(buf + len, size - len, name);
+		if (n == 0) return -1;
+		len += n;
+
+		int decimals = state_decimals(val);
+		if (decimals < 0) {
+			n = cbor_text(buf + len, size - len, val);
+		} else {
+			// "-12.3" -> mantissa -123, exponent -1
+			char digits[64];
+			char *d = digits;
+			for (const char *p = val; *p; p++) {
+				if (*p != '.') *d++ = *p;
+			}
+			*d = 0;
+			int64_t mantissa = strtoll(digits, NULL, 10);
+			if (decimals == 0) {
+				n = cbor_int(buf + len, size - len, mantissa);
+			} else {
+				// decimal fraction: tag 4, [exponent, mantissa]
+				n = cbor_head(buf + len, size - len, 6, 4);
+				if (n) n += cbor_head(buf + len + n, size - len - n, 4, 2);
+				if (n) {
+					size_t e = cbor_int(buf + len + n, size - len - n, -decimals);
+					size_t m = e ? cbor_int(buf + len + n + e, size - len - n - e, mantissa) : 0;
+					n = m ? n + e + m : 0;
+				}
+			}
+		}
+		if (n == 0) return -1;
+		len += n;
+	}
+	return len;
+}
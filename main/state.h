@@ -0,0 +1,26 @@
+/*
+	Snapshot of the latest values, published as one document on wp/state.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "elster.h"
+
+#define STATE_MAX_VALUES 64
+
+// Stores the packet's value as the latest for its table row.
+void state_update(const ElsterPacketReceive *packet);
+// True if a value changed since the last state_render().
+bool state_dirty(void);
+// Renders all values as one JSON object or CBOR map ({"NAME": value, ...}).
+// Numbers are encoded as numbers, everything else as text. Returns the
+// length or -1 if buf is too small.
+int state_render_json(char *buf, size_t size);
+int state_render_cbor(uint8_t *buf, size_t size);
+
+#endif
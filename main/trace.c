@@ -0,0 +1,288 @@
+/*
+	Latency of a frame from twai_receive() to the PUBACK of its publish.
+
+	twai_task, mqtt_pub_task and the MQTT client task stamp the frames they
+	handle with esp_timer_get_time() into a ring of their own. A ring has one
+	writer and one reader (trace_collect() in mqtt_pub_task), so recording
+	takes no lock and never blocks: a record is written, then the head is
+	advanced. A writer that laps the reader overwrites the oldest records,
+	which are counted as lost.
+
+	trace_collect() matches the records of a frame by its id (the PUBACK by
+	the MQTT message id of the publish) and adds the time between two trace
+	points to the histogram of that stage. The histograms have four buckets
+	per power of two, a percentile is the upper bound of its bucket (at most
+	25% above the true value). The collected records are also kept for a
+	binary dump.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "trace.h"
+
+#if CONFIG_WPM_TRACE
+
+#define TAG "TRACE"
+
+#define RING_SIZE      CONFIG_WPM_TRACE_RING
+#define RINGS          3
+#define PENDING        64      // frames between TRACE_RX and TRACE_ACK that can be matched
+#define HIST_OCTAVES   25      // up to 2^26 us, 67 s
+#define HIST_BUCKETS   (4 + HIST_OCTAVES * 4)
+
+_Static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "CONFIG_WPM_TRACE_RING must be a power of two");
+
+typedef struct {
+	TRACE_RECORD_t records[RING_SIZE];
+	uint32_t head;  // advanced by the owner task only
+	uint32_t tail;  // advanced by trace_collect() only
+} TRACE_RING_t;
+
+typedef struct {
+	uint32_t id;
+	uint16_t msgId;
+	uint8_t seen;   // bit per TRACE_POINT_t
+	int64_t time[TRACE_POINTS];
+} TRACE_FRAME_t;
+
+typedef struct {
+	uint32_t count;
+	int64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+} TRACE_HIST_t;
+
+// The ring of the task that records a point
+static const uint8_t s_ringOf[TRACE_POINTS] = { 0, 0, 0, 1, 1, 2 };
+static const char * const s_stageNames[TRACE_POINTS] = { "total", "decode", "dispatch", "queue", "publish", "ack" };
+
+static TRACE_RING_t s_rings[RINGS];
+static uint32_t s_nextId;
+static bool s_dumpRequested;
+
+// Owned by mqtt_pub_task
+static TRACE_FRAME_t s_frames[PENDING];
+static TRACE_HIST_t s_hist[TRACE_POINTS];
+static uint32_t s_periodFrames;
+static uint32_t s_periodLost;
+static TRACE_RECORD_t s_dump[CONFIG_WPM_TRACE_DUMP];
+static uint32_t s_dumpPos;
+static uint32_t s_dumpCount;
+static TRACE_STATS_t s_stats;
+
+uint32_t trace_frame(void)
+{
+	if (++s_nextId == 0) s_nextId = 1;
+	return s_nextId;
+}
+
+void trace_record(TRACE_POINT_t point, uint32_t id, uint16_t msgId, int64_t time)
+{
+	if (point >= TRACE_POINTS || (id == 0 && point != TRACE_ACK)) return;
+	TRACE_RING_t *ring = &s_rings[s_ringOf[point]];
+	uint32_t head = ring->head;
+	TRACE_RECORD_t *r = &ring->records[head & (RING_SIZE - 1)];
+	r->time = time;
+	r->id = id;
+	r->msgId = msgId;
+	r->point = point;
+	r->reserved = 0;
+	// the record is complete before the reader can see it
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int hist_bucket(int64_t us)
+{
+	if (us < 4) return us < 0 ? 0 : (int)us;
+	int octave = 31 - __builtin_clz((uint32_t)(us > 0x7fffffff ? 0x7fffffff : us));
+	if (octave - 2 >= HIST_OCTAVES) return HIST_BUCKETS - 1;
+	int sub = (int)(us >> (octave - 2)) & 3;
+	return 4 + (octave - 2) * 4 + sub;
+}
+
+// Largest value that falls into bucket
+static int64_t hist_upper(int bucket)
+{
+	if (bucket < 4) return bucket;
+	int shift = (bucket - 4) / 4;
+	int sub = (bucket - 4) % 4;
+	return ((int64_t)(4 + sub + 1) << shift) - 1;
+}
+
+static void hist_add(int stage, int64_t us)
+{
+	TRACE_HIST_t *h = &s_hist[stage];
+	h->buckets[hist_bucket(us)]++;
+	h->count++;
+	if (us > h->max) h->max = us;
+}
+
+static int64_t hist_percentile(const TRACE_HIST_t *h, uint32_t percent)
+{
+	if (h->count == 0) return 0;
+	uint32_t rank = (uint32_t)(((uint64_t)h->count * percent + 99) / 100);
+	uint32_t sum = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		sum += h->buckets[i];
+		if (sum >= rank) {
+			int64_t upper = hist_upper(i);
+			return upper < h->max ? upper : h->max;
+		}
+	}
+	return h->max;
+}
+
+// Stage from point - 1 to point, once both are known
+static void trace_stage(const TRACE_FRAME_t *f, int point)
+{
+	if (point < 1 || point >= TRACE_POINTS) return;
+	uint8_t both = (1u << (point - 1)) | (1u << point);
+	if ((f->seen & both) == both) hist_add(point, f->time[point] - f->time[point - 1]);
+}
+
+static void trace_process(const TRACE_RECORD_t *r)
+{
+	TRACE_FRAME_t *f = NULL;
+	if (r->point == TRACE_ACK) {
+		// acks of other publishes (wp/state, wp/history, ...) find no frame
+		for (int i = 0; i < PENDING && f == NULL; i++) {
+			TRACE_FRAME_t *p = &s_frames[i];
+			if ((p->seen & (1u << TRACE_PUBLISH)) && !(p->seen & (1u << TRACE_ACK)) && p->msgId == r->msgId) f = p;
+		}
+		if (f == NULL) return;
+	} else {
+		f = &s_frames[r->id % PENDING];
+		if (f->id != r->id) {
+			memset(f, 0, sizeof(*f));
+			f->id = r->id;
+		}
+		if (r->point == TRACE_PUBLISH) f->msgId = r->msgId;
+	}
+	f->time[r->point] = r->time;
+	f->seen |= 1u << r->point;
+
+	// the rings are collected one after the other, so a later point may
+	// come before an earlier one
+	trace_stage(f, r->point);
+	trace_stage(f, r->point + 1);
+	uint8_t ends = (1u << TRACE_RX) | (1u << TRACE_ACK);
+	if ((f->seen & ends) == ends && (r->point == TRACE_RX || r->point == TRACE_ACK)) {
+		hist_add(TRACE_STAGE_TOTAL, f->time[TRACE_ACK] - f->time[TRACE_RX]);
+		s_periodFrames++;
+		s_stats.frames++;
+	}
+
+	s_dump[s_dumpPos] = *r;
+	if (++s_dumpPos == CONFIG_WPM_TRACE_DUMP) s_dumpPos = 0;
+	if (s_dumpCount < CONFIG_WPM_TRACE_DUMP) s_dumpCount++;
+}
+
+void trace_collect(void)
+{
+	for (int i = 0; i < RINGS; i++) {
+		TRACE_RING_t *ring = &s_rings[i];
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = ring->tail;
+		if (head - tail > RING_SIZE) {
+			s_stats.lost += head - tail - RING_SIZE;
+			s_periodLost += head - tail - RING_SIZE;
+			tail = head - RING_SIZE;
+		}
+		for (; tail != head; tail++) {
+			TRACE_RECORD_t r = ring->records[tail & (RING_SIZE - 1)];
+			// the writer may have started to overwrite it while we copied
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - tail >= RING_SIZE) {
+				s_stats.lost++;
+				s_periodLost++;
+				continue;
+			}
+			s_stats.records++;
+			trace_process(&r);
+		}
+		ring->tail = tail;
+	}
+}
+
+int trace_render_latency(char *buf, size_t size)
+{
+	// in the order a frame passes the stages
+	static const int order[TRACE_POINTS] = { 1, 2, 3, 4, 5, TRACE_STAGE_TOTAL };
+
+	int len = snprintf(buf, size, "{\"period\":%d,\"frames\":%"PRIu32",\"lost\":%"PRIu32,
+		CONFIG_WPM_TRACE_PERIOD, s_periodFrames, s_periodLost);
+	for (int i = 0; i < TRACE_POINTS && len >= 0 && (size_t)len < size; i++) {
+		const TRACE_HIST_t *h = &s_hist[order[i]];
+		len += snprintf(&buf[len], size - len,
+			",\"%s\":{\"n\":%"PRIu32",\"p50\":%"PRId64",\"p95\":%"PRId64",\"p99\":%"PRId64",\"max\":%"PRId64"}",
+			s_stageNames[order[i]], h->count, hist_percentile(h, 50), hist_percentile(h, 95),
+			hist_percentile(h, 99), h->max);
+	}
+	if (len >= 0 && (size_t)len < size) len += snprintf(&buf[len], size - len, "}");
+	if (len < 0 || (size_t)len >= size) return -1;
+
+	ESP_LOGI(TAG, "%"PRIu32" frames, total p50=%"PRId64"us p99=%"PRId64"us, %"PRIu32" records lost",
+		s_periodFrames, hist_percentile(&s_hist[TRACE_STAGE_TOTAL], 50),
+		hist_percentile(&s_hist[TRACE_STAGE_TOTAL], 99), s_periodLost);
+	memset(s_hist, 0, sizeof(s_hist));
+	s_periodFrames = 0;
+	s_periodLost = 0;
+	return len;
+}
+
+void trace_request_dump(void)
+{
+	__atomic_store_n(&s_dumpRequested, true, __ATOMIC_RELAXED);
+}
+
+bool trace_dump_requested(void)
+{
+	return __atomic_exchange_n(&s_dumpRequested, false, __ATOMIC_RELAXED);
+}
+
+int trace_dump(uint8_t *buf, size_t size)
+{
+	size_t len = sizeof(TRACE_DUMP_HEADER_t) + s_dumpCount * sizeof(TRACE_RECORD_t);
+	if (len > size) return -1;
+
+	TRACE_DUMP_HEADER_t header = {
+		.magic = { 'W', 'P', 'T', 'R' },
+		.version = 1,
+		.recordSize = sizeof(TRACE_RECORD_t),
+		.count = s_dumpCount,
+		.lost = s_stats.lost,
+		.now = esp_timer_get_time()
+	};
+	memcpy(buf, &header, sizeof(header));
+	uint32_t first = (s_dumpPos + CONFIG_WPM_TRACE_DUMP - s_dumpCount) % CONFIG_WPM_TRACE_DUMP;
+	for (uint32_t i = 0; i < s_dumpCount; i++) {
+		memcpy(&buf[sizeof(header) + i * sizeof(TRACE_RECORD_t)],
+			&s_dump[(first + i) % CONFIG_WPM_TRACE_DUMP], sizeof(TRACE_RECORD_t));
+	}
+	s_stats.dumps++;
+	return (int)len;
+}
+
+void trace_get_stats(TRACE_STATS_t *stats)
+{
+	*stats = s_stats;
+}
+
+#else
+
+void trace_collect(void) { }
+int trace_render_latency(char *buf, size_t size) { return -1; }
+void trace_request_dump(void) { }
+bool trace_dump_requested(void) { return false; }
+int trace_dump(uint8_t *buf, size_t size) { return -1; }
+void trace_get_stats(TRACE_STATS_t *stats) { memset(stats, 0, sizeof(*stats)); }
+
+#endif
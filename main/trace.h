@@ -0,0 +1,84 @@
+/*
+	Latency of a frame from twai_receive() to the PUBACK of its publish.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+// Trace points in the order a frame passes them. Every point is recorded by
+// one task only, which owns the ring it goes to.
+typedef enum {
+	TRACE_RX = 0,   // twai_task: twai_receive() returned the frame
+	TRACE_DECODE,   // twai_task: ElsterRawToReceivePacket() done
+	TRACE_ENQUEUE,  // twai_task: handed to xQueue_mqtt_tx
+	TRACE_DEQUEUE,  // mqtt_pub_task: taken from xQueue_mqtt_tx
+	TRACE_PUBLISH,  // mqtt_pub_task: handed to the MQTT client
+	TRACE_ACK,      // MQTT client task: PUBACK (MQTT_EVENT_PUBLISHED)
+	TRACE_POINTS
+} TRACE_POINT_t;
+
+// Stage n is the time from point n-1 to point n, TRACE_STAGE_TOTAL from
+// TRACE_RX to TRACE_ACK
+#define TRACE_STAGE_TOTAL 0
+
+// Record of the binary dump, little endian as in memory
+typedef struct {
+	int64_t time;     // esp_timer_get_time()
+	uint32_t id;      // frame id, 0 for TRACE_ACK
+	uint16_t msgId;   // MQTT message id for TRACE_PUBLISH and TRACE_ACK
+	uint8_t point;    // TRACE_POINT_t
+	uint8_t reserved;
+} TRACE_RECORD_t;
+
+// Binary dump published to wp/sys/trace: this header, then count records,
+// the oldest first
+typedef struct {
+	char magic[4];        // "WPTR"
+	uint16_t version;     // 1
+	uint16_t recordSize;  // sizeof(TRACE_RECORD_t)
+	uint32_t count;
+	uint32_t lost;        // records overwritten before they were collected
+	int64_t now;          // esp_timer_get_time() of the dump
+} TRACE_DUMP_HEADER_t;
+
+typedef struct {
+	uint32_t records;   // collected
+	uint32_t lost;      // overwritten in a ring before they were collected
+	uint32_t frames;    // frames traced up to TRACE_ACK
+	uint32_t dumps;
+} TRACE_STATS_t;
+
+#if CONFIG_WPM_TRACE
+// New frame id, never 0. Called by twai_task for every Elster telegram.
+uint32_t trace_frame(void);
+// Records that frame id passed point at time. id 0 is not traced, except
+// for TRACE_ACK which is matched by msgId.
+void trace_record(TRACE_POINT_t point, uint32_t id, uint16_t msgId, int64_t time);
+#else
+static inline uint32_t trace_frame(void) { return 0; }
+static inline void trace_record(TRACE_POINT_t point, uint32_t id, uint16_t msgId, int64_t time) { }
+#endif
+
+// Moves the records from the rings into the histograms and the dump
+// buffer. Call from mqtt_pub_task only, at least every TRACE_COLLECT_MS.
+void trace_collect(void);
+#define TRACE_COLLECT_MS 250
+// p50/p95/p99/max in us per stage since the last call as JSON, resets the
+// histograms. Returns the length or -1 if it does not fit.
+int trace_render_latency(char *buf, size_t size);
+// Asks mqtt_pub_task for a dump, from any task
+void trace_request_dump(void);
+bool trace_dump_requested(void);
+// Header and the last CONFIG_WPM_TRACE_DUMP records into buf. Returns the
+// length or -1 if it does not fit.
+int trace_dump(uint8_t *buf, size_t size);
+void trace_get_stats(TRACE_STATS_t *stats);
+
+#endif
@@ -15,168 +15,530 @@
 #include "freertos/task.h"
 #include "freertos/queue.h"
 #include "freertos/semphr.h"
-#include "freertos/timers.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/twai.h" // Update from V4.2
 #include "sdkconfig.h"
 
 #include "elster.h"
 #include "mqtt.h"
+#include "request.h"
+#include "poll.h"
+#include "change.h"
+#include "get.h"
+#include "write.h"
+#include "trace.h"
+#include "metrics.h"
+#include "dlog.h"
+#include "capture.h"
+#include "replay.h"
 
 static const char *TAG = "TWAI";
 
 extern QueueHandle_t xQueue_mqtt_tx;
 extern QueueHandle_t xQueue_twai_tx;
 
-uint8_t cyclicReadPacketPos = 0u;
-ElsterPacketSend cyclicReadPackets[] = {
-	{ 0x480, ELSTER_PT_READ, 0x0112}, // PROGRAMMSCHALTER
-	{ 0x180, ELSTER_PT_READ, 0x4f07}, // KUEHLEN_AKTIVIERT
-	{ 0x180, ELSTER_PT_READ, 0x000e}, // SPEICHERISTTEMP
-	{ 0x500, ELSTER_PT_READ, 0x01d6}, // WPVORLAUFIST
-	{ 0x500, ELSTER_PT_READ, 0x0016}, // RUECKLAUFISTTEMP
-	{ 0x500, ELSTER_PT_READ, 0x000c}, // AUSSENTEMP
-	{ 0x601, ELSTER_PT_READ, 0x4ec7}, // RAUM_IST_TEMPERATUR
-	{ 0x601, ELSTER_PT_READ, 0x4ece}, // RAUM_SOLL_TEMPERATUR
-	{ 0x601, ELSTER_PT_READ, 0x4ec8}, // RAUM_IST_FEUCHTE
-	{ 0x601, ELSTER_PT_READ, 0x4ee0}, // RAUM_TAUPUNKT_TEMPERATUR
-	{ 0x514, ELSTER_PT_READ, 0x091c}, // WW_SUM_KWH
-	{ 0x514, ELSTER_PT_READ, 0x091d}, // WW_SUM_MWH
-	{ 0x514, ELSTER_PT_READ, 0x0920}, // HEIZ_SUM_KWH
-	{ 0x514, ELSTER_PT_READ, 0x0921}, // HEIZ_SUM_MWH
-};
-
-TimerHandle_t timerHndTwaiRequests;
-
-void send_2_can(uint32_t canid, int16_t data_len, uint8_t const * const data)
-{
-	ESP_LOGI(TAG,"send_2_can");
-	twai_message_t tx_msg;
-	
-	tx_msg.extd = 0; // use standard frame
-	tx_msg.ss = 1;
-	tx_msg.self = 0;
-	tx_msg.dlc_non_comp = 0;
-	tx_msg.identifier = canid;
-	tx_msg.data_length_code = data_len;
+#if CONFIG_WPM_HW_FILTER
+#define FILTER_MAX_SENDERS (POLL_MAX_ENTRIES + 16)
+#define FILTER_RETRY_US    5000000 // after a failed reinstall
+
+// Frame accepted by the filter, set mask bits are don't care
+typedef struct {
+	uint16_t id;
+	uint16_t idMask;
+	uint8_t data0;
+	uint8_t data0Mask;
+	uint8_t data1;
+	uint8_t data1Mask;
+} FRAME_PATTERN_t;
+
+static const twai_general_config_t *s_gConfig;
+static const twai_timing_config_t *s_tConfig;
+static SemaphoreHandle_t s_filterMutex;
+static SemaphoreHandle_t s_driverMutex;
+// Devices whose responses to 0x680 are accepted
+static uint16_t s_filterSenders[FILTER_MAX_SENDERS];
+static int s_filterNsenders;
+static bool s_filterPending;
+static int64_t s_filterRetry;          // not before, after a failed reinstall
+static twai_filter_config_t s_filter;  // installed
+#endif
+
+// Length of a frame on the bus without stuff bits, for the bus load
+static inline uint32_t twai_frame_bits(const twai_message_t *msg)
+{
+	return (msg->extd ? 67 : 47) + 8 * msg->data_length_code;
+}
+
+static bool s_busOff;
+
+// Counts the controller going bus-off. twai_tx_task looks before every
+// transmit, a reinstall for the filter before it ends the state.
+static void twai_check_bus_off(const twai_status_info_t *status)
+{
+	bool busOff = status->state == TWAI_STATE_BUS_OFF;
+	if (__atomic_exchange_n(&s_busOff, busOff, __ATOMIC_RELAXED) != busOff && busOff) {
+		ESP_LOGW(TAG, "TWAI bus-off, tec=%"PRIu32" rec=%"PRIu32, status->tx_error_counter, status->rx_error_counter);
+		metrics_inc(METRIC_CAN_BUS_OFF);
+	}
+}
+
+#if CONFIG_WPM_HW_FILTER
+static void pattern_merge(FRAME_PATTERN_t *p, const FRAME_PATTERN_t *q)
+{
+	p->idMask |= q->idMask | (p->id ^ q->id);
+	p->data0Mask |= q->data0Mask | (p->data0 ^ q->data0);
+	p->data1Mask |= q->data1Mask | (p->data1 ^ q->data1);
+}
+
+// Share of random frames a filter checking ID, RTR and the given data bits lets through
+static float pattern_share(const FRAME_PATTERN_t *p, int data0Bits, int data1Bits)
+{
+	int exact = 11 - __builtin_popcount(p->idMask) + 1;
+	if (data0Bits) exact += 8 - __builtin_popcount(p->data0Mask);
+	if (data1Bits) exact += 8 - __builtin_popcount(p->data1Mask);
+	return 1.0f / (float)(1u << exact);
+}
+
+// Responses to 0x680 from senders[0..n)
+static FRAME_PATTERN_t pattern_responses(const uint16_t *senders, int n)
+{
+	FRAME_PATTERN_t p = { 0x000, 0x7ff, 0xd0 | ELSTER_PT_RESPONSE, 0x00, 0x680 & 0x7f, 0x00 };
+	for (int i = 0; i < n; i++) {
+		FRAME_PATTERN_t q = { senders[i], 0x000, p.data0, 0x00, p.data1, 0x00 };
+		if (i == 0) p = q;
+		else pattern_merge(&p, &q);
+	}
+	return p;
+}
+
+static int sender_compare(const void *a, const void *b)
+{
+	return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+// Computes the acceptance filter for the current senders: one single filter
+// (ID and both data bytes) or two dual filters (ID and data byte 0, ID only),
+// whichever lets the smaller share of other frames through. Call with
+// s_filterMutex held.
+static twai_filter_config_t twai_filter_compute(void)
+{
+	uint16_t senders[FILTER_MAX_SENDERS];
+	int n = s_filterNsenders;
+	memcpy(senders, s_filterSenders, n * sizeof(senders[0]));
+	qsort(senders, n, sizeof(senders[0]), sender_compare);
+
+	FRAME_PATTERN_t single = pattern_responses(senders, n);
+#if CONFIG_WPM_BROADCAST_LISTENER
+	// write or response from anyone to 0x79
+	const FRAME_PATTERN_t broadcast = { 0x000, 0x7ff, ELSTER_PT_WRITE, 0xf0 | ELSTER_PT_RESPONSE, 0x79, 0x00 };
+	pattern_merge(&single, &broadcast);
+#endif
+	float best = pattern_share(&single, 8, 8);
+	twai_filter_config_t f_config = {
+		.acceptance_code = ((uint32_t)single.id << 21) | ((uint32_t)single.data0 << 8) | single.data1,
+		.acceptance_mask = ((uint32_t)single.idMask << 21) | (0xfu << 16) | ((uint32_t)single.data0Mask << 8) | single.data1Mask,
+		.single_filter = true
+	};
+
+	// dual: filter 1 takes the broadcasts and senders[0..k), filter 2 senders[k..n)
+#if CONFIG_WPM_BROADCAST_LISTENER
+	int k = 0;
+#else
+	int k = 1;
+#endif
+	for (; k < n; k++) {
+		FRAME_PATTERN_t f1 = pattern_responses(senders, k);
+#if CONFIG_WPM_BROADCAST_LISTENER
+		if (k == 0) f1 = broadcast;
+		else pattern_merge(&f1, &broadcast);
+#endif
+		FRAME_PATTERN_t f2 = pattern_responses(senders + k, n - k);
+		float share = pattern_share(&f1, 8, 0) + pattern_share(&f2, 0, 0);
+		if (share < best) {
+			best = share;
+			f_config.acceptance_code = ((uint32_t)f1.id << 21) | ((uint32_t)(f1.data0 >> 4) << 16) |
+				((uint32_t)f2.id << 5) | (f1.data0 & 0xf);
+			f_config.acceptance_mask = ((uint32_t)f1.idMask << 21) | ((uint32_t)(f1.data0Mask >> 4) << 16) |
+				((uint32_t)f2.idMask << 5) | (f1.data0Mask & 0xf);
+			f_config.single_filter = false;
+		}
+	}
+	ESP_LOGI(TAG, "%s filter code=0x%08"PRIx32" mask=0x%08"PRIx32" for %d senders, passes %.3f%% of other frames",
+		f_config.single_filter ? "single" : "dual", f_config.acceptance_code, f_config.acceptance_mask, n, best * 100.0f);
+	return f_config;
+}
+
+// Senders whose responses must pass the filter. Replaces the current set.
+void twai_filter_set(const uint16_t *senders, int n)
+{
+	if (n > FILTER_MAX_SENDERS) n = FILTER_MAX_SENDERS;
+	xSemaphoreTake(s_filterMutex, portMAX_DELAY);
+	if (n != s_filterNsenders || memcmp(senders, s_filterSenders, n * sizeof(senders[0])) != 0) {
+		memcpy(s_filterSenders, senders, n * sizeof(senders[0]));
+		s_filterNsenders = n;
+		s_filterPending = true;
+	}
+	xSemaphoreGive(s_filterMutex);
+}
+
+// Adds a sender to the set unless it is already part of it.
+void twai_filter_require(uint16_t sender)
+{
+	xSemaphoreTake(s_filterMutex, portMAX_DELAY);
+	bool found = false;
+	for (int i = 0; i < s_filterNsenders && !found; i++) {
+		found = s_filterSenders[i] == sender;
+	}
+	if (!found && s_filterNsenders < FILTER_MAX_SENDERS) {
+		s_filterSenders[s_filterNsenders++] = sender;
+		s_filterPending = true;
+	}
+	xSemaphoreGive(s_filterMutex);
+}
+
+// Call with s_driverMutex held
+static esp_err_t twai_reinstall(const twai_filter_config_t *f_config)
+{
+	twai_status_info_t status;
+	if (twai_get_status_info(&status) == ESP_OK) twai_check_bus_off(&status);
+	// the driver counters restart from 0
+	metrics_twai_reinstall();
+	twai_stop();
+	twai_driver_uninstall();
+	esp_err_t ret = twai_driver_install(s_gConfig, s_tConfig, f_config);
+	if (ret == ESP_OK) ret = twai_start();
+	if (ret == ESP_OK) s_filter = *f_config;
+	return ret;
+}
+
+// The filter can only be changed by installing the driver again. If that
+// fails, the previous filter or else none is installed and the change is
+// tried again after FILTER_RETRY_US.
+static void twai_filter_apply(void)
+{
+	xSemaphoreTake(s_filterMutex, portMAX_DELAY);
+	twai_filter_config_t f_config = twai_filter_compute();
+	s_filterPending = false;
+	xSemaphoreGive(s_filterMutex);
+
+	xSemaphoreTake(s_driverMutex, portMAX_DELAY);
+	twai_filter_config_t previous = s_filter;
+	esp_err_t ret = twai_reinstall(&f_config);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "reinstalling the driver failed %s", esp_err_to_name(ret));
+		const twai_filter_config_t all = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+		if (twai_reinstall(&previous) != ESP_OK && twai_reinstall(&all) != ESP_OK) {
+			ESP_LOGE(TAG, "no driver installed");
+		}
+	}
+	xSemaphoreGive(s_driverMutex);
+	if (ret != ESP_OK) {
+		xSemaphoreTake(s_filterMutex, portMAX_DELAY);
+		s_filterPending = true;
+		xSemaphoreGive(s_filterMutex);
+		s_filterRetry = esp_timer_get_time() + FILTER_RETRY_US;
+	}
+}
+#endif
+
+// Installs the TWAI driver, with CONFIG_WPM_HW_FILTER only the frames of
+// interest pass the controller's acceptance filter.
+esp_err_t twai_install(const twai_general_config_t *g_config, const twai_timing_config_t *t_config)
+{
+#if CONFIG_WPM_HW_FILTER
+	s_gConfig = g_config;
+	s_tConfig = t_config;
+	s_filterMutex = xSemaphoreCreateMutex();
+	configASSERT( s_filterMutex );
+	s_driverMutex = xSemaphoreCreateMutex();
+	configASSERT( s_driverMutex );
+	s_filter = twai_filter_compute();
+	return twai_driver_install(g_config, t_config, &s_filter);
+#else
+	twai_filter_config_t f_config = TWAI_FILTER_CONFIG_ACCEPT_ALL();
+	return twai_driver_install(g_config, t_config, &f_config);
+#endif
+}
+
+// Never waits for room: the callers include the timer callbacks of
+// request.c, poll.c and write.c, which must not hold up the timer task.
+// They send again on a later tick.
+static bool twai_queue_tx(uint32_t canid, int16_t data_len, uint8_t const * const data, bool first)
+{
+	TWAI_t twaiBuf;
+	twai_message_t *tx_msg = &twaiBuf.msg;
+
+	memset(tx_msg, 0, sizeof(*tx_msg));
+	tx_msg->extd = 0; // use standard frame
+	tx_msg->ss = 1;
+	tx_msg->self = 0;
+	tx_msg->dlc_non_comp = 0;
+	tx_msg->identifier = canid;
+	tx_msg->data_length_code = data_len;
 	if (data_len > 8) {
 		ESP_LOGW(TAG, "Data length is reduced to 8 bytes");
-		tx_msg.data_length_code = 8;
+		tx_msg->data_length_code = 8;
 	}
-	for (int i=0;i<tx_msg.data_length_code;i++) {
-		tx_msg.data[i] = data[i];
+	for (int i=0;i<tx_msg->data_length_code;i++) {
+		tx_msg->data[i] = data[i];
 	}
-	if (xQueueSend(xQueue_twai_tx, &tx_msg, portMAX_DELAY) != pdPASS) {
-		ESP_LOGE(pcTaskGetName(0), "xQueueSend Fail");
+	twaiBuf.queued = esp_timer_get_time();
+	BaseType_t ret = first ? xQueueSendToFront(xQueue_twai_tx, &twaiBuf, 0)
+		: xQueueSend(xQueue_twai_tx, &twaiBuf, 0);
+	if (ret != pdPASS) {
+		ESP_LOGW(TAG, "transmit queue full, 0x%03"PRIx32" dropped", canid);
+		metrics_inc(METRIC_CAN_TX_DROPPED);
+		return false;
 	}
+	metrics_max(METRIC_Q_TWAI_TX_PEAK, uxQueueMessagesWaiting(xQueue_twai_tx));
+	DLOGD(DLOG_CAN_TX_QUEUED, canid, tx_msg->data_length_code, first);
+	return true;
 }
 
-void vTimerCallbackTwaiExpired( TimerHandle_t xTimer )
+// Returns false if the frame was dropped, the transmit queue was full
+bool send_2_can(uint32_t canid, int16_t data_len, uint8_t const * const data)
 {
-	uint8_t raw[7] = { 0u };
-	ElsterPrepareSendPacket(7, raw, cyclicReadPackets[cyclicReadPacketPos]);
-	send_2_can(0x680, 7, raw);
+	return twai_queue_tx(canid, data_len, data, false);
+}
 
-	cyclicReadPacketPos++;
-	if (cyclicReadPacketPos >= sizeof(cyclicReadPackets)/sizeof(cyclicReadPackets[0]))
-		cyclicReadPacketPos = 0u;
+// Like send_2_can() but ahead of everything queued, for writes and their read-back
+bool send_2_can_first(uint32_t canid, int16_t data_len, uint8_t const * const data)
+{
+	return twai_queue_tx(canid, data_len, data, true);
 }
 
+// Time from send_2_can() until the frame was handed to the driver
+static int64_t txLatencyMin = INT64_MAX;
+static int64_t txLatencyMax = 0;
+static int64_t txLatencySum = 0;
+static uint32_t txLatencyCount = 0;
+
+static void twai_tx_latency(int64_t latency)
+{
+	if (latency < txLatencyMin) txLatencyMin = latency;
+	if (latency > txLatencyMax) txLatencyMax = latency;
+	txLatencySum += latency;
+	txLatencyCount++;
+	ESP_LOGD(TAG, "tx latency %"PRId64"us", latency);
+	if (txLatencyCount == 100) {
+		ESP_LOGI(TAG, "tx latency min=%"PRId64"us avg=%"PRId64"us max=%"PRId64"us",
+			txLatencyMin, txLatencySum / txLatencyCount, txLatencyMax);
+		txLatencyMin = INT64_MAX;
+		txLatencyMax = 0;
+		txLatencySum = 0;
+		txLatencyCount = 0;
+	}
+}
+
+// Transmits everything queued in xQueue_twai_tx as soon as the driver has
+// room. Blocks on the queue while there is nothing to send.
+void twai_tx_task(void *pvParameters)
+{
+	ESP_LOGI(TAG,"tx task start");
+
+	TWAI_t twaiBuf;
+	while (1) {
+		xQueueReceive(xQueue_twai_tx, &twaiBuf, portMAX_DELAY);
+		// drain the queue into the driver's TX queue while frames are pending
+		do {
+			DLOGD(DLOG_CAN_TX, twaiBuf.msg.identifier, twaiBuf.msg.extd);
+			twai_status_info_t status_info;
+			twai_get_status_info(&status_info);
+			ESP_LOGD(TAG, "status_info.state=%d",status_info.state);
+			twai_check_bus_off(&status_info);
+			if (status_info.state != TWAI_STATE_RUNNING) {
+				ESP_LOGE(TAG, "TWAI driver not running %d", status_info.state);
+				metrics_inc(METRIC_CAN_TX_FAILED);
+				continue;
+			}
+			ESP_LOGD(TAG, "status_info.msgs_to_tx=%"PRIu32, status_info.msgs_to_tx);
+			// blocks until the driver's TX queue has room
+#if CONFIG_WPM_HW_FILTER
+			xSemaphoreTake(s_driverMutex, portMAX_DELAY);
+#endif
+			esp_err_t ret = twai_transmit(&twaiBuf.msg, pdMS_TO_TICKS(1000));
+#if CONFIG_WPM_HW_FILTER
+			xSemaphoreGive(s_driverMutex);
+#endif
+			if (ret == ESP_OK) {
+				metrics_inc(METRIC_CAN_TX);
+				metrics_add(METRIC_CAN_BITS, twai_frame_bits(&twaiBuf.msg));
+				twai_tx_latency(esp_timer_get_time() - twaiBuf.queued);
+			} else {
+				metrics_inc(METRIC_CAN_TX_FAILED);
+				ESP_LOGE(TAG, "twai_transmit Fail %s", esp_err_to_name(ret));
+			}
+		} while (xQueueReceive(xQueue_twai_tx, &twaiBuf, 0) == pdTRUE);
+	} // end while
+
+	// Never reach here
+	vTaskDelete(NULL);
+}
+
+// Hands a decoded packet to mqtt_pub_task
+static bool twai_enqueue(PACKET_t *item, const ElsterPacketReceive *packet)
+{
+	item->packet = *packet;
+	int64_t now = esp_timer_get_time();
+	// the last places are kept for the frames from the bus
+	if (item->replay && uxQueueSpacesAvailable(xQueue_mqtt_tx) <= REPLAY_HEADROOM) return false;
+	if (xQueueSend(xQueue_mqtt_tx, item, 0) != pdPASS) {
+		if (!item->replay) metrics_inc(METRIC_CAN_RX_DROPPED);
+		return false;
+	}
+	metrics_max(METRIC_Q_MQTT_TX_PEAK, uxQueueMessagesWaiting(xQueue_mqtt_tx));
+	trace_record(TRACE_ENQUEUE, item->trace, 0, now);
+	return true;
+}
+
+// Decodes a frame and dispatches the telegram to the request, poll, get
+// and write modules and to mqtt_pub_task. A replayed telegram only goes to
+// mqtt_pub_task, it must not touch the live state. Returns false if the
+// frame was of no use. *queued is 1 if a packet went to xQueue_mqtt_tx, -1 if it was
+// dropped because the queue was full, 0 if there was nothing to publish.
+static bool twai_rx_frame(const twai_message_t *rx_msg, int64_t rxTime, bool replay, int *queued)
+{
+	*queued = 0;
+	// not an Elster telegram
+	if (rx_msg->extd != 0 || rx_msg->rtr != 0 || rx_msg->data_length_code != 7) return false;
+
+	bool used = false;
+	// replayed frames would distort the latency of the received ones
+	PACKET_t item = { .trace = replay ? 0 : trace_frame(), .replay = replay };
+	ElsterPacketReceive packet = ElsterRawToReceivePacket((uint16_t)rx_msg->identifier, (uint8_t)rx_msg->data_length_code, rx_msg->data);
+	trace_record(TRACE_RX, item.trace, 0, rxTime);
+	trace_record(TRACE_DECODE, item.trace, 0, esp_timer_get_time());
+	if (packet.tableIndex != ELSTER_NO_TABLE_INDEX) {
+		DLOGD(DLOG_CAN_DECODED, packet.sender, packet.receiver, packet.packetType, packet.index, packet.tableIndex, packet.value);
+	}
+	if (replay) {
+		// the telegrams published when received, every value of them
+		used = packet.receiver == 0x680 && packet.packetType == ELSTER_PT_RESPONSE;
+#if CONFIG_WPM_BROADCAST_LISTENER
+		used = used || (packet.receiver == ELSTER_BROADCAST &&
+			(packet.packetType == ELSTER_PT_WRITE || packet.packetType == ELSTER_PT_RESPONSE));
+#endif
+		if (used && packet.tableIndex != ELSTER_NO_TABLE_INDEX) *queued = twai_enqueue(&item, &packet) ? 1 : -1;
+		return used;
+	}
+#if CONFIG_WPM_BROADCAST_LISTENER
+	if (packet.receiver == ELSTER_BROADCAST)
+	{
+		switch(packet.packetType)
+		{
+			case ELSTER_PT_WRITE:
+			case ELSTER_PT_RESPONSE:
+			{
+				used = true;
+				if (packet.tableIndex == ELSTER_NO_TABLE_INDEX) break;
+				item.answer = get_value(&packet);
+				// an unchanged broadcast defers the poll of its index too
+				poll_value(packet.sender, packet.index, packet.value, true);
+#if CONFIG_WPM_PUBLISH_ON_CHANGE
+				// a value asked for by wp/get is published anyway
+				if (!change_filter(&packet, item.answer)) break;
+#endif
+				// never block reception, mqtt_pub_task spools while the broker is away
+				*queued = twai_enqueue(&item, &packet) ? 1 : -1;
+				break;
+			}
+			default:
+			{
+				break;
+			}
+		}
+	}
+#endif
+	if (packet.receiver == 0x680)
+	{
+		switch(packet.packetType)
+		{
+			case ELSTER_PT_RESPONSE:
+			{
+				used = true;
+				if (!request_response(packet.sender, packet.index)) {
+					ESP_LOGD(TAG, "unrequested response 0x%x 0x%04x", packet.sender, packet.index);
+				}
+				write_response(&packet);
+				poll_value(packet.sender, packet.index, packet.value, false);
+				if (packet.tableIndex == ELSTER_NO_TABLE_INDEX) break;
+				item.answer = get_value(&packet);
+#if CONFIG_WPM_PUBLISH_ON_CHANGE
+				// a value asked for by wp/get is published anyway
+				if (!change_filter(&packet, item.answer)) break;
+#endif
+				// never block reception, mqtt_pub_task spools while the broker is away
+				*queued = twai_enqueue(&item, &packet) ? 1 : -1;
+				break;
+			}
+			default:
+			{
+				break;
+			}
+		}
+	}
+	return used;
+}
+
+#if CONFIG_WPM_REPLAY
+// Injects a recorded frame as if twai_receive() had returned it, for
+// replay.c. Returns *queued of twai_rx_frame().
+int twai_replay_frame(const twai_message_t *msg)
+{
+	int queued;
+	twai_rx_frame(msg, esp_timer_get_time(), true, &queued);
+	return queued;
+}
+#endif
+
 void twai_task(void *pvParameters)
 {
 	ESP_LOGI(TAG,"task start");
 
 	twai_message_t rx_msg;
-	twai_message_t tx_msg;
-	MQTT_t mqttBuf;
-	mqttBuf.topic_type = PUBLISH;
-
-	timerHndTwaiRequests = xTimerCreate(
-      "twaiTimer", /* name */
-      pdMS_TO_TICKS(CONFIG_WPM_REQUEST_PERIOD * 1000), /* period/time */
-      pdTRUE, /* auto reload */
-      (void*)0, /* timer ID */
-      vTimerCallbackTwaiExpired); /* callback */
-	xTimerStart(timerHndTwaiRequests, pdMS_TO_TICKS(3000));
 
 	while (1) {
-		esp_err_t ret = twai_receive(&rx_msg, pdMS_TO_TICKS(10));
+#if CONFIG_WPM_HW_FILTER
+		// wake up once a second to apply a changed filter
+		if (s_filterPending && esp_timer_get_time() >= s_filterRetry) twai_filter_apply();
+		esp_err_t ret = twai_receive(&rx_msg, pdMS_TO_TICKS(1000));
+		if (ret == ESP_ERR_TIMEOUT) continue;
+#else
+		esp_err_t ret = twai_receive(&rx_msg, portMAX_DELAY);
+#endif
 		if (ret == ESP_OK) {
+			int64_t rxTime = esp_timer_get_time();
 			ESP_LOGD(TAG,"twai_receive identifier=0x%"PRIx32" flags=0x%"PRIx32" data_length_code=%d",
 				rx_msg.identifier, rx_msg.flags, rx_msg.data_length_code);
 
-			//int ext = rx_msg.flags & 0x01; // flags is Deprecated
-			//int rtr = rx_msg.flags & 0x02; // flags is Deprecated
-			int ext = rx_msg.extd;
-			int rtr = rx_msg.rtr;
-			// ESP_LOGD(TAG, "ext=%x rtr=%x", ext, rtr);
-
-
 #if CONFIG_ENABLE_PRINT
-			if (ext == 0) {
-				printf("Standard ID: 0x%03"PRIx32"     ", rx_msg.identifier);
-			} else {
-				printf("Extended ID: 0x%08"PRIx32, rx_msg.identifier);
-			}
-			printf(" DLC: %d	Data: ", rx_msg.data_length_code);
-
-			if (rtr == 0) {
-				for (int i = 0; i < rx_msg.data_length_code; i++) {
-					printf("0x%02x ", rx_msg.data[i]);
-				}
-			} else {
-				printf("REMOTE REQUEST FRAME");
-
-			}
-			printf("\n");
+			// printed later by dlog_task, data big endian in two words
+			DLOGI(DLOG_CAN_FRAME, rx_msg.identifier, rx_msg.extd, rx_msg.rtr, rx_msg.data_length_code,
+				(uint32_t)rx_msg.data[0] << 24 | (uint32_t)rx_msg.data[1] << 16 | (uint32_t)rx_msg.data[2] << 8 | rx_msg.data[3],
+				(uint32_t)rx_msg.data[4] << 24 | (uint32_t)rx_msg.data[5] << 16 | (uint32_t)rx_msg.data[6] << 8 | rx_msg.data[7]);
 #endif
 
-			ElsterPacketReceive packet = ElsterRawToReceivePacket((uint16_t)rx_msg.identifier, (uint8_t)rx_msg.data_length_code, rx_msg.data);
-			if (packet.receiver == 0x680)
-			{
-				switch(packet.packetType)
-				{
-					case ELSTER_PT_RESPONSE:
-					{
-						strncpy(mqttBuf.topic, "wp/read/", 9);
-						strncpy(&mqttBuf.topic[8], packet.indexName, sizeof(mqttBuf.topic) - 8);
-						mqttBuf.data_len = strnlen(packet.value, sizeof(packet.value));
-						strncpy(mqttBuf.data, packet.value, sizeof(mqttBuf.data));
-						if (xQueueSend(xQueue_mqtt_tx, &mqttBuf, portMAX_DELAY) != pdPASS) {
-							ESP_LOGE(TAG, "xQueueSend Fail");
-						}
-						break;
-					}
-					default:
-					{
-						break;
-					}
-				}
-			}
-		} else if (ret == ESP_ERR_TIMEOUT) {
-			if (xQueueReceive(xQueue_twai_tx, &tx_msg, 0) == pdTRUE) {
-				ESP_LOGI(TAG, "tx_msg.identifier=[0x%"PRIx32"] tx_msg.extd=%d", tx_msg.identifier, tx_msg.extd);
-				twai_status_info_t status_info;
-				twai_get_status_info(&status_info);
-				ESP_LOGD(TAG, "status_info.state=%d",status_info.state);
-				if (status_info.state != TWAI_STATE_RUNNING) {
-					ESP_LOGE(TAG, "TWAI driver not running %d", status_info.state);
-					continue;
-				}
-				ESP_LOGD(TAG, "status_info.msgs_to_tx=%"PRIu32, status_info.msgs_to_tx);
-				ESP_LOGD(TAG, "status_info.msgs_to_rx=%"PRIu32, status_info.msgs_to_rx);
-				//esp_err_t ret = twai_transmit(&tx_msg, pdMS_TO_TICKS(10));
-				esp_err_t ret = twai_transmit(&tx_msg, 0);
-				if (ret == ESP_OK) {
-					ESP_LOGI(TAG, "twai_transmit success");
-				} else {
-					ESP_LOGE(TAG, "twai_transmit Fail %s", esp_err_to_name(ret));
-				}
+			metrics_inc(METRIC_CAN_RX);
+			metrics_add(METRIC_CAN_BITS, twai_frame_bits(&rx_msg));
+#if CONFIG_WPM_CAPTURE
+			// every frame, also those that are no Elster telegram
+			capture_frame(&rx_msg, rxTime);
+#endif
+			if (metrics_get(METRIC_CAN_RX) % 1000 == 0) {
+				ESP_LOGI(TAG, "rx received=%"PRIu32" used=%"PRIu32" rejected in software=%"PRIu32" dropped=%"PRIu32,
+					metrics_get(METRIC_CAN_RX), metrics_get(METRIC_CAN_RX_USED),
+					metrics_get(METRIC_CAN_RX_REJECTED), metrics_get(METRIC_CAN_RX_DROPPED));
 			}
 
+			int queued;
+			bool used = twai_rx_frame(&rx_msg, rxTime, false, &queued);
+			metrics_inc(used ? METRIC_CAN_RX_USED : METRIC_CAN_RX_REJECTED);
 		} else {
 			ESP_LOGE(TAG, "twai_receive Fail %s", esp_err_to_name(ret));
+			// no driver, do not starve the tasks below
+			vTaskDelay(pdMS_TO_TICKS(1000));
 		}
 	} // end while
 
@@ -0,0 +1,377 @@
+/*
+	Writes to the WPM with read-back confirmation, results on wp/write_result.
+
+	Every value being written has one entry that goes through
+
+	  SETTLE  the WRITE was sent ahead of all queued frames; the read-back
+	          waits CONFIG_WPM_WRITE_SETTLE_MS for the device to apply it.
+	          A WRITE dropped for a full transmit queue is sent again
+	          every CONFIG_WPM_WRITE_SETTLE_MS, the write is reported as
+	          busy if it did not go out within CONFIG_WPM_WRITE_TIMEOUT_MS.
+	  VERIFY  an urgent READ was sent; a response with the written value
+	          confirms the write, one with another value is remembered as
+	          mismatch until CONFIG_WPM_WRITE_TIMEOUT_MS has passed (the
+	          answer to a read sent before the write may still arrive).
+	          Without a free request slot the READ is tried again every
+	          CONFIG_WPM_WRITE_SETTLE_MS, if it never went out the write
+	          is reported as unverified.
+
+	and then publishes {"result":...,"value":...,"latency_ms":...} to
+	wp/write_result/<NAME>. Writes to a value that arrive meanwhile are not
+	sent: the latest one is kept and written next, the others are reported
+	as superseded. Like in request.c a one-shot timer runs to the earliest
+	deadline.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+
+#include "elster.h"
+#include "request.h"
+#include "mqtt_conn.h"
+#include "write.h"
+
+static const char *TAG = "WRITE";
+
+#define SETTLE_US  ((int64_t)CONFIG_WPM_WRITE_SETTLE_MS * 1000)
+#define TIMEOUT_US ((int64_t)CONFIG_WPM_WRITE_TIMEOUT_MS * 1000)
+
+typedef enum {
+	WRITE_IDLE,
+	WRITE_SETTLE,
+	WRITE_VERIFY
+} WRITE_STATE_t;
+
+typedef struct {
+	WRITE_STATE_t state;
+	uint16_t receiver;
+	uint16_t index;
+	uint8_t raw[7];      // WRITE telegram of the value being written
+	uint16_t expected;   // raw value the read-back has to return
+	bool seen;           // read back with another value
+	bool written;        // SETTLE: the WRITE was queued
+	bool readBack;       // VERIFY: the READ was sent
+	uint16_t seenValue;
+	bool hasNext;        // written when this one is done
+	uint32_t next;
+	int64_t started;     // WRITE queued
+	int64_t expires;     // VERIFY: given up then
+	int64_t deadline;
+} WRITE_t;
+
+// Outcome collected under s_mutex, published after releasing it
+typedef struct {
+	uint16_t index;
+	const char *result;
+	bool hasValue;
+	uint16_t value;
+	int64_t latency;
+} WRITE_RESULT_t;
+
+static WRITE_t s_writes[WRITE_MAX_PENDING];
+static WRITE_STATS_t s_stats;
+static SemaphoreHandle_t s_mutex;
+static TimerHandle_t s_timer;
+
+bool send_2_can_first(uint32_t canid, int16_t data_len, uint8_t const * const data);
+
+static void write_publish(const WRITE_RESULT_t *result)
+{
+	char name[ELSTER_NAME_LEN];
+	char topic[64];
+	char val[ELSTER_VALUE_LEN];
+	char data[128];
+	int tableIndex = GetElsterTableIndex(result->index);
+	ElsterPacketReceive packet = {
+		.index = result->index,
+		.value = result->value,
+		.tableIndex = tableIndex < 0 ? ELSTER_NO_TABLE_INDEX : tableIndex
+	};
+	snprintf(topic, sizeof(topic), "wp/write_result/%s", ElsterPacketName(&packet, name));
+	int len;
+	if (result->hasValue) {
+		ElsterPacketValue(&packet, val);
+		len = snprintf(data, sizeof(data), "{\"result\":\"%s\",\"value\":\"%s\",\"latency_ms\":%"PRId64"}",
+			result->result, val, result->latency / 1000);
+	} else {
+		len = snprintf(data, sizeof(data), "{\"result\":\"%s\",\"latency_ms\":%"PRId64"}",
+			result->result, result->latency / 1000);
+	}
+	ESP_LOGI(TAG, "TOPIC=[%s] DATA=[%s]", topic, data);
+	// called from the CAN and timer tasks, must not block on the network
+	mqtt_conn_enqueue(topic, data, len, 1, 0);
+}
+
+// Builds the WRITE telegram and the raw value a READ returns for it
+static void write_prepare(WRITE_t *w, uint32_t value)
+{
+	ElsterPacketSend pSet = { w->receiver, ELSTER_PT_WRITE, w->index };
+	memset(w->raw, 0, sizeof(w->raw));
+	ElsterPrepareSendPacket(7, w->raw, pSet);
+	ElsterSetValueDefault(7, w->raw, value);
+	// the first two value bytes, as getElsterRawValue() reads them
+	w->expected = w->raw[2] == 0xfa ? (w->raw[5] << 8) | w->raw[6] : (w->raw[3] << 8) | w->raw[4];
+}
+
+// Starts the write of value. Call with s_mutex held, then send w->raw.
+static void write_start(WRITE_t *w, uint32_t value, int64_t now)
+{
+	write_prepare(w, value);
+	w->state = WRITE_SETTLE;
+	w->seen = false;
+	w->written = true;
+	w->readBack = false;
+	w->started = now;
+	w->deadline = now + SETTLE_US;
+	s_stats.sent++;
+}
+
+// (Re)arms the one-shot timer to the earliest deadline. Call with s_mutex held.
+static void write_arm(int64_t now)
+{
+	int64_t earliest = INT64_MAX;
+	for (int i = 0; i < WRITE_MAX_PENDING; i++) {
+		if (s_writes[i].state != WRITE_IDLE && s_writes[i].deadline < earliest) {
+			earliest = s_writes[i].deadline;
+		}
+	}
+	if (earliest == INT64_MAX) {
+		xTimerStop(s_timer, 0);
+		return;
+	}
+	TickType_t ticks = pdMS_TO_TICKS((earliest - now + 999) / 1000);
+	xTimerChangePeriod(s_timer, ticks > 0 ? ticks : 1, 0);
+}
+
+// Ends the write with result and starts the next one if there is one.
+// Returns true if w->raw is to be sent. Call with s_mutex held.
+static bool write_finish(WRITE_t *w, WRITE_RESULT_t *result, const char *text, bool hasValue, uint16_t value, int64_t now)
+{
+	result->index = w->index;
+	result->result = text;
+	result->hasValue = hasValue;
+	result->value = value;
+	result->latency = now - w->started;
+	w->state = WRITE_IDLE;
+	if (!w->hasNext) return false;
+	w->hasNext = false;
+	write_start(w, w->next, now);
+	return true;
+}
+
+// Sends the WRITE telegram of s_writes[slot], sent as a copy taken under
+// s_mutex. Without room in the transmit queue it is sent again on the next
+// settle tick.
+static void write_send(int slot, const WRITE_t *sent)
+{
+	if (send_2_can_first(0x680, 7, sent->raw)) return;
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	WRITE_t *w = &s_writes[slot];
+	if (w->state == WRITE_SETTLE && w->started == sent->started && w->index == sent->index) {
+		w->written = false;
+	}
+	xSemaphoreGive(s_mutex);
+}
+
+static void vTimerCallbackWriteExpired(TimerHandle_t xTimer)
+{
+	WRITE_RESULT_t results[WRITE_MAX_PENDING];
+	int sendSlot[WRITE_MAX_PENDING];
+	WRITE_t send[WRITE_MAX_PENDING];
+	int verify[WRITE_MAX_PENDING];
+	WRITE_t verifying[WRITE_MAX_PENDING];
+	int nresults = 0, nsend = 0, nverify = 0;
+	int64_t now = esp_timer_get_time();
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i = 0; i < WRITE_MAX_PENDING; i++) {
+		WRITE_t *w = &s_writes[i];
+		if (w->state == WRITE_IDLE || w->deadline > now) continue;
+
+		if (w->state == WRITE_SETTLE && !w->written) {
+			if (now - w->started < TIMEOUT_US) {
+				w->written = true;
+				w->deadline = now + SETTLE_US;
+				sendSlot[nsend] = i;
+				send[nsend++] = *w;
+			} else {
+				s_stats.busy++;
+				ESP_LOGW(TAG, "0x%x 0x%04x not written, transmit queue full", w->receiver, w->index);
+				if (write_finish(w, &results[nresults++], "busy", false, 0, now)) {
+					sendSlot[nsend] = i;
+					send[nsend++] = *w;
+				}
+			}
+			continue;
+		}
+		if (w->state == WRITE_SETTLE) {
+			w->state = WRITE_VERIFY;
+			w->expires = now + TIMEOUT_US;
+		}
+		if (!w->readBack && now < w->expires) {
+			// sent below, taken back if there is no free request slot
+			w->readBack = true;
+			w->deadline = w->expires;
+			verify[nverify] = i;
+			verifying[nverify++] = *w;
+		} else {
+			const char *text;
+			if (w->seen) {
+				s_stats.mismatched++;
+				text = "mismatch";
+				ESP_LOGW(TAG, "0x%x 0x%04x read back 0x%04x instead of 0x%04x", w->receiver, w->index, w->seenValue, w->expected);
+			} else if (w->readBack) {
+				s_stats.timeouts++;
+				text = "timeout";
+				ESP_LOGW(TAG, "0x%x 0x%04x not read back", w->receiver, w->index);
+			} else {
+				s_stats.unverified++;
+				text = "unverified";
+				ESP_LOGW(TAG, "0x%x 0x%04x not read back, no free request slot", w->receiver, w->index);
+			}
+			if (write_finish(w, &results[nresults++], text, w->seen, w->seenValue, now)) {
+				sendSlot[nsend] = i;
+				send[nsend++] = *w;
+			}
+		}
+	}
+	write_arm(now);
+	xSemaphoreGive(s_mutex);
+
+	for (int i = 0; i < nsend; i++) {
+		write_send(sendSlot[i], &send[i]);
+	}
+	for (int i = 0; i < nverify; i++) {
+		const WRITE_t *v = &verifying[i];
+		if (request_read_urgent(v->receiver, v->index)) continue;
+		ESP_LOGD(TAG, "no free request slot for the read-back of 0x%04x", v->index);
+		// on the next settle tick again, unless it was answered meanwhile
+		xSemaphoreTake(s_mutex, portMAX_DELAY);
+		WRITE_t *w = &s_writes[verify[i]];
+		if (w->state == WRITE_VERIFY && w->started == v->started && w->index == v->index) {
+			w->readBack = false;
+			w->deadline = now + SETTLE_US < w->expires ? now + SETTLE_US : w->expires;
+			write_arm(esp_timer_get_time());
+		}
+		xSemaphoreGive(s_mutex);
+	}
+	for (int i = 0; i < nresults; i++) {
+		write_publish(&results[i]);
+	}
+}
+
+void write_init(void)
+{
+	s_mutex = xSemaphoreCreateMutex();
+	configASSERT( s_mutex );
+	s_timer = xTimerCreate("writeTimer", 1, pdFALSE, (void*)0, vTimerCallbackWriteExpired);
+	configASSERT( s_timer );
+	memset(s_writes, 0, sizeof(s_writes));
+	memset(&s_stats, 0, sizeof(s_stats));
+}
+
+void write_request(uint16_t receiver, uint16_t index, uint32_t value)
+{
+	int64_t now = esp_timer_get_time();
+	WRITE_RESULT_t result;
+	bool publish = false;
+	WRITE_t sent;
+	int slot = -1;
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	s_stats.requested++;
+	WRITE_t *w = NULL;
+	WRITE_t *idle = NULL;
+	for (int i = 0; i < WRITE_MAX_PENDING; i++) {
+		if (s_writes[i].state == WRITE_IDLE) {
+			if (idle == NULL) idle = &s_writes[i];
+		} else if (s_writes[i].receiver == receiver && s_writes[i].index == index) {
+			w = &s_writes[i];
+			break;
+		}
+	}
+	if (w != NULL) {
+		// last one wins
+		if (w->hasNext) {
+			s_stats.superseded++;
+			WRITE_t old = *w;
+			write_prepare(&old, w->next);
+			result = (WRITE_RESULT_t){ index, "superseded", true, old.expected, 0 };
+			publish = true;
+		}
+		w->hasNext = true;
+		w->next = value;
+	} else if (idle != NULL) {
+		idle->receiver = receiver;
+		idle->index = index;
+		idle->hasNext = false;
+		write_start(idle, value, now);
+		sent = *idle;
+		slot = idle - s_writes;
+		write_arm(now);
+	} else {
+		s_stats.busy++;
+		result = (WRITE_RESULT_t){ index, "busy", false, 0, 0 };
+		publish = true;
+	}
+	if (s_stats.requested % 20 == 0) {
+		ESP_LOGI(TAG, "requested=%"PRIu32" sent=%"PRIu32" confirmed=%"PRIu32" mismatched=%"PRIu32" timeouts=%"PRIu32" unverified=%"PRIu32" superseded=%"PRIu32" busy=%"PRIu32,
+			s_stats.requested, s_stats.sent, s_stats.confirmed, s_stats.mismatched, s_stats.timeouts, s_stats.unverified, s_stats.superseded, s_stats.busy);
+	}
+	xSemaphoreGive(s_mutex);
+
+	if (slot >= 0) {
+		ESP_LOGI(TAG, "write 0x%x 0x%04x", receiver, index);
+		write_send(slot, &sent);
+	}
+	if (publish) write_publish(&result);
+}
+
+void write_response(const ElsterPacketReceive *packet)
+{
+	int64_t now = esp_timer_get_time();
+	WRITE_RESULT_t result;
+	bool publish = false;
+	WRITE_t sent;
+	int slot = -1;
+
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	for (int i = 0; i < WRITE_MAX_PENDING; i++) {
+		WRITE_t *w = &s_writes[i];
+		if (w->state != WRITE_VERIFY || w->receiver != packet->sender || w->index != packet->index) continue;
+
+		if (packet->value == w->expected) {
+			s_stats.confirmed++;
+			publish = true;
+			if (write_finish(w, &result, "ok", true, packet->value, now)) {
+				sent = *w;
+				slot = i;
+			}
+			write_arm(now);
+		} else {
+			w->seen = true;
+			w->seenValue = packet->value;
+		}
+		break;
+	}
+	xSemaphoreGive(s_mutex);
+
+	if (slot >= 0) write_send(slot, &sent);
+	if (publish) write_publish(&result);
+}
+
+void write_get_stats(WRITE_STATS_t *stats)
+{
+	xSemaphoreTake(s_mutex, portMAX_DELAY);
+	*stats = s_stats;
+	xSemaphoreGive(s_mutex);
+}
@@ -0,0 +1,36 @@
+/*
+	Writes to the WPM with read-back confirmation, results on wp/write_result.
+
+	This code is in the Public Domain (or CC0 licensed, at your option.)
+*/
+
+#ifndef WRITE_H
+#define WRITE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "elster.h"
+
+#define WRITE_MAX_PENDING 8 // values with a write in progress
+
+typedef struct {
+	uint32_t requested;  // wp/write messages
+	uint32_t sent;       // WRITE telegrams put on the bus
+	uint32_t confirmed;  // read back as written
+	uint32_t mismatched; // read back with another value
+	uint32_t timeouts;   // no read-back within CONFIG_WPM_WRITE_TIMEOUT_MS
+	uint32_t unverified; // read-back never sent, no free request slot
+	uint32_t superseded; // replaced by a newer write before being sent
+	uint32_t busy;       // rejected, all WRITE_MAX_PENDING slots in use, or never left the full transmit queue
+} WRITE_STATS_t;
+
+void write_init(void);
+// Writes value (as returned by TranslateString()) to index of receiver and
+// publishes the outcome. While a write to the same value is in progress only
+// the latest further value is kept and written next.
+void write_request(uint16_t receiver, uint16_t index, uint32_t value);
+// Called for every response addressed to us.
+void write_response(const ElsterPacketReceive *packet);
+void write_get_stats(WRITE_STATS_t *stats);
+
+#endif
@@ -0,0 +1,44 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+#
+# Requests the latency trace of the gateway (CONFIG_WPM_TRACE) and prints
+# its records as CSV, one line per trace point. See TRACE_DUMP_HEADER_t and
+# TRACE_RECORD_t in main/trace.h for the format.
+#
+#   python trace_dump.py <broker> > trace.csv
+#
+# python -m pip install -U paho-mqtt
+
+import struct
+import sys
+
+import paho.mqtt.client as mqtt
+
+# MQTT Broker
+host = sys.argv[1] if len(sys.argv) > 1 else 'localhost'
+# MQTT Port
+port = 1883
+
+points = ['rx', 'decode', 'enqueue', 'dequeue', 'publish', 'ack']
+
+def on_connect(client, userdata, flags, respons_code):
+	client.subscribe('wp/sys/trace')
+	client.publish('wp/sys/trace/dump', '')
+
+def on_message(client, userdata, msg):
+	magic, version, size, count, lost, now = struct.unpack_from('<4sHHIIq', msg.payload)
+	if magic != b'WPTR' or version != 1:
+		sys.exit('not a trace dump')
+	sys.stderr.write('{} records, {} lost\n'.format(count, lost))
+	print('time_us,frame,point,msg_id')
+	for i in range(count):
+		time, frame, msg_id, point = struct.unpack_from('<qIHB', msg.payload, 24 + i * size)
+		print('{},{},{},{}'.format(time, frame, points[point] if point < len(points) else point, msg_id))
+	client.disconnect()
+
+if __name__=='__main__':
+	client = mqtt.Client(protocol=mqtt.MQTTv311)
+	client.on_connect = on_connect
+	client.on_message = on_message
+	client.connect(host, port=port, keepalive=60)
+	client.loop_forever()